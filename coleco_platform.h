@@ -2,12 +2,17 @@
 #include <vector>
 #include <functional>
 
+namespace TMS9918A
+{
+struct Background;
+};
+
 namespace PlatformInterface
 {
 
 enum EventType
 {
-    NONE, RESET, SPEED, QUIT, PAUSE, SAVE_VDP_STATE, DEBUG_VDP_WRITES, DUMP_SOME_AUDIO
+    NONE, RESET, SPEED, QUIT, PAUSE, REWIND, SAVE_VDP_STATE, DEBUG_VDP_WRITES, DUMP_SOME_AUDIO, SAVE_STATE, LOAD_STATE
 };
 
 struct Event {
@@ -30,7 +35,7 @@ uint8_t GetKeypadState(ControllerIndex controller);
 
 void Start(uint32_t& stereoU8SampleRate, size_t& preferredAudioBufferSizeBytes);
 void EnqueueStereoU8AudioSamples(uint8_t *buf, size_t sz);
-void Frame(const uint8_t* vdp_registers, const uint8_t* vdp_ram, uint8_t& vdp_status_result, float megahertz);  // update display, update events, and block to retrace
+void Frame(const uint8_t* vdp_registers, const uint8_t* vdp_ram, TMS9918A::Background& vdp_background, uint8_t& vdp_status_result, float megahertz);  // update display, update events, and block to retrace
 
 typedef std::function<uint8_t ()> MainLoopBodyFunc;
 void MainLoopAndShutdown(MainLoopBodyFunc body);
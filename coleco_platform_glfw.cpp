@@ -278,6 +278,9 @@ static void key(GLFWwindow *window, int key, int scancode, int action, int mods)
 
     if(action == GLFW_PRESS || action == GLFW_REPEAT ) {
         switch(key) {
+            case GLFW_KEY_BACKSPACE:
+                event_queue.push_back({REWIND, 1});
+                break;
             case GLFW_KEY_RIGHT_SHIFT:
             case GLFW_KEY_LEFT_SHIFT:
                 shift_pressed = true;
@@ -350,6 +353,15 @@ static void key(GLFWwindow *window, int key, int scancode, int action, int mods)
             case GLFW_KEY_N:
                 event_queue.push_back({DEBUG_VDP_WRITES, 0});
                 break;
+            case GLFW_KEY_F5:
+                event_queue.push_back({SAVE_STATE, 0});
+                break;
+            case GLFW_KEY_F9:
+                event_queue.push_back({LOAD_STATE, 0});
+                break;
+            case GLFW_KEY_BACKSPACE:
+                event_queue.push_back({REWIND, 0});
+                break;
             case GLFW_KEY_R:
                 event_queue.push_back({RESET, 0});
                 break;
@@ -624,14 +636,13 @@ void Start(uint32_t& stereoU8SampleRate, size_t& preferredAudioBufferSizeBytes)
      previous_event_time = previous_draw_time = std::chrono::system_clock::now();
 }
 
-void Frame(const uint8_t* vdp_registers, const uint8_t* vdp_ram, uint8_t& vdp_status_result, [[maybe_unused]] float megahertz)
+void Frame(const uint8_t* vdp_registers, const uint8_t* vdp_ram, TMS9918A::Background& vdp_background, uint8_t& vdp_status_result, [[maybe_unused]] float megahertz)
 {
-    auto pixel_setter = [](int x, int y, uint8_t color) {
-        uint8_t *pixel = framebuffer + 4 * (x + y * TMS9918A::SCREEN_X);
-        TMS9918A::CopyColor(pixel, TMS9918A::Colors[color]);
+    auto row_setter = [](int row, const uint8_t* row_colors) {
+        TMS9918A::ConvertRowToRGBX8(row_colors, framebuffer + 4 * row * TMS9918A::SCREEN_X);
     };
 
-    vdp_status_result = TMS9918A::CreateImageAndReturnFlags(vdp_registers, vdp_ram, pixel_setter);
+    vdp_status_result = vdp_background.create_rows_and_return_flags(vdp_registers, vdp_ram, row_setter);
 
     std::chrono::time_point<std::chrono::system_clock> now = std::chrono::system_clock::now();
     std::chrono::duration<float> elapsed;
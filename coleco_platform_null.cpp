@@ -0,0 +1,132 @@
+#include <deque>
+#include <cstring>
+
+#include "coleco_platform_null.h"
+
+#include "tms9918.h"
+
+namespace PlatformInterface
+{
+
+std::deque<Event> event_queue;
+
+bool EventIsWaiting()
+{
+    return event_queue.size() > 0;
+}
+
+Event DequeueEvent()
+{
+    if(EventIsWaiting()) {
+        Event e = event_queue.front();
+        event_queue.pop_front();
+        return e;
+    } else
+        return {NONE, 0};
+}
+
+void EnqueueEvent(const Event& event)
+{
+    event_queue.push_back(event);
+}
+
+uint8_t controller_1_joystick_state = 0;
+uint8_t controller_2_joystick_state = 0;
+uint8_t controller_1_keypad_state = 0;
+uint8_t controller_2_keypad_state = 0;
+
+void SetControllerState(ControllerIndex controller, uint8_t joystick_pressed, uint8_t keypad_pressed)
+{
+    switch(controller) {
+        case CONTROLLER_1:
+            controller_1_joystick_state = joystick_pressed;
+            controller_1_keypad_state = keypad_pressed;
+            break;
+        case CONTROLLER_2:
+            controller_2_joystick_state = joystick_pressed;
+            controller_2_keypad_state = keypad_pressed;
+            break;
+    }
+}
+
+uint8_t GetJoystickState(ControllerIndex controller)
+{
+    uint8_t data = 0x7F;
+    switch(controller) {
+        case CONTROLLER_1:
+            data = (~controller_1_joystick_state) & 0x7F;
+            break;
+        case CONTROLLER_2:
+            data = (~controller_2_joystick_state) & 0x7F;
+            break;
+    }
+    return data;
+}
+
+uint8_t GetKeypadState(ControllerIndex controller)
+{
+    uint8_t data = 0x7F;
+    switch(controller) {
+        case CONTROLLER_1:
+            data = (~controller_1_keypad_state) & 0x7F;
+            break;
+        case CONTROLLER_2:
+            data = (~controller_2_keypad_state) & 0x7F;
+            break;
+    }
+    return data;
+}
+
+// Without a sink, audio is generated at the rate of the terminal build, so
+// that both run the sound chip the same way, and dropped
+uint32_t audio_sample_rate = 11050;
+std::function<void (const uint8_t *buf, size_t sz)> audio_sink;
+
+void SetAudioSink(uint32_t sample_rate, std::function<void (const uint8_t *buf, size_t sz)> sink)
+{
+    audio_sample_rate = sample_rate;
+    audio_sink = sink;
+}
+
+void EnqueueStereoU8AudioSamples(uint8_t *buf, size_t sz)
+{
+    if(audio_sink) {
+        audio_sink(buf, sz);
+    }
+}
+
+uint8_t *frame_capture = nullptr;
+
+void SetFrameCapture(uint8_t *color_indices)
+{
+    frame_capture = color_indices;
+}
+
+void Start(uint32_t& stereoU8SampleRate, size_t& preferredAudioBufferSizeBytes)
+{
+    stereoU8SampleRate = audio_sample_rate;
+    preferredAudioBufferSizeBytes = audio_sample_rate * 2 / 100;
+}
+
+void Frame(const uint8_t* vdp_registers, const uint8_t* vdp_ram, TMS9918A::Background& vdp_background, uint8_t& vdp_status_result, [[maybe_unused]] float megahertz)
+{
+    if(frame_capture) {
+        auto row_setter = [](int row, const uint8_t *row_colors) {
+            memcpy(frame_capture + row * TMS9918A::SCREEN_X, row_colors, TMS9918A::SCREEN_X);
+        };
+        vdp_status_result = vdp_background.create_rows_and_return_flags(vdp_registers, vdp_ram, row_setter);
+    } else {
+        vdp_status_result = TMS9918A::GetStatusFromSpriteConfiguration(vdp_registers, vdp_ram);
+    }
+}
+
+void MainLoopAndShutdown(MainLoopBodyFunc body)
+{
+    bool quit_requested = false;
+    while(!quit_requested)
+    {
+        quit_requested = body();
+    }
+}
+
+};
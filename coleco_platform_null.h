@@ -0,0 +1,34 @@
+#ifndef _COLECO_PLATFORM_NULL_H_
+#define _COLECO_PLATFORM_NULL_H_
+
+#include <cstdint>
+#include <functional>
+
+#include "coleco_platform.h"
+
+// The headless platform (coleco_platform_null.cpp, built as emulator_null)
+// opens no window and starts no thread.  Controllers only change through
+// recordings played back by the emulator or through these calls, frames are
+// only drawn into a buffer given here, and audio is dropped unless a sink is
+// given here.
+
+namespace PlatformInterface
+{
+
+// Set the joystick and keypad bits of "controller" that are pressed, the
+// complement of what GetJoystickState and GetKeypadState then return
+void SetControllerState(ControllerIndex controller, uint8_t joystick_pressed, uint8_t keypad_pressed);
+
+// Draw each following frame into "color_indices", TMS9918A::SCREEN_X by
+// TMS9918A::SCREEN_Y TMS9918A color indices, or stop drawing if nullptr
+void SetFrameCapture(uint8_t *color_indices);
+
+// Hand audio at "sample_rate" to "sink" instead of dropping it; only
+// effective before Start
+void SetAudioSink(uint32_t sample_rate, std::function<void (const uint8_t *buf, size_t sz)> sink);
+
+void EnqueueEvent(const Event& event);
+
+};
+
+#endif /* _COLECO_PLATFORM_NULL_H_ */
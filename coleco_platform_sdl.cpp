@@ -207,6 +207,9 @@ static void HandleEvents(void)
 
             case SDL_KEYDOWN:
                 switch (event.key.keysym.scancode) {
+                    case SDL_SCANCODE_BACKSPACE:
+                        event_queue.push_back({REWIND, 1});
+                        break;
                     case SDL_SCANCODE_RSHIFT:
                     case SDL_SCANCODE_LSHIFT:
                         shift_pressed = true;
@@ -279,6 +282,15 @@ static void HandleEvents(void)
                     case SDL_SCANCODE_N:
                         event_queue.push_back({DEBUG_VDP_WRITES, 0});
                         break;
+                    case SDL_SCANCODE_F5:
+                        event_queue.push_back({SAVE_STATE, 0});
+                        break;
+                    case SDL_SCANCODE_F9:
+                        event_queue.push_back({LOAD_STATE, 0});
+                        break;
+                    case SDL_SCANCODE_BACKSPACE:
+                        event_queue.push_back({REWIND, 0});
+                        break;
                     case SDL_SCANCODE_R:
                         event_queue.push_back({RESET, 0});
                         break;
@@ -344,7 +356,7 @@ static void HandleEvents(void)
     }
 }
 
-void Frame(const uint8_t* vdp_registers, const uint8_t* vdp_ram, uint8_t& vdp_status_result, [[maybe_unused]] float megahertz)
+void Frame(const uint8_t* vdp_registers, const uint8_t* vdp_ram, TMS9918A::Background& vdp_background, uint8_t& vdp_status_result, [[maybe_unused]] float megahertz)
 {
     using namespace std::chrono_literals;
 
@@ -352,16 +364,11 @@ void Frame(const uint8_t* vdp_registers, const uint8_t* vdp_ram, uint8_t& vdp_st
 
     uint8_t* framebuffer = reinterpret_cast<uint8_t*>(surface->pixels);
 
-    auto pixel_setter = [framebuffer](int x, int y, uint8_t color) {
-        uint8_t *pixel = framebuffer + 3 * (x + y * TMS9918A::SCREEN_X);
-        uint8_t rgb[3];
-        TMS9918A::CopyColor(rgb, TMS9918A::Colors[color]);
-        pixel[0] = rgb[2];
-        pixel[1] = rgb[1];
-        pixel[2] = rgb[0];
+    auto row_setter = [framebuffer](int row, const uint8_t* row_colors) {
+        TMS9918A::ConvertRowToBGR8(row_colors, framebuffer + 3 * row * TMS9918A::SCREEN_X);
     };
 
-    vdp_status_result = TMS9918A::CreateImageAndReturnFlags(vdp_registers, vdp_ram, pixel_setter);
+    vdp_status_result = vdp_background.create_rows_and_return_flags(vdp_registers, vdp_ram, row_setter);
 
     if (SDL_MUSTLOCK(surface)) SDL_UnlockSurface(surface);
 
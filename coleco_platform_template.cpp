@@ -1,6 +1,7 @@
 #include <deque>
 #include <thread>
 #include <chrono>
+#include <cstring>
 
 #include "coleco_platform.h"
 
@@ -255,18 +256,17 @@ void display_frame()
     }
 }
 
-void Frame(const uint8_t* vdp_registers, const uint8_t* vdp_ram, uint8_t& vdp_status_result, [[maybe_unused]] float megahertz)
+void Frame(const uint8_t* vdp_registers, const uint8_t* vdp_ram, TMS9918A::Background& vdp_background, uint8_t& vdp_status_result, [[maybe_unused]] float megahertz)
 {
     using namespace std::chrono_literals;
 
-    auto pixel_setter = [](int x, int y, uint8_t color) {
-        uint8_t *pixel = framebuffer + 3 * (x + y * TMS9918A::SCREEN_X);
-        TMS9918A::CopyColor(pixel, TMS9918A::Colors[color]);
+    auto row_setter = [](int row, const uint8_t* row_colors) {
+        TMS9918A::ConvertRowToRGB8(row_colors, framebuffer + 3 * row * TMS9918A::SCREEN_X);
     };
 
     if(display_screen) {
 
-        vdp_status_result = TMS9918A::CreateImageAndReturnFlags(vdp_registers, vdp_ram, pixel_setter);
+        vdp_status_result = vdp_background.create_rows_and_return_flags(vdp_registers, vdp_ram, row_setter);
 
         if(frameCount++ % 10 == 0) {
             // printf("\033[H");
@@ -0,0 +1,56 @@
+#ifndef _COMPILED_ROM_H_
+#define _COMPILED_ROM_H_
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+#include "z80emu.h"
+
+// Blocks of a BIOS and cartridge pair compiled to C++ ahead of time by
+// romcompile.  Each generated translation unit registers its table at
+// startup, and the emulator hands the blocks to the z80emu block cache when
+// the hashes of the ROMs it loaded match.  Blocks not in the table, and
+// computed jumps into code that was not traced, are still interpreted.
+
+struct CompiledROM
+{
+    uint64_t bios_hash;
+    uint64_t cartridge_hash;
+    const Z80_COMPILED_BLOCK *blocks;   // sorted by address
+    int count;
+};
+
+// FNV-1a, over the ROM image as read from its file
+inline uint64_t HashROM(const uint8_t *bytes, size_t length)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for(size_t i = 0; i < length; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+inline std::vector<const CompiledROM*>& CompiledROMs()
+{
+    static std::vector<const CompiledROM*> roms;
+    return roms;
+}
+
+inline bool RegisterCompiledROM(const CompiledROM *rom)
+{
+    CompiledROMs().push_back(rom);
+    return true;
+}
+
+inline const CompiledROM *FindCompiledROM(uint64_t bios_hash, uint64_t cartridge_hash)
+{
+    for(const CompiledROM *rom: CompiledROMs()) {
+        if((rom->bios_hash == bios_hash) && (rom->cartridge_hash == cartridge_hash)) {
+            return rom;
+        }
+    }
+    return nullptr;
+}
+
+#endif /* _COMPILED_ROM_H_ */
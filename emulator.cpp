@@ -12,17 +12,28 @@
 #include <set>
 #include <unordered_set>
 #include <deque>
+#include <algorithm>
+#include <limits>
 #include <array>
 #include <thread>
 #include <memory>
+#include <mutex>
+#include <type_traits>
 
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #define ENABLE_AUTOMATION
 
+// Headless builds (emulator_null in the Makefile) have no terminal for the
+// debugger and don't link readline
+#ifndef HEADLESS
 #define PROVIDE_DEBUGGER
+#endif
 
 #ifdef PROVIDE_DEBUGGER
 #include <signal.h>
@@ -33,6 +44,7 @@
 
 #include "z80user.h"
 #include "z80emu.h"
+#include "compiled_rom.h"
 
 #include "coleco_platform.h"
 #include "tms9918.h"
@@ -88,25 +100,151 @@ struct RAMboard
     { }
 };
 
+// A ROM image mapped read-only from its file, so that even large cartridges
+// load at once.  The mapping is padded with zeros to whole MegaCart banks, and
+// so to whole pages, so that the tail of a short ROM reads as 0, as unmapped
+// memory does.
+struct ROMImage
+{
+    size_t length;              // of the file
+    size_t mapped_length;
+    uint8_t *bytes;
+    uint64_t hash;              // HashROM() of the file
+    struct stat file_status;    // when it was mapped
+    ROMImage(int fd, const struct stat& st) :
+        length(st.st_size),
+        mapped_length((length + CV_BANK_SIZE - 1) & ~(size_t)(CV_BANK_SIZE - 1)),
+        bytes(nullptr),
+        hash(0),
+        file_status(st)
+    {
+        // Zeros first, then the file over them
+        void *mapping = mmap(nullptr, mapped_length, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(mapping == MAP_FAILED) {
+            return;
+        }
+        if(mmap(mapping, length, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+            munmap(mapping, mapped_length);
+            return;
+        }
+        bytes = static_cast<uint8_t*>(mapping);
+        hash = HashROM(bytes, length);
+    }
+    ~ROMImage()
+    {
+        if(bytes) {
+            munmap(bytes, mapped_length);
+        }
+    }
+    bool is_file(const struct stat& st) const
+    {
+        return (st.st_dev == file_status.st_dev) && (st.st_ino == file_status.st_ino) &&
+            (st.st_size == file_status.st_size) && (st.st_mtime == file_status.st_mtime);
+    }
+    ROMImage(const ROMImage&) = delete;
+    ROMImage& operator=(const ROMImage&) = delete;
+};
+
+// Every emulator in the process using a ROM shares one ROMImage of it, which
+// is unmapped when the last one lets it go.  Images are found by path, as long
+// as the file is unchanged, and then by content, looked up by hash, so that
+// copies of a ROM under other names share the mapping too.
+class ROMRegistry
+{
+    static std::mutex mutex;
+    static std::map<std::string, std::weak_ptr<const ROMImage>> by_path;
+    static std::unordered_map<uint64_t, std::weak_ptr<const ROMImage>> by_hash;
+
+    // Drop the entries of images that have been unmapped, so that a process
+    // loading many ROMs in turn only keeps those still in use
+    template <typename Map>
+    static void ForgetExpired(Map& images)
+    {
+        for(auto it = images.begin(); it != images.end(); ) {
+            if(it->second.expired()) {
+                it = images.erase(it);
+            } else {
+                it++;
+            }
+        }
+    }
+
+public:
+    // Returns NULL if the file can't be opened, is empty, or can't be mapped.
+    static std::shared_ptr<const ROMImage> Acquire(const char *path)
+    {
+        std::scoped_lock lock(mutex);
+
+        int fd = open(path, O_RDONLY);
+        if(fd < 0) {
+            return nullptr;
+        }
+        struct stat st;
+        if((fstat(fd, &st) != 0) || (st.st_size <= 0)) {
+            close(fd);
+            return nullptr;
+        }
+
+        std::shared_ptr<const ROMImage> image = by_path[path].lock();
+        if(image && image->is_file(st)) {
+            close(fd);
+            return image;
+        }
+
+        ForgetExpired(by_path);
+        ForgetExpired(by_hash);
+
+        image = std::make_shared<const ROMImage>(fd, st);
+        close(fd);
+        if(image->bytes == nullptr) {
+            return nullptr;
+        }
+        // The hash only finds a candidate: a file colliding with a live image
+        // keeps its own mapping and leaves the live image's entry alone
+        std::shared_ptr<const ROMImage> same = by_hash[image->hash].lock();
+        if(same && (same->length == image->length) && (memcmp(same->bytes, image->bytes, image->length) == 0)) {
+            image = same;
+        } else if(!same) {
+            by_hash[image->hash] = image;
+        }
+        by_path[path] = image;
+        return image;
+    }
+};
+
+std::mutex ROMRegistry::mutex;
+std::map<std::string, std::weak_ptr<const ROMImage>> ROMRegistry::by_path;
+std::unordered_map<uint64_t, std::weak_ptr<const ROMImage>> ROMRegistry::by_hash;
+
 struct ROMboard
 {
     uint16_t base;
-    uint16_t length;
-    std::vector<uint8_t> bytes;
-    ROMboard(uint16_t base_, uint16_t length_, uint8_t *bytes_) : 
+    std::shared_ptr<const ROMImage> image;  // NULL if the file could not be mapped
+    size_t length;
+    size_t padded_length;                   // to whole pages
+    uint8_t *bytes;
+    ROMboard(uint16_t base_, const char *name) :
         base(base_),
-        length(length_),
-        bytes(bytes_, bytes_ + length)
-    {
-    }
+        image(ROMRegistry::Acquire(name)),
+        length(image ? image->length : 0),
+        padded_length((length + CV_PAGE_SIZE - 1) & ~CV_PAGE_OFFSET_MASK),
+        bytes(image ? image->bytes : nullptr)
+    { }
 };
 
+// Larger cartridges are MegaCarts, of at most as many banks as there are
+// addresses selecting them.
+static constexpr size_t MAXIMUM_CARTRIDGE_LENGTH = 0x8000;
+static constexpr size_t MAXIMUM_MEGACART_LENGTH = (0x10000 - CV_BANK_SELECT) * CV_BANK_SIZE;
+
 bool quit_requested = false;
 bool enter_debugger = false; 
 
 static constexpr clk_t machine_clock_rate = 3579545;
 static constexpr uint32_t slice_frequency_times_1000 = 58000; // 59809; // 59940;
 static constexpr uint32_t clocks_per_retrace = (machine_clock_rate * 1000 + slice_frequency_times_1000 / 2 - 1)/ slice_frequency_times_1000;
+static constexpr clk_t audio_batch_clocks = 10000;
+static constexpr clk_t debugger_checkpoint_clocks = 10000;
 
 static constexpr uint32_t DEBUG_NONE = 0x00;
 [[maybe_unused]] static constexpr uint32_t DEBUG_ROM = 0x01; // Needs to be passed over to z80emu
@@ -134,7 +272,62 @@ void print_state(Z80_STATE* state)
         state->pc);
 }
 
-typedef std::function<uint8_t (const uint8_t *registers, const uint8_t *memory)> tms9918_scanout_func;
+// Machine state is saved as the raw bytes of its fields, in the host's byte
+// order, so it is only read back by the same build on the same kind of host.
+struct StateWriter
+{
+    std::vector<uint8_t> bytes;
+
+    template <typename T>
+    void write(const T& value)
+    {
+        static_assert(std::is_trivially_copyable_v<T>);
+        const uint8_t *p = reinterpret_cast<const uint8_t*>(&value);
+        bytes.insert(bytes.end(), p, p + sizeof(T));
+    }
+
+    void write_bytes(const uint8_t *data, size_t count)
+    {
+        bytes.insert(bytes.end(), data, data + count);
+    }
+};
+
+struct StateReader
+{
+    const uint8_t *bytes;
+    size_t size;
+    size_t offset{0};
+    bool failed{false};         // set by reading past the end
+
+    StateReader(const uint8_t *bytes, size_t size) :
+        bytes(bytes),
+        size(size)
+    { }
+
+    template <typename T>
+    void read(T& value)
+    {
+        static_assert(std::is_trivially_copyable_v<T>);
+        if(failed || (size - offset < sizeof(T))) {
+            failed = true;
+            return;
+        }
+        memcpy(&value, bytes + offset, sizeof(T));
+        offset += sizeof(T);
+    }
+
+    void read_bytes(uint8_t *data, size_t count)
+    {
+        if(failed || (size - offset < count)) {
+            failed = true;
+            return;
+        }
+        memcpy(data, bytes + offset, count);
+        offset += count;
+    }
+};
+
+typedef std::function<uint8_t (const uint8_t *registers, const uint8_t *memory, TMS9918A::Background& background)> tms9918_scanout_func;
 typedef std::function<void (uint8_t *audiobuffer, size_t dist)> audio_flush_func;
 
 struct SN76489A
@@ -194,6 +387,41 @@ struct SN76489A
         noise_flipflop = 0;
     }
 
+    // Everything but the configuration and the audio not yet flushed
+    void save_state(StateWriter& out) const
+    {
+        out.write(cmd_latched);
+        out.write(tone_lengths);
+        out.write(tone_attenuation);
+        out.write(noise_config);
+        out.write(noise_length);
+        out.write(noise_length_id);
+        out.write(noise_attenuation);
+        out.write(tone_counters);
+        out.write(tone_bit);
+        out.write(noise_counter);
+        out.write(noise_register);
+        out.write(noise_flipflop);
+        out.write(previous_clock);
+    }
+
+    void load_state(StateReader& in)
+    {
+        in.read(cmd_latched);
+        in.read(tone_lengths);
+        in.read(tone_attenuation);
+        in.read(noise_config);
+        in.read(noise_length);
+        in.read(noise_length_id);
+        in.read(noise_attenuation);
+        in.read(tone_counters);
+        in.read(tone_bit);
+        in.read(noise_counter);
+        in.read(noise_register);
+        in.read(noise_flipflop);
+        in.read(previous_clock);
+    }
+
     SN76489A(uint32_t clock_rate, uint32_t stereo_u8_sample_rate, size_t audio_buffer_size_bytes) :
         clock_rate(clock_rate),
         stereo_u8_sample_rate(stereo_u8_sample_rate),
@@ -377,6 +605,10 @@ struct TMS9918AEmulator
     uint8_t cmd_data = 0x0;
     uint16_t read_address = 0x0;
     uint16_t write_address = 0x0;
+    uint32_t register_writes{0};
+
+    // Not part of the state; drawn again in full after loading one
+    TMS9918A::Background background;
 
     uint32_t& interrupt_status; /* uint32_t for interop with C */
 
@@ -390,6 +622,40 @@ struct TMS9918AEmulator
     {
         std::fill(registers.begin(), registers.end(), 0);
         std::fill(memory.begin(), memory.end(), 0);
+        background.everything_written();
+    }
+
+    void save_state(StateWriter& out) const
+    {
+        out.write(cmd_started_in_nmi);
+        out.write(frame_number);
+        out.write(write_number);
+        out.write(memory);
+        out.write(registers);
+        out.write(status_register);
+        out.write(cmd_phase);
+        out.write(cmd_data);
+        out.write(read_address);
+        out.write(write_address);
+        out.write(register_writes);
+        out.write(interrupt_status);
+    }
+
+    void load_state(StateReader& in)
+    {
+        in.read(cmd_started_in_nmi);
+        in.read(frame_number);
+        in.read(write_number);
+        in.read(memory);
+        in.read(registers);
+        in.read(status_register);
+        in.read(cmd_phase);
+        in.read(cmd_data);
+        in.read(read_address);
+        in.read(write_address);
+        in.read(register_writes);
+        in.read(interrupt_status);
+        background.everything_written();
     }
 
     void clear_status_register_bits(uint8_t b)
@@ -410,6 +676,7 @@ struct TMS9918AEmulator
     {
         using namespace TMS9918A;
         registers[which_register] = cmd_data;
+        register_writes++;
         interrupt_status = InterruptsAreEnabled(registers.data()) && VSyncInterruptHasOccurred(status_register);
     }
 
@@ -426,14 +693,11 @@ struct TMS9918AEmulator
         if(do_save_images_on_vdp_write) { /* debug */
 
             uint8_t framebuffer[SCREEN_X * SCREEN_Y * 3];
-            auto pixel_setter = [&framebuffer](int x, int y, uint8_t color) {
-                uint8_t *pixel = framebuffer + 3 * (x + y * SCREEN_X) + 0;
-                uint8_t rgb[3];
-                CopyColor(rgb, Colors[color]);
-                SetColor(pixel, rgb[0], rgb[1], rgb[2]);
+            auto row_setter = [&framebuffer](int row, const uint8_t* row_colors) {
+                ConvertRowToRGB8(row_colors, framebuffer + 3 * row * SCREEN_X);
             };
 
-            CreateImageAndReturnFlags(registers.data(), memory.data(), pixel_setter);
+            CreateRowsAndReturnFlags(registers.data(), memory.data(), row_setter);
             char name[512];
             sprintf(name, "frame_%04" PRIu32 "_%05" PRIu32 "_%d_%02X.ppm", frame_number, write_number, cmd, data);
             FILE *fp = fopen(name, "wb");
@@ -497,12 +761,54 @@ struct TMS9918AEmulator
                 }
             }
             memory[write_address] = data;
+            background.memory_written(write_address);
             write_address = (write_address + 1) % MEMORY_SIZE;
             cmd_phase = CMD_PHASE_FIRST; // https://github.com/cbmeeks/TMS9918/blob/master/tms9918a.txt
         }
 
     }
 
+    // Same as "count" data writes, with write_address wrapping around VRAM
+    void write_block(const uint8_t *data, size_t count)
+    {
+        if(count == 0) {
+            return;
+        }
+        if((debug & DEBUG_VDP_OPERATIONS) || do_save_images_on_vdp_write) {
+            for(size_t i = 0; i < count; i++) {
+                write(0, data[i]);
+            }
+            return;
+        }
+
+        write_number += count;
+        while(count > 0) {
+            size_t chunk = std::min(count, (size_t)(MEMORY_SIZE - write_address));
+            std::copy(data, data + chunk, memory.begin() + write_address);
+            background.memory_written(write_address, chunk);
+            write_address = (write_address + chunk) % MEMORY_SIZE;
+            data += chunk;
+            count -= chunk;
+        }
+        cmd_phase = CMD_PHASE_FIRST;
+    }
+
+    // Same as "count" data reads, with read_address wrapping around VRAM
+    void read_block(uint8_t *data, size_t count)
+    {
+        if(count == 0) {
+            return;
+        }
+        while(count > 0) {
+            size_t chunk = std::min(count, (size_t)(MEMORY_SIZE - read_address));
+            std::copy(memory.begin() + read_address, memory.begin() + read_address + chunk, data);
+            read_address = (read_address + chunk) % MEMORY_SIZE;
+            data += chunk;
+            count -= chunk;
+        }
+        cmd_phase = CMD_PHASE_FIRST;
+    }
+
     uint8_t read(uint8_t cmd)
     {
         using namespace TMS9918A;
@@ -535,7 +841,7 @@ struct TMS9918AEmulator
             printf("scanout frame %" PRIu32 "\n", frame_number);
         }
 
-        uint8_t scanout_status_set = scanout(registers.data(), memory.data());
+        uint8_t scanout_status_set = scanout(registers.data(), memory.data(), background);
         set_status_register_bits(scanout_status_set);
     }
 };
@@ -633,6 +939,43 @@ struct ColecoHW
         return false;
     }
 
+    // Same as "count" calls to io_write, in one go for the VDP's data port
+    bool io_write_block(uint8_t addr, const uint8_t *data, int count)
+    {
+        if((addr >= 0xA0) && (addr <= 0xBF) && !(addr & 0x1)) {
+            vdp.write_block(data, count);
+#ifdef PROVIDE_DEBUGGER
+            io_writes.insert({addr, data[0]});
+#endif
+            return true;
+        }
+
+        bool accepted = true;
+        for(int i = 0; i < count; i++) {
+            accepted = io_write(addr, data[i]) && accepted;
+        }
+        return accepted;
+    }
+
+    // Same as "count" calls to io_read, in one go for the VDP's data port
+    bool io_read_block(uint8_t addr, uint8_t *data, int count)
+    {
+        if((addr >= 0xA0) && (addr <= 0xBF) && !(addr & 0x1)) {
+            if(debug & DEBUG_IO) printf("read VDP 0x%02X %d times\n", addr, count);
+            vdp.read_block(data, count);
+#ifdef PROVIDE_DEBUGGER
+            io_reads.insert(addr);
+#endif
+            return true;
+        }
+
+        bool served = true;
+        for(int i = 0; i < count; i++) {
+            served = io_read(addr, data[i]) && served;
+        }
+        return served;
+    }
+
     bool io_read(uint8_t addr, uint8_t &data)
     {
         if(false) {
@@ -689,6 +1032,20 @@ struct ColecoHW
         sound.reset();
     }
 
+    void save_state(StateWriter& out) const
+    {
+        vdp.save_state(out);
+        sound.save_state(out);
+        out.write(reading_joystick);
+    }
+
+    void load_state(StateReader& in)
+    {
+        vdp.load_state(in);
+        sound.load_state(in);
+        in.read(reading_joystick);
+    }
+
     void fill_flush_audio(clk_t clk, audio_flush_func stereo_audio_flush)
     {
         sound.generate_audio(clk, stereo_audio_flush);
@@ -1138,14 +1495,11 @@ bool debugger_image(Debugger *d, Z80_STATE* state, int argc, char **argv)
 
     // XXX
     uint8_t framebuffer[SCREEN_X * SCREEN_Y * 3];
-    auto pixel_setter = [&framebuffer](int x, int y, uint8_t color) {
-        uint8_t *pixel = framebuffer + 3 * (x + y * SCREEN_X) + 0;
-        uint8_t rgb[3];
-        CopyColor(rgb, Colors[color]);
-        SetColor(pixel, rgb[0], rgb[1], rgb[2]);
+    auto row_setter = [&framebuffer](int row, const uint8_t* row_colors) {
+        ConvertRowToRGB8(row_colors, framebuffer + 3 * row * SCREEN_X);
     };
     std::chrono::time_point<std::chrono::system_clock> start_time = std::chrono::system_clock::now();
-    CreateImageAndReturnFlags(vdp.registers.data(), vdp.memory.data(), pixel_setter);
+    CreateRowsAndReturnFlags(vdp.registers.data(), vdp.memory.data(), row_setter);
     std::chrono::time_point<std::chrono::system_clock> now = std::chrono::system_clock::now();
     std::chrono::duration<double> elapsed = now - start_time;
     if(false) printf("dump time %f seconds\n", elapsed.count());
@@ -1641,14 +1995,33 @@ void usage(char *progname)
     printf("\t--playback-controllers file    Playback controller data from file\n");
     printf("\t                               Only one of --record-controllers or\n");
     printf("\t                               --playback-controllers may be specified at any time.\n");
+    printf("\t--idle-loops file              Only skip the idle loops that file allows\n");
+    printf("\t                               (see LoadIdleLoopList).\n");
+    printf("\t--hle                          Run OS7's VRAM fill, read, and write routines\n");
+    printf("\t                               natively (USE_HLE=1 builds).\n");
+    printf("\t--hle-verify                   As --hle, also running the BIOS routines and\n");
+    printf("\t                               reporting where they differ.\n");
+    printf("\t--fast-boot                    Start from a snapshot of the machine taken once\n");
+    printf("\t                               the cartridge has started, saved in\n");
+    printf("\t                               ~/.cache/leathervision by the first such run.\n");
+    printf("\t--state file                   Save the machine to file on F5 and load it back\n");
+    printf("\t                               on F9 (default leathervision.state).\n");
+    printf("\t--load-state file              Start from a state saved by F5.\n");
+    printf("\t--rewind-megabytes count       Memory kept for stepping back through the\n");
+    printf("\t                               last fields with Backspace (default 16, or\n");
+    printf("\t                               0 for none as in headless builds).\n");
+    printf("\t--benchmark count              Run count frames unthrottled, then print the\n");
+    printf("\t                               emulation rates and host time by part as JSON.\n");
+    printf("\t--run-ahead count              Show each field as it will be count fields\n");
+    printf("\t                               later, hiding as many fields of input latency.\n");
     printf("\t--vdp-test file image          Use previously-saved contents of file as the\n");
     printf("\t                               state for the VDP and save resulting screen as image.\n");
 #ifdef PROVIDE_DEBUGGER
     printf("\t--debugger init                Invoke debugger on startup\n");
-#endif
     printf("\t                               \"init\" can be commands (separated by \";\"\n");
     printf("\t                               or a filename.  The initial commands can be\n");
     printf("\t                               an empty string.\n");
+#endif
     printf("\n");
 }
 
@@ -1674,13 +2047,10 @@ void do_vdp_test(const char *vdp_dump_name, const char *image_name)
     fclose(vdp_dump_in);
 
     uint8_t framebuffer[SCREEN_X * SCREEN_Y * 3];
-    auto pixel_setter = [&framebuffer](int x, int y, uint8_t color) {
-        uint8_t *pixel = framebuffer + 3 * (x + y * SCREEN_X) + 0;
-        uint8_t rgb[3];
-        CopyColor(rgb, Colors[color]);
-        SetColor(pixel, rgb[0], rgb[1], rgb[2]);
+    auto row_setter = [&framebuffer](int row, const uint8_t* row_colors) {
+        ConvertRowToRGB8(row_colors, framebuffer + 3 * row * SCREEN_X);
     };
-    CreateImageAndReturnFlags(registers.data(), memory.data(), pixel_setter);
+    CreateRowsAndReturnFlags(registers.data(), memory.data(), row_setter);
     FILE *fp = fopen(image_name, "wb");
     write_rgb8_image_as_P6(framebuffer, SCREEN_X, SCREEN_Y, fp);
     fclose(fp);
@@ -1721,155 +2091,1165 @@ uint8_t GetPlatformControllerState(int index, bool JoystickNotKeypad)
     }
 }
 
-struct ControllerEvent
-{
-    clk_t clk;
-    bool JoystickNotKeypad;
-    int index;
-    uint8_t bits_set;
-    uint8_t bits_cleared;
-};
-
-void set_colecovision_context(ColecovisionContext *colecovision_context, RAMboard& RAM, ROMboard& BIOS, ROMboard& cartridge, ColecoHW* colecohw, int64_t* clk, uint32_t* nmi)
+// Read which idle loops z80emu may skip (see Z80_IDLE_LOOPS) into a table
+// indexed by the loop's start address.  Each line of the file is one of
+//
+//     allow ADDRESS
+//     deny ADDRESS
+//     cartridge HASH
+//
+// with '#' starting a comment.  Lines following "cartridge" only apply to the
+// cartridge whose HashROM() is HASH (printed with the idle loop statistics),
+// lines before the first one apply to every cartridge.  If any "allow" line
+// applies, only the loops it lists are skipped; "deny" always wins.
+bool LoadIdleLoopList(const char *filename, uint64_t cartridge_hash, std::vector<uint8_t>& allowed)
 {
-    colecovision_context->RAM = RAM.bytes.data();
-
-    colecovision_context->BIOS.start = BIOS.base;
-    colecovision_context->BIOS.length = BIOS.length;
-    colecovision_context->BIOS.bytes = BIOS.bytes.data();
-
-    colecovision_context->cartridge.start = cartridge.base;
-    colecovision_context->cartridge.length = cartridge.length;
-    colecovision_context->cartridge.bytes = cartridge.bytes.data();
-
-    colecovision_context->cvhw = colecohw;
+    FILE *fp = fopen(filename, "r");
+    if(fp == NULL) {
+        fprintf(stderr, "couldn't open %s to read idle loops\n", filename);
+        return false;
+    }
 
-    colecovision_context->clk = clk;
-    colecovision_context->clocks_per_retrace = clocks_per_retrace;
-    colecovision_context->next_field_start_clock = clocks_per_retrace;
-    colecovision_context->do_vretrace_work = 0;
+    std::set<int> allow, deny;
+    bool applies = true;
+    char line[512];
+    int line_number = 0;
+    while(fgets(line, sizeof(line), fp)) {
+        line_number++;
+        char *comment = strchr(line, '#');
+        if(comment) {
+            *comment = '\0';
+        }
+        char keyword[32];
+        unsigned long long value;
+        int words = sscanf(line, "%31s %llx", keyword, &value);
+        if(words <= 0) {
+            continue;
+        }
+        bool valid = (words == 2);
+        if(valid && (strcmp(keyword, "cartridge") == 0)) {
+            applies = (value == cartridge_hash);
+        } else if(valid && (value <= 0xFFFF) && (strcmp(keyword, "allow") == 0)) {
+            if(applies) {
+                allow.insert(value);
+            }
+        } else if(valid && (value <= 0xFFFF) && (strcmp(keyword, "deny") == 0)) {
+            if(applies) {
+                deny.insert(value);
+            }
+        } else {
+            fprintf(stderr, "%s:%d: expected \"allow\", \"deny\", or \"cartridge\" and a hexadecimal number\n", filename, line_number);
+            fclose(fp);
+            return false;
+        }
+    }
+    fclose(fp);
 
-    colecovision_context->nmi = nmi;
-    colecovision_context->nmi_was_issued = false;
-    colecovision_context->do_nmi = 0;
+    allowed.assign(0x10000, allow.empty() ? 1 : 0);
+    for(int address: allow) {
+        allowed[address] = 1;
+    }
+    for(int address: deny) {
+        allowed[address] = 0;
+    }
+    return true;
 }
 
-}; // namespace ColecovisionEmulator
+static const ColecovisionContext *idle_loop_context = nullptr;
+static uint64_t idle_loop_cartridge_hash;
 
-#if defined(ROSA)
+void ReportIdleLoops()
+{
+    const ColecovisionContext *context = idle_loop_context;
+    if((context == nullptr) || (context->idle_loop_skips == 0)) {
+        return;
+    }
+    long long clocks = *context->clk;
+    fprintf(stderr, "idle loops: %lld skips, %lld of %lld clocks skipped (%.1f%%), cartridge %016" PRIx64 "\n",
+        context->idle_loop_skips, context->idle_cycles_skipped, clocks,
+        (clocks > 0) ? (100.0 * context->idle_cycles_skipped / clocks) : 0.0,
+        idle_loop_cartridge_hash);
+}
 
-extern "C" {
-void HAL_Delay(uint32_t millis);
-int coleco_main(int argc, char **argv);
-void main_iterate(void);
-uint32_t HAL_GetTick();
+// High-level emulation of OS7 BIOS routines (see Z80_HLE and --hle).  Calls
+// through the BIOS jump table to routines that only move bytes between memory
+// and VRAM are done here in one go instead of one OUT or IN at a time.  Each
+// leaves the VDP, the registers, and the flags as the routine's own code would,
+// and is charged the cycles and R increments of that code: a fixed part,
+// including its jump table JP and RET, plus a part per byte moved.  These are
+// modeled on the routine's loop and can be checked with --hle-verify, which
+// also runs the real routine and reports any difference.
+struct OS7Routine
+{
+    uint16_t address;                   // entry in the BIOS jump table
+    const char *name;
+    int count_register;                 // Z80_BC or Z80_DE, bytes to move, 0 meaning 65536
+    int cycles, cycles_per_byte;
+    int instructions, instructions_per_byte;
+    void (*run)(Z80_STATE *state, ColecovisionContext *context, TMS9918AEmulator& vdp, uint32_t count);
 };
 
-#define main coleco_main
-
-#endif
+// The loops end on "LD A,B; OR C" or "LD A,D; OR E" with the count at zero
+static constexpr uint8_t OS7_FLAGS_COUNT_DONE = Z80_Z_FLAG | Z80_P_FLAG;
 
-namespace ColecovisionEmulator
+// As the two command port writes setting the VDP's address would
+static void os7_set_vdp_address(Z80_STATE *state, TMS9918AEmulator& vdp, uint16_t address, bool write)
 {
+    vdp.cmd_data = address & 0xFF;
+    vdp.cmd_phase = TMS9918AEmulator::CMD_PHASE_FIRST;
+    vdp.cmd_started_in_nmi = state->in_nmi;
+    (write ? vdp.write_address : vdp.read_address) = address % TMS9918AEmulator::MEMORY_SIZE;
+    vdp.write_number += 2;
+}
 
-static void sleep_for(int32_t millis)
+// FILL_VRAM: HL is the VRAM address, DE the count, A the value
+static void os7_fill_vram(Z80_STATE *state, ColecovisionContext *context, TMS9918AEmulator& vdp, uint32_t count)
 {
-    if(millis < 0) {
-        return;
-    }
-#ifdef ROSA
-    HAL_Delay(millis);
-#else
-    std::this_thread::sleep_for(std::chrono::milliseconds(millis));
-#endif
+    uint8_t value = state->registers.byte[Z80_A];
+    os7_set_vdp_address(state, vdp, state->registers.word[Z80_HL], true);
+    for(uint32_t i = 0; i < count; i++) {
+        vdp.memory[vdp.write_address] = value;
+        vdp.background.memory_written(vdp.write_address);
+        vdp.write_address = (vdp.write_address + 1) % TMS9918AEmulator::MEMORY_SIZE;
+    }
+    vdp.write_number += count;
+    state->registers.byte[Z80_C] = value;
+    state->registers.word[Z80_DE] = 0;
+    state->registers.byte[Z80_A] = 0;
+    state->registers.byte[Z80_F] = OS7_FLAGS_COUNT_DONE;
 }
 
-extern "C" {
-
-uint8_t cv_in_byte(void* ctx_, uint16_t address16)
+// WRITE_VRAM: HL is the buffer, DE the VRAM address, BC the count
+static void os7_write_vram(Z80_STATE *state, ColecovisionContext *context, TMS9918AEmulator& vdp, uint32_t count)
 {
-    auto *context = reinterpret_cast<ColecovisionContext*>(ctx_);
-    auto* cvhw = reinterpret_cast<ColecoHW*>(context->cvhw);
-
-    uint8_t b = 0;
-    bool served = cvhw->io_read(address16 & 0xff, b);
-    if(!served) {
-        printf("IN %d (0x%02X) was not handled!\n", address16, address16);
+    uint16_t buffer = state->registers.word[Z80_HL];
+    os7_set_vdp_address(state, vdp, state->registers.word[Z80_DE], true);
+    uint8_t bytes[256];
+    for(uint32_t done = 0; done < count; ) {
+        uint32_t chunk = std::min(count - done, (uint32_t)sizeof(bytes));
+        for(uint32_t i = 0; i < chunk; i++) {
+            bytes[i] = cv_read_byte(context, buffer++);
+        }
+        vdp.write_block(bytes, chunk);
+        done += chunk;
     }
-    return b;
+    state->registers.word[Z80_HL] = buffer;
+    state->registers.word[Z80_BC] = 0;
+    state->registers.byte[Z80_A] = 0;
+    state->registers.byte[Z80_F] = OS7_FLAGS_COUNT_DONE;
 }
 
-void cv_out_byte(void* ctx_, uint16_t address16, uint8_t value)
+// READ_VRAM: HL is the buffer, DE the VRAM address, BC the count
+static void os7_read_vram(Z80_STATE *state, ColecovisionContext *context, TMS9918AEmulator& vdp, uint32_t count)
 {
-    auto *context = reinterpret_cast<ColecovisionContext*>(ctx_);
-    auto* cvhw = reinterpret_cast<ColecoHW*>(context->cvhw);
-
-    bool accepted = cvhw->io_write(address16 & 0xff, value);
-    if(!accepted) {
-        printf("OUT %d (0x%02X), 0x%02X was not handled!\n", address16, address16, value);
+    uint16_t buffer = state->registers.word[Z80_HL];
+    os7_set_vdp_address(state, vdp, state->registers.word[Z80_DE], false);
+    uint8_t bytes[256];
+    for(uint32_t done = 0; done < count; ) {
+        uint32_t chunk = std::min(count - done, (uint32_t)sizeof(bytes));
+        vdp.read_block(bytes, chunk);
+        for(uint32_t i = 0; i < chunk; i++) {
+            cv_write_byte(context, buffer++, bytes[i]);
+        }
+        done += chunk;
     }
+    state->registers.word[Z80_HL] = buffer;
+    state->registers.word[Z80_BC] = 0;
+    state->registers.byte[Z80_A] = 0;
+    state->registers.byte[Z80_F] = OS7_FLAGS_COUNT_DONE;
 }
 
-}; // extern "C" 
-
-}; // namespace ColecovisionEmulator
-
+static const OS7Routine os7_routines[] = {
+    {0x1F82, "FILL_VRAM", Z80_DE, 56, 41, 8, 6, os7_fill_vram},
+    {0x1FDF, "WRITE_VRAM", Z80_BC, 52, 50, 7, 7, os7_write_vram},
+    {0x1FE2, "READ_VRAM", Z80_BC, 45, 50, 6, 7, os7_read_vram},
+};
 
-int main(int argc, char **argv)
+struct OS7HLE
 {
-    bool freerun = false;
-    using namespace PlatformInterface;
-    using namespace ColecovisionEmulator;
-    using namespace std::chrono_literals;
-#ifdef PROVIDE_DEBUGGER
-    bool do_debugger = false;
-    char *debugger_argument = NULL;
-
-    populate_command_handlers();
-#endif
-#ifdef ENABLE_AUTOMATION
-    bool record_controllers = false;
-    std::string record_controller_filename;
-    bool playback_controllers = false;
-    std::string playback_controller_filename;
-#endif
+    ColecoHW *hw;
+    bool verify;                        // also run the real routines and compare
+    bool verifying = false;             // running a real routine for verify
+    struct Statistics
+    {
+        long long calls = 0;
+        long long bytes = 0;
+        long long mismatches = 0;       // of memory or VRAM, with verify
+        long long drifts = 0;           // of registers, pc, R, or cycles, with verify
+    };
+    std::array<Statistics, std::size(os7_routines)> statistics;
 
-    char *progname = argv[0];
-    argc -= 1;
-    argv += 1;
+    OS7HLE(ColecoHW *hw, bool verify) :
+        hw(hw),
+        verify(verify)
+    { }
 
-    while((argc > 0) && (argv[0][0] == '-')) {
-	if(
-            (strcmp(argv[0], "-help") == 0) ||
-            (strcmp(argv[0], "--help") == 0) ||
-            (strcmp(argv[0], "-h") == 0) ||
-            (strcmp(argv[0], "-?") == 0))
-         {
-             usage(progname);
-             exit(EXIT_SUCCESS);
-	} else if(strcmp(argv[0], "--vdp-test") == 0) {
-            if(argc < 3) {
-                fprintf(stderr, "-vdp-test requires VDP register dump filename and output image filename\n");
-                usage(progname);
-                exit(EXIT_FAILURE);
+    // Memory, VRAM, and VDP state the routines may change
+    struct Snapshot
+    {
+        std::array<uint8_t, 0x10000> memory;
+        std::array<uint8_t, TMS9918AEmulator::MEMORY_SIZE> vram;
+        decltype(TMS9918AEmulator::cmd_phase) cmd_phase;
+        uint8_t cmd_data;
+        uint16_t read_address;
+        uint16_t write_address;
+        uint32_t write_number;
+        decltype(Z80_STATE::registers) registers;
+        int pc;
+        int r;
+        int cycles;
+
+        void save(ColecovisionContext *context, const TMS9918AEmulator& vdp, const Z80_STATE *state)
+        {
+            for(uint32_t address = 0; address < memory.size(); address++) {
+                memory[address] = cv_read_byte(context, address);
             }
-            do_vdp_test(argv[1], argv[2]);
-            exit(0);
-        } else if(strcmp(argv[0], "--free-run") == 0) {
-            freerun = true;
-            argv++;
-            argc--;
+            vram = vdp.memory;
+            cmd_phase = vdp.cmd_phase;
+            cmd_data = vdp.cmd_data;
+            read_address = vdp.read_address;
+            write_address = vdp.write_address;
+            write_number = vdp.write_number;
+            registers = state->registers;
         }
 
-#ifdef ENABLE_AUTOMATION
-	else if(strcmp(argv[0], "--record-controllers") == 0) {
-
-            if(argc < 2) {
-                fprintf(stderr, "--record-controllers requires filename to which to record controller state\n");
-                usage(progname);
-                exit(EXIT_FAILURE);
+        void restore(ColecovisionContext *context, TMS9918AEmulator& vdp, Z80_STATE *state) const
+        {
+            for(uint32_t address = 0; address < memory.size(); address++) {
+                cv_write_byte(context, address, memory[address]);
             }
-            if(playback_controllers) {
+            vdp.memory = vram;
+            vdp.background.everything_written();
+            vdp.cmd_phase = cmd_phase;
+            vdp.cmd_data = cmd_data;
+            vdp.read_address = read_address;
+            vdp.write_address = write_address;
+            vdp.write_number = write_number;
+            state->registers = registers;
+        }
+    };
+
+    // Returns the cycles taken by the routine, or 0 if it should be emulated
+    int call(ColecovisionContext *context, Z80_STATE *state, int *pc, int *r, int elapsed_cycles)
+    {
+        if(verifying) {
+            return 0;
+        }
+        const OS7Routine *routine = std::find_if(std::begin(os7_routines), std::end(os7_routines),
+            [pc](const OS7Routine& routine) { return routine.address == (*pc & 0xFFFF); });
+        if(routine == std::end(os7_routines)) {
+            return 0;
+        }
+
+        // Only routines ending before the next vertical retrace, which is
+        // when the NMI that could interrupt them is raised, and only if the
+        // VDP isn't waiting for the second byte of a command
+        uint32_t count = state->registers.word[routine->count_register];
+        if(count == 0) {
+            count = 0x10000;
+        }
+        int cycles = routine->cycles + routine->cycles_per_byte * count;
+        clk_t now = *context->clk + elapsed_cycles;
+        clk_t next_vretrace = (now / clocks_per_retrace + 1) * clocks_per_retrace;
+        if((now + cycles >= next_vretrace) || (hw->vdp.cmd_phase != TMS9918AEmulator::CMD_PHASE_FIRST)) {
+            return 0;
+        }
+
+        Statistics& routine_statistics = statistics[routine - os7_routines];
+        routine_statistics.calls++;
+        routine_statistics.bytes += count;
+
+        int sp = state->registers.word[Z80_SP];
+        if(!verify) {
+            routine->run(state, context, hw->vdp, count);
+            *pc = cv_read_word(context, sp);
+            state->registers.word[Z80_SP] = sp + 2;
+            *r += routine->instructions + routine->instructions_per_byte * count;
+            return cycles;
+        }
+
+        auto before = std::make_unique<Snapshot>();
+        auto native = std::make_unique<Snapshot>();
+        before->save(context, hw->vdp, state);
+        routine->run(state, context, hw->vdp, count);
+        native->save(context, hw->vdp, state);
+        native->pc = cv_read_word(context, sp);
+        native->registers.word[Z80_SP] = sp + 2;
+        native->r = (*r + routine->instructions + routine->instructions_per_byte * count) & 0x7F;
+        native->cycles = cycles;
+        before->restore(context, hw->vdp, state);
+
+        // Step through the routine until its RET
+        Z80_CACHE *block_cache = state->block_cache;
+        state->block_cache = NULL;
+        state->pc = *pc;
+        state->r = (state->r & 0x80) | (*r & 0x7F);
+        int real_cycles = 0;
+        bool returned;
+        verifying = true;
+        do {
+            real_cycles += Z80Emulate(state, 1, context);
+            returned = (state->pc == native->pc) && (state->registers.word[Z80_SP] == ((sp + 2) & 0xFFFF));
+        } while(!returned && !state->halted && (real_cycles < 2 * cycles + 10000));
+        verifying = false;
+        state->block_cache = block_cache;
+        *pc = state->pc;
+        // The steps counted their fetches, which the caller would count again
+        // from *r, at least modulo 128
+        state->opcode_fetches -= (state->r - *r) & 0x7F;
+        *r += (state->r - *r) & 0x7F;
+
+        if(!returned) {
+            // Carry on from wherever the BIOS code got to
+            fprintf(stderr, "HLE %s: BIOS routine didn't return after %d cycles\n", routine->name, real_cycles);
+            routine_statistics.mismatches++;
+            return real_cycles;
+        }
+
+        auto real = std::make_unique<Snapshot>();
+        real->save(context, hw->vdp, state);
+
+        // Leave out what the routine may have left on the stack
+        for(int address = sp - 64; address < sp; address++) {
+            native->memory[address & 0xFFFF] = real->memory[address & 0xFFFF];
+        }
+        bool mismatch = (native->memory != real->memory) || (native->vram != real->vram) ||
+            (native->cmd_phase != real->cmd_phase) || (native->cmd_data != real->cmd_data) ||
+            (native->read_address != real->read_address) || (native->write_address != real->write_address);
+        bool drift = (memcmp(&native->registers, &real->registers, sizeof(real->registers)) != 0) ||
+            (native->r != (*r & 0x7F)) || (native->cycles != real_cycles);
+        if(mismatch && (routine_statistics.mismatches++ == 0)) {
+            fprintf(stderr, "HLE %s of %" PRIu32 " bytes: memory or VDP differs from the BIOS routine\n", routine->name, count);
+        }
+        if(drift && (routine_statistics.drifts++ == 0)) {
+            fprintf(stderr, "HLE %s of %" PRIu32 " bytes: cycles %d, BIOS %d; R %02X, BIOS %02X\n",
+                routine->name, count, native->cycles, real_cycles, native->r, *r & 0x7F);
+            for(int i = 0; i < 7; i++) {
+                if(native->registers.word[i] != real->registers.word[i]) {
+                    fprintf(stderr, "    register word %d is %04X, BIOS %04X\n", i, native->registers.word[i], real->registers.word[i]);
+                }
+            }
+        }
+        return real_cycles;
+    }
+
+    void report()
+    {
+        for(size_t i = 0; i < std::size(os7_routines); i++) {
+            const Statistics& s = statistics[i];
+            if(s.calls == 0) {
+                continue;
+            }
+            fprintf(stderr, "HLE %s: %lld calls, %lld bytes", os7_routines[i].name, s.calls, s.bytes);
+            if(verify) {
+                fprintf(stderr, ", %lld with memory or VDP differing, %lld with registers or cycles differing", s.mismatches, s.drifts);
+            }
+            fprintf(stderr, "\n");
+        }
+    }
+};
+
+static OS7HLE *os7_hle = nullptr;
+
+void ReportHLE()
+{
+    if(os7_hle != nullptr) {
+        os7_hle->report();
+    }
+}
+
+// Work the main loop does at given clocks.  Z80Emulate is only ever asked to
+// run up to the earliest one, so that nothing needs to be checked after each
+// instruction.  Events due on the same clock are handled in this order.
+enum EventKind
+{
+    VRETRACE,                   // scan out the field and raise the VDP's vsync flag
+    NMI,                        // the NMI line rose, interrupt the Z80
+    AUDIO_BATCH,                // generate audio samples up to now
+    CONTROLLER_PLAYBACK,        // apply the next recorded controller change
+    DEBUGGER_CHECKPOINT,        // let the debugger check its breakpoints
+};
+
+struct ScheduledEvent
+{
+    clk_t clk;
+    EventKind kind;
+
+    bool operator>(const ScheduledEvent& other) const
+    {
+        return (clk > other.clk) || ((clk == other.clk) && (kind > other.kind));
+    }
+};
+
+struct EventScheduler
+{
+    // A heap with the earliest event first, kept with std::push_heap and
+    // std::pop_heap so that save states can look through it
+    std::vector<ScheduledEvent> events;
+
+    void schedule(clk_t clk, EventKind kind)
+    {
+        events.push_back({clk, kind});
+        std::push_heap(events.begin(), events.end(), std::greater<ScheduledEvent>());
+    }
+
+    clk_t next_deadline() const
+    {
+        return events.empty() ? std::numeric_limits<clk_t>::max() : events.front().clk;
+    }
+
+    // Remove the earliest event into "event" if it is due by "now"
+    bool pop_due(clk_t now, ScheduledEvent& event)
+    {
+        if(events.empty() || (events.front().clk > now)) {
+            return false;
+        }
+        std::pop_heap(events.begin(), events.end(), std::greater<ScheduledEvent>());
+        event = events.back();
+        events.pop_back();
+        return true;
+    }
+
+    // The earliest event of "kind", or the maximum clk_t if there is none
+    clk_t deadline(EventKind kind) const
+    {
+        clk_t earliest = std::numeric_limits<clk_t>::max();
+        for(const ScheduledEvent& event: events) {
+            if(event.kind == kind) {
+                earliest = std::min(earliest, event.clk);
+            }
+        }
+        return earliest;
+    }
+
+    // Move the events of "kind" to "clk"
+    void reschedule(EventKind kind, clk_t clk)
+    {
+        for(ScheduledEvent& event: events) {
+            if(event.kind == kind) {
+                event.clk = clk;
+            }
+        }
+        std::make_heap(events.begin(), events.end(), std::greater<ScheduledEvent>());
+    }
+};
+
+struct ControllerEvent
+{
+    clk_t clk;
+    bool JoystickNotKeypad;
+    int index;
+    uint8_t bits_set;
+    uint8_t bits_cleared;
+};
+
+void set_colecovision_context(ColecovisionContext *colecovision_context, RAMboard& RAM, ROMboard& BIOS, ROMboard& cartridge, ColecoHW* colecohw, clk_t* clk, uint32_t* nmi)
+{
+    colecovision_context->RAM = RAM.bytes.data();
+
+    colecovision_context->BIOS.start = BIOS.base;
+    colecovision_context->BIOS.length = BIOS.length;
+    colecovision_context->BIOS.bytes = BIOS.bytes;
+
+    colecovision_context->cartridge.start = cartridge.base;
+    colecovision_context->cartridge.length = cartridge.length;
+    colecovision_context->cartridge.bytes = cartridge.bytes;
+
+    cv_clear_pages(colecovision_context);
+    cv_map_pages(colecovision_context, BIOS.base, BIOS.padded_length, BIOS.bytes, 0xFFFF, 0);
+    if(cartridge.length > MAXIMUM_CARTRIDGE_LENGTH) {
+        cv_map_megacart(colecovision_context, cartridge.bytes, (cartridge.length + CV_BANK_SIZE - 1) / CV_BANK_SIZE);
+    } else {
+        cv_map_pages(colecovision_context, cartridge.base, cartridge.padded_length, cartridge.bytes, 0xFFFF, 0);
+    }
+    cv_map_pages(colecovision_context, RAM.base, RAM.mirroredLength, RAM.bytes.data(), RAM.addressMask, 1);
+
+    colecovision_context->cvhw = colecohw;
+
+    colecovision_context->clk = clk;
+
+    colecovision_context->nmi = nmi;
+    colecovision_context->nmi_was_issued = false;
+    colecovision_context->do_nmi = 0;
+
+    colecovision_context->idle_loop_allowed = NULL;
+    colecovision_context->idle_loop_skips = 0;
+    colecovision_context->idle_cycles_skipped = 0;
+
+    colecovision_context->hle = NULL;
+}
+
+// A save state is a versioned header naming the ROMs, then the raw state (see
+// StateWriter) of the Z80, RAM, the VDP and the sound chip, the NMI latch, the
+// MegaCart bank, clk, and when the next field and audio batch are due.  Saving
+// and loading are a few memcpys, cheap enough to do every field.  They are
+// done between runs of the Z80 with no event due; periodic events are the only
+// pending ones there.  The Z80's block cache and register tables are left out,
+// being the same for every machine, and so is what the context only
+// configures.
+struct Machine
+{
+    static constexpr uint32_t MAGIC = 0x5453564C;       // "LVST"
+    static constexpr uint32_t VERSION = 1;
+
+    struct Header
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t bios_hash;
+        uint64_t cartridge_hash;
+    };
+
+    Z80_STATE& state;
+    RAMboard& RAM;
+    ColecoHW& hw;
+    ColecovisionContext& context;
+    clk_t& clk;
+    EventScheduler& scheduler;
+    Header header;
+    size_t state_size;          // of every save state of this machine
+
+    Machine(Z80_STATE& state, RAMboard& RAM, ColecoHW& hw, ColecovisionContext& context, clk_t& clk, EventScheduler& scheduler, uint64_t bios_hash, uint64_t cartridge_hash) :
+        state(state),
+        RAM(RAM),
+        hw(hw),
+        context(context),
+        clk(clk),
+        scheduler(scheduler),
+        header{MAGIC, VERSION, bios_hash, cartridge_hash}
+    {
+        StateWriter probe;
+        save(probe);
+        state_size = probe.bytes.size();
+    }
+
+    // Append a save state to "out", whose bytes can be cleared and reused
+    // from one save to the next
+    void save(StateWriter& out) const
+    {
+        out.write(header);
+        out.write(state.status);
+        out.write(state.registers);
+        out.write(state.alternates);
+        out.write(state.i);
+        out.write(state.r);
+        out.write(state.pc);
+        out.write(state.iff1);
+        out.write(state.iff2);
+        out.write(state.im);
+        out.write(state.in_nmi);
+        out.write(state.halted);
+        out.write_bytes(RAM.bytes.data(), RAM.bytes.size());
+        hw.save_state(out);
+        out.write(context.nmi_was_issued);
+        out.write(context.do_nmi);
+        out.write(context.bank);
+        out.write(clk);
+        out.write(scheduler.deadline(VRETRACE));
+        out.write(scheduler.deadline(AUDIO_BATCH));
+    }
+
+    // Returns false, leaving the machine unchanged, if "bytes" isn't a save
+    // state of this machine
+    bool load(const uint8_t *bytes, size_t size)
+    {
+        if((size != state_size) || (memcmp(bytes, &header, sizeof(Header)) != 0)) {
+            return false;
+        }
+
+        StateReader in(bytes + sizeof(Header), size - sizeof(Header));
+        int bank = 0;
+        clk_t retrace = 0, audio_batch = 0;
+        in.read(state.status);
+        in.read(state.registers);
+        in.read(state.alternates);
+        in.read(state.i);
+        in.read(state.r);
+        in.read(state.pc);
+        in.read(state.iff1);
+        in.read(state.iff2);
+        in.read(state.im);
+        in.read(state.in_nmi);
+        in.read(state.halted);
+        in.read_bytes(RAM.bytes.data(), RAM.bytes.size());
+        hw.load_state(in);
+        in.read(context.nmi_was_issued);
+        in.read(context.do_nmi);
+        in.read(bank);
+        in.read(clk);
+        in.read(retrace);
+        in.read(audio_batch);
+        if(context.bank_count > 0) {
+            cv_map_bank(&context, (unsigned int)bank % context.bank_count);
+        }
+        scheduler.reschedule(VRETRACE, retrace);
+        scheduler.reschedule(AUDIO_BATCH, audio_batch);
+        return true;
+    }
+
+    // Written aside then renamed, so that a save state being written is never
+    // read half done
+    bool save_file(const std::string& filename) const
+    {
+        StateWriter out;
+        save(out);
+
+        std::string temporary = filename + "." + std::to_string(getpid());
+        FILE *fp = fopen(temporary.c_str(), "wb");
+        if(fp == NULL) {
+            return false;
+        }
+        bool written = fwrite(out.bytes.data(), 1, out.bytes.size(), fp) == out.bytes.size();
+        written = (fclose(fp) == 0) && written;
+        if(!written || (rename(temporary.c_str(), filename.c_str()) != 0)) {
+            unlink(temporary.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    bool load_file(const std::string& filename)
+    {
+        FILE *fp = fopen(filename.c_str(), "rb");
+        if(fp == NULL) {
+            return false;
+        }
+        // One more byte than a save state, to tell longer files apart
+        std::vector<uint8_t> bytes(state_size + 1);
+        size_t got = fread(bytes.data(), 1, bytes.size(), fp);
+        fclose(fp);
+        return load(bytes.data(), got);
+    }
+};
+
+// With --fast-boot, a save state taken right after the BIOS has handed over
+// to the cartridge is kept on disk, keyed by the hashes of both ROMs, and
+// later runs start from there instead of going through the BIOS's title
+// screen.  It is captured the first time the Z80 stops in the cartridge after
+// VDP registers were written, taken as the cartridge setting up the VDP.
+// Cartridges are assumed not to read the controllers before.
+struct BootSnapshot
+{
+    std::string directory;
+    std::string filename;
+    bool capturing{false};              // no snapshot was restored, save one
+    uint32_t register_writes{0};        // VDP register writes at the last check
+
+    BootSnapshot(uint64_t bios_hash, uint64_t cartridge_hash)
+    {
+        const char *cache = getenv("XDG_CACHE_HOME");
+        const char *home = getenv("HOME");
+        directory = (cache && *cache) ? cache : std::string(home ? home : ".") + "/.cache";
+
+        char name[64];
+        snprintf(name, sizeof(name), "/boot-%016" PRIx64 "-%016" PRIx64 ".bin", bios_hash, cartridge_hash);
+        filename = directory + "/leathervision" + name;
+    }
+
+    // Start the machine from the snapshot if there is a valid one, else
+    // capture one during this run
+    bool restore(Machine& machine)
+    {
+        if(machine.load_file(filename)) {
+            return true;
+        }
+        capturing = true;
+        return false;
+    }
+
+    // Called between runs of the Z80 with no event due, returns true if the
+    // snapshot should be saved there
+    bool watch(const Z80_STATE& state, const TMS9918AEmulator& vdp)
+    {
+        bool written = vdp.register_writes != register_writes;
+        register_writes = vdp.register_writes;
+        return written && (state.pc >= 0x8000);
+    }
+
+    void save(const Machine& machine)
+    {
+        capturing = false;
+        mkdir(directory.c_str(), 0755);
+        mkdir((directory + "/leathervision").c_str(), 0755);
+        if(!machine.save_file(filename)) {
+            fprintf(stderr, "couldn't write the boot snapshot to %s\n", filename.c_str());
+        }
+    }
+};
+
+// Save states of the last fields, most recent last, for stepping back through
+// them while the rewind key is held.  Every KEYFRAME_INTERVAL-th is kept
+// whole, and the others as their XOR with the keyframe before, mostly zero
+// since little of RAM and VRAM changes in a few seconds, run-length encoded
+// as pairs of 16-bit counts of zero bytes then of literal bytes, each pair
+// followed by its literals.  Once over "budget" bytes, the oldest keyframe
+// is dropped along with the deltas against it, as long as a later keyframe
+// is kept.  A group over half the budget is ended early by keeping the next
+// field whole, so that dropping the group before it still leaves about half
+// the budget of fields, and the buffer is never emptied.
+struct RewindBuffer
+{
+    static constexpr size_t KEYFRAME_INTERVAL = 60;
+
+    struct Entry
+    {
+        bool keyframe;
+        std::vector<uint8_t> bytes;
+    };
+
+    size_t budget;
+    size_t used{0};
+    std::deque<Entry> entries;
+    StateWriter saved;                  // reused for every field
+    std::vector<uint8_t> restored;
+
+    RewindBuffer(size_t budget) :
+        budget(budget)
+    { }
+
+    // The most recent keyframe, if one of the last KEYFRAME_INTERVAL - 1
+    // entries, so that the entry pushed next is the KEYFRAME_INTERVAL-th
+    const Entry *last_keyframe() const
+    {
+        size_t checked = std::min(entries.size(), KEYFRAME_INTERVAL - 1);
+        for(auto it = entries.rbegin(); it != entries.rbegin() + checked; it++) {
+            if(it->keyframe) {
+                return &*it;
+            }
+        }
+        return nullptr;
+    }
+
+    // Bytes of the most recent keyframe and the deltas after it
+    size_t last_group_bytes() const
+    {
+        size_t bytes = 0;
+        for(auto it = entries.rbegin(); it != entries.rend(); it++) {
+            bytes += it->bytes.size();
+            if(it->keyframe) {
+                break;
+            }
+        }
+        return bytes;
+    }
+
+    static void append_count(std::vector<uint8_t>& out, uint16_t count)
+    {
+        out.insert(out.end(), reinterpret_cast<const uint8_t*>(&count), reinterpret_cast<const uint8_t*>(&count) + sizeof(count));
+    }
+
+    static std::vector<uint8_t> encode(const std::vector<uint8_t>& keyframe, const std::vector<uint8_t>& state)
+    {
+        std::vector<uint8_t> out;
+        size_t i = 0;
+        while(i < state.size()) {
+            size_t zeros = 0;
+            while((i + zeros < state.size()) && (zeros < 0xFFFF) && (state[i + zeros] == keyframe[i + zeros])) {
+                zeros++;
+            }
+            i += zeros;
+            size_t literals = 0;
+            while((i + literals < state.size()) && (literals < 0xFFFF) && (state[i + literals] != keyframe[i + literals])) {
+                literals++;
+            }
+            append_count(out, zeros);
+            append_count(out, literals);
+            for(size_t j = 0; j < literals; j++, i++) {
+                out.push_back(state[i] ^ keyframe[i]);
+            }
+        }
+        return out;
+    }
+
+    static void decode(const std::vector<uint8_t>& keyframe, const std::vector<uint8_t>& delta, std::vector<uint8_t>& state)
+    {
+        state = keyframe;
+        size_t at = 0;
+        size_t i = 0;
+        while(i < delta.size()) {
+            uint16_t zeros, literals;
+            memcpy(&zeros, delta.data() + i, sizeof(zeros));
+            memcpy(&literals, delta.data() + i + sizeof(zeros), sizeof(literals));
+            i += sizeof(zeros) + sizeof(literals);
+            at += zeros;
+            for(size_t j = 0; j < literals; j++) {
+                state[at++] ^= delta[i++];
+            }
+        }
+    }
+
+    // Called between runs of the Z80 with no event due, once per field
+    void push(const Machine& machine)
+    {
+        saved.bytes.clear();
+        machine.save(saved);
+
+        const Entry *keyframe = last_keyframe();
+        if(keyframe && (last_group_bytes() > budget / 2)) {
+            keyframe = nullptr;
+        }
+        if(keyframe) {
+            entries.push_back({false, encode(keyframe->bytes, saved.bytes)});
+        } else {
+            entries.push_back({true, saved.bytes});
+        }
+        used += entries.back().bytes.size();
+
+        while(used > budget) {
+            auto next_keyframe = std::find_if(entries.begin() + 1, entries.end(), [](const Entry& entry) { return entry.keyframe; });
+            if(next_keyframe == entries.end()) {
+                break;
+            }
+            for(size_t dropped = next_keyframe - entries.begin(); dropped > 0; dropped--) {
+                used -= entries.front().bytes.size();
+                entries.pop_front();
+            }
+        }
+    }
+
+    // Load the most recent field, removing it, or return false if there is
+    // none left
+    bool step_back(Machine& machine)
+    {
+        if(entries.empty()) {
+            return false;
+        }
+        // Removed first, the keyframe is found as it was by push()
+        Entry entry = std::move(entries.back());
+        entries.pop_back();
+        used -= entry.bytes.size();
+        if(entry.keyframe) {
+            machine.load(entry.bytes.data(), entry.bytes.size());
+        } else {
+            decode(last_keyframe()->bytes, entry.bytes, restored);
+            machine.load(restored.data(), restored.size());
+        }
+        return true;
+    }
+};
+
+// --benchmark runs a number of fields unthrottled, timing the parts of the
+// emulation, then prints the rates reached and where the host's time went as
+// JSON.  Scanout includes the platform's Frame, where it draws the field, and
+// audio excludes handing samples to the platform; a part timed within another
+// is taken out of it.  Instructions are counted as R counts them (see
+// opcode_fetches in z80emu.h), over each call of Z80Emulate.
+struct Benchmark
+{
+    enum Part { Z80, SCANOUT, AUDIO, PLATFORM, PART_COUNT, NO_PART = PART_COUNT };
+
+    uint32_t fields;                    // to run, 0 if not benchmarking
+    uint32_t fields_run{0};
+    std::array<double, PART_COUNT> seconds{};
+    Part current{NO_PART};
+    std::chrono::steady_clock::time_point start_time;
+    clk_t start_clock{0};
+    long long instructions{0};
+
+    Benchmark(uint32_t fields) :
+        fields(fields)
+    { }
+
+    void start(clk_t clk)
+    {
+        start_time = std::chrono::steady_clock::now();
+        start_clock = clk;
+    }
+
+    // Run Z80Emulate as "emulate", counting the instructions it runs
+    template <typename F>
+    int emulate_z80(const Z80_STATE& state, F emulate)
+    {
+        long long fetches = state.opcode_fetches;
+        int cycles = emulate();
+        instructions += state.opcode_fetches - fetches;
+        return cycles;
+    }
+
+    template <typename F>
+    void time(Part part, F f)
+    {
+        if(fields == 0) {
+            f();
+            return;
+        }
+        Part enclosing = current;
+        current = part;
+        auto started = std::chrono::steady_clock::now();
+        f();
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        seconds[part] += elapsed;
+        if(enclosing != NO_PART) {
+            seconds[enclosing] -= elapsed;
+        }
+        current = enclosing;
+    }
+
+    // Called after each field, returns true once all were run
+    bool field_ended()
+    {
+        return (fields > 0) && (++fields_run == fields);
+    }
+
+    void report(clk_t clk) const
+    {
+        static constexpr const char *part_names[PART_COUNT] = {"z80", "scanout", "audio", "platform"};
+
+        double host_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+        double emulated_seconds = (double)(clk - start_clock) / machine_clock_rate;
+        double other_seconds = host_seconds;
+
+        printf("{\n");
+        printf("    \"frames\": %" PRIu32 ",\n", fields_run);
+        printf("    \"emulated_seconds\": %.6f,\n", emulated_seconds);
+        printf("    \"host_seconds\": %.6f,\n", host_seconds);
+        printf("    \"emulated_mhz\": %.3f,\n", (clk - start_clock) / host_seconds / 1e6);
+        printf("    \"frames_per_second\": %.2f,\n", fields_run / host_seconds);
+        printf("    \"instructions_per_second\": %.0f,\n", instructions / host_seconds);
+        printf("    \"host_seconds_by_part\": {\n");
+        for(int part = 0; part < PART_COUNT; part++) {
+            printf("        \"%s\": %.6f,\n", part_names[part], seconds[part]);
+            other_seconds -= seconds[part];
+        }
+        printf("        \"other\": %.6f\n", other_seconds);
+        printf("    }\n");
+        printf("}\n");
+        fflush(stdout);
+    }
+};
+
+}; // namespace ColecovisionEmulator
+
+#if defined(ROSA)
+
+extern "C" {
+void HAL_Delay(uint32_t millis);
+int coleco_main(int argc, char **argv);
+void main_iterate(void);
+uint32_t HAL_GetTick();
+};
+
+#define main coleco_main
+
+#endif
+
+namespace ColecovisionEmulator
+{
+
+static void sleep_for(int32_t millis)
+{
+    if(millis < 0) {
+        return;
+    }
+#ifdef ROSA
+    HAL_Delay(millis);
+#else
+    std::this_thread::sleep_for(std::chrono::milliseconds(millis));
+#endif
+}
+
+extern "C" {
+
+uint8_t cv_in_byte(void* ctx_, uint16_t address16)
+{
+    auto *context = reinterpret_cast<ColecovisionContext*>(ctx_);
+    auto* cvhw = reinterpret_cast<ColecoHW*>(context->cvhw);
+
+    uint8_t b = 0;
+    bool served = cvhw->io_read(address16 & 0xff, b);
+    if(!served) {
+        printf("IN %d (0x%02X) was not handled!\n", address16, address16);
+    }
+    return b;
+}
+
+void cv_out_byte(void* ctx_, uint16_t address16, uint8_t value)
+{
+    auto *context = reinterpret_cast<ColecovisionContext*>(ctx_);
+    auto* cvhw = reinterpret_cast<ColecoHW*>(context->cvhw);
+
+    bool accepted = cvhw->io_write(address16 & 0xff, value);
+    if(!accepted) {
+        printf("OUT %d (0x%02X), 0x%02X was not handled!\n", address16, address16, value);
+    }
+}
+
+void cv_out_block(void* ctx_, uint16_t address16, const uint8_t *data, int count)
+{
+    auto *context = reinterpret_cast<ColecovisionContext*>(ctx_);
+    auto* cvhw = reinterpret_cast<ColecoHW*>(context->cvhw);
+
+    bool accepted = cvhw->io_write_block(address16 & 0xff, data, count);
+    if(!accepted) {
+        printf("OTIR to %d (0x%02X) was not handled!\n", address16, address16);
+    }
+}
+
+void cv_in_block(void* ctx_, uint16_t address16, uint8_t *data, int count)
+{
+    auto *context = reinterpret_cast<ColecovisionContext*>(ctx_);
+    auto* cvhw = reinterpret_cast<ColecoHW*>(context->cvhw);
+
+    bool served = cvhw->io_read_block(address16 & 0xff, data, count);
+    if(!served) {
+        printf("INIR from %d (0x%02X) was not handled!\n", address16, address16);
+    }
+}
+
+int cv_hle_routine(void *ctx_, Z80_STATE *state, int *pc, int *r, int elapsed_cycles)
+{
+    auto *context = reinterpret_cast<ColecovisionContext*>(ctx_);
+    auto *hle = reinterpret_cast<OS7HLE*>(context->hle);
+
+    return hle->call(context, state, pc, r, elapsed_cycles);
+}
+
+}; // extern "C" 
+
+}; // namespace ColecovisionEmulator
+
+
+int main(int argc, char **argv)
+{
+#ifdef HEADLESS
+    bool freerun = true;        // no one is watching
+#else
+    bool freerun = false;
+#endif
+    using namespace PlatformInterface;
+    using namespace ColecovisionEmulator;
+    using namespace std::chrono_literals;
+#ifdef PROVIDE_DEBUGGER
+    bool do_debugger = false;
+    char *debugger_argument = NULL;
+
+    populate_command_handlers();
+#endif
+#ifdef ENABLE_AUTOMATION
+    bool record_controllers = false;
+    std::string record_controller_filename;
+    bool playback_controllers = false;
+    std::string playback_controller_filename;
+#endif
+
+    const char *idle_loop_filename = nullptr;
+    bool hle = false;
+    bool hle_verify = false;
+    bool fast_boot = false;
+    std::string state_filename = "leathervision.state";
+    const char *load_state_filename = nullptr;
+#ifdef HEADLESS
+    size_t rewind_megabytes = 0;        // nothing to rewind with
+#else
+    size_t rewind_megabytes = 16;
+#endif
+    int run_ahead_fields = 0;
+    uint32_t benchmark_fields = 0;
+
+    char *progname = argv[0];
+    argc -= 1;
+    argv += 1;
+
+    while((argc > 0) && (argv[0][0] == '-')) {
+	if(
+            (strcmp(argv[0], "-help") == 0) ||
+            (strcmp(argv[0], "--help") == 0) ||
+            (strcmp(argv[0], "-h") == 0) ||
+            (strcmp(argv[0], "-?") == 0))
+         {
+             usage(progname);
+             exit(EXIT_SUCCESS);
+	} else if(strcmp(argv[0], "--vdp-test") == 0) {
+            if(argc < 3) {
+                fprintf(stderr, "-vdp-test requires VDP register dump filename and output image filename\n");
+                usage(progname);
+                exit(EXIT_FAILURE);
+            }
+            do_vdp_test(argv[1], argv[2]);
+            exit(0);
+        } else if(strcmp(argv[0], "--free-run") == 0) {
+            freerun = true;
+            argv++;
+            argc--;
+        } else if(strcmp(argv[0], "--idle-loops") == 0) {
+            if(argc < 2) {
+                fprintf(stderr, "--idle-loops requires filename from which to read the idle loops to skip\n");
+                usage(progname);
+                exit(EXIT_FAILURE);
+            }
+            idle_loop_filename = argv[1];
+            argv += 2;
+            argc -= 2;
+        } else if(strcmp(argv[0], "--hle") == 0) {
+            hle = true;
+            argv++;
+            argc--;
+        } else if(strcmp(argv[0], "--hle-verify") == 0) {
+            hle = true;
+            hle_verify = true;
+            argv++;
+            argc--;
+        } else if(strcmp(argv[0], "--fast-boot") == 0) {
+            fast_boot = true;
+            argv++;
+            argc--;
+        } else if(strcmp(argv[0], "--state") == 0) {
+            if(argc < 2) {
+                fprintf(stderr, "--state requires a filename for save states\n");
+                usage(progname);
+                exit(EXIT_FAILURE);
+            }
+            state_filename = argv[1];
+            argv += 2;
+            argc -= 2;
+        } else if(strcmp(argv[0], "--rewind-megabytes") == 0) {
+            if(argc < 2) {
+                fprintf(stderr, "--rewind-megabytes requires the memory to keep for rewinding\n");
+                usage(progname);
+                exit(EXIT_FAILURE);
+            }
+            rewind_megabytes = strtoul(argv[1], NULL, 0);
+            argv += 2;
+            argc -= 2;
+        } else if(strcmp(argv[0], "--benchmark") == 0) {
+            if(argc < 2) {
+                fprintf(stderr, "--benchmark requires the number of frames to run\n");
+                usage(progname);
+                exit(EXIT_FAILURE);
+            }
+            benchmark_fields = strtoul(argv[1], NULL, 0);
+            freerun = true;
+            argv += 2;
+            argc -= 2;
+        } else if(strcmp(argv[0], "--run-ahead") == 0) {
+            if(argc < 2) {
+                fprintf(stderr, "--run-ahead requires the number of fields to run ahead\n");
+                usage(progname);
+                exit(EXIT_FAILURE);
+            }
+            run_ahead_fields = atoi(argv[1]);
+            argv += 2;
+            argc -= 2;
+        } else if(strcmp(argv[0], "--load-state") == 0) {
+            if(argc < 2) {
+                fprintf(stderr, "--load-state requires a filename from which to load a save state\n");
+                usage(progname);
+                exit(EXIT_FAILURE);
+            }
+            load_state_filename = argv[1];
+            argv += 2;
+            argc -= 2;
+        }
+
+#ifdef ENABLE_AUTOMATION
+	else if(strcmp(argv[0], "--record-controllers") == 0) {
+
+            if(argc < 2) {
+                fprintf(stderr, "--record-controllers requires filename to which to record controller state\n");
+                usage(progname);
+                exit(EXIT_FAILURE);
+            }
+            if(playback_controllers) {
                 fprintf(stderr, "only one of --record-controllers or --playback-controllers can be provided.\n");
                 usage(progname);
                 exit(EXIT_FAILURE);
@@ -1912,10 +3292,8 @@ int main(int argc, char **argv)
 	    argc -= 2;
 	    argv += 2;
 #else
-            if(argc < 2) {
-                fprintf(stderr, "The debugger is not enabled in this build\n");
-                exit(EXIT_FAILURE);
-            }
+            fprintf(stderr, "The debugger is not enabled in this build\n");
+            exit(EXIT_FAILURE);
 #endif
         }
 
@@ -1931,50 +3309,61 @@ int main(int argc, char **argv)
         exit(EXIT_FAILURE);
     }
 
+#ifdef ENABLE_AUTOMATION
+    if(record_controllers && (run_ahead_fields > 0)) {
+        // Changes would be recorded as seen by the fields run ahead
+        fprintf(stderr, "--run-ahead can't be used with --record-controllers\n");
+        exit(EXIT_FAILURE);
+    }
+#endif
+
     uint32_t stereoU8SampleRate;
     size_t preferredAudioBufferSizeBytes;
     PlatformInterface::Start(stereoU8SampleRate, preferredAudioBufferSizeBytes);
 
-    uint8_t rom_temp[32768];
-    FILE *fp;
-
     char *bios_name = argv[0];
     char *cart_name = argv[1];
 
-    fp = fopen(bios_name, "rb");
-    if(fp == NULL) {
+    ROMboard bios_rom(0, bios_name);
+    if(bios_rom.bytes == nullptr) {
         fprintf(stderr, "failed to open %s for reading\n", bios_name);
         exit(EXIT_FAILURE);
     }
-    size_t bios_length = fread(rom_temp, 1, sizeof(rom_temp), fp);
-    if(bios_length != 0x2000) {
-        fprintf(stderr, "ROM read from %s was unexpectedly %zd bytes\n", bios_name, bios_length);
+    if(bios_rom.length != 0x2000) {
+        fprintf(stderr, "ROM read from %s was unexpectedly %zd bytes\n", bios_name, bios_rom.length);
         exit(EXIT_FAILURE);
     }
-    fclose(fp);
-    ROMboard bios_rom(0, bios_length, rom_temp);
 
-    audio_flush_func stereo_audio_flush = [](uint8_t *buf, size_t sz){ PlatformInterface::EnqueueStereoU8AudioSamples(buf, sz); };
+    Benchmark benchmark(benchmark_fields);
 
-    tms9918_scanout_func platform_scanout = [](const uint8_t *registers, const uint8_t *memory)->uint8_t {
+    audio_flush_func stereo_audio_flush = [&benchmark](uint8_t *buf, size_t sz){
+        benchmark.time(Benchmark::PLATFORM, [buf, sz]() { PlatformInterface::EnqueueStereoU8AudioSamples(buf, sz); });
+    };
+
+    tms9918_scanout_func platform_scanout = [](const uint8_t *registers, const uint8_t *memory, TMS9918A::Background& background)->uint8_t {
         uint8_t status_result;
-        PlatformInterface::Frame(registers, memory, status_result, 3.579f);
+        PlatformInterface::Frame(registers, memory, background, status_result, 3.579f);
         return status_result;
     };
 
-    fp = fopen(cart_name, "rb");
-    if(fp == NULL) {
+    // For fields that aren't shown
+    tms9918_scanout_func status_scanout = [](const uint8_t *registers, const uint8_t *memory, [[maybe_unused]] TMS9918A::Background& background)->uint8_t {
+        return TMS9918A::GetStatusFromSpriteConfiguration(registers, memory);
+    };
+
+    ROMboard cart_rom(0x8000, cart_name);
+    if(cart_rom.bytes == nullptr) {
         fprintf(stderr, "failed to open %s for reading\n", cart_name);
         exit(EXIT_FAILURE);
     }
-    size_t cart_length = fread(rom_temp, 1, sizeof(rom_temp), fp);
-    if(cart_length < 0x2000) {
-        fprintf(stderr, "ROM read from %s was unexpectedly short (%zd bytes)\n", cart_name, cart_length);
+    if(cart_rom.length < 0x2000) {
+        fprintf(stderr, "ROM read from %s was unexpectedly short (%zd bytes)\n", cart_name, cart_rom.length);
+        exit(EXIT_FAILURE);
+    }
+    if(cart_rom.length > MAXIMUM_MEGACART_LENGTH) {
+        fprintf(stderr, "ROM read from %s was unexpectedly long (%zd bytes)\n", cart_name, cart_rom.length);
         exit(EXIT_FAILURE);
     }
-    fclose(fp);
-
-    ROMboard cart_rom(0x8000, cart_length, rom_temp);
     RAMboard RAM(RAM_START, RAM_ADDRESS_MASK + 1, RAM_LENGTH);
 
     clk_t clk = 0;
@@ -2026,7 +3415,7 @@ int main(int argc, char **argv)
     uint8_t joystick_state[2] = {127, 127};
     uint8_t keypad_state[2] = {127, 127};
 
-    auto get_controller_state = [&clk, &joystick_state, &keypad_state, recording_output, record_controllers, playback_controllers, &playback_events](int index, bool JoystickNotKeypad) -> uint8_t {
+    auto get_controller_state = [&clk, &joystick_state, &keypad_state, recording_output, record_controllers, playback_controllers](int index, bool JoystickNotKeypad) -> uint8_t {
         uint8_t previous = JoystickNotKeypad ? joystick_state[index] : keypad_state[index];
         uint8_t current = GetPlatformControllerState(index, JoystickNotKeypad);
         if(record_controllers && (current != previous)) {
@@ -2039,26 +3428,37 @@ int main(int argc, char **argv)
             }
         }
         if(playback_controllers) {
-            if(playback_events.size() == 0) {
-                exit(0);
-            }
+            // changed by CONTROLLER_PLAYBACK events
             current = previous;
-            const ControllerEvent& next = playback_events.front();
-            if((clk >= next.clk) && (index == next.index) && (JoystickNotKeypad == next.JoystickNotKeypad)) {
-                current = (previous | next.bits_set) & ~next.bits_cleared;
-                playback_events.pop_front();
-            }
         }
         (JoystickNotKeypad ? joystick_state[index] : keypad_state[index]) = current;
         return current;
     };
 
+    // Apply the earliest recorded change, and return in "next" when the
+    // following one is due, or false at the end of the recording.
+    auto play_controller_event = [&joystick_state, &keypad_state, &playback_events](clk_t& next) -> bool {
+        const ControllerEvent& event = playback_events.front();
+        uint8_t& state = event.JoystickNotKeypad ? joystick_state[event.index] : keypad_state[event.index];
+        state = (state | event.bits_set) & ~event.bits_cleared;
+        playback_events.pop_front();
+        if(playback_events.empty()) {
+            return false;
+        }
+        next = playback_events.front().clk;
+        return true;
+    };
+
 #else
 
     auto get_controller_state = [](int index, bool JoystickNotKeypad) -> uint8_t {
         return GetPlatformControllerState(index, JoystickNotKeypad);
     };
 
+    auto play_controller_event = [](clk_t& next) -> bool {
+        return false;
+    };
+
 #endif
 
     bool save_vdp = false;
@@ -2068,6 +3468,21 @@ int main(int argc, char **argv)
     ColecovisionContext *colecovision_context = new ColecovisionContext;
     set_colecovision_context(colecovision_context, RAM, bios_rom, cart_rom, colecohw, &clk, &colecohw->vdp_interrupt_status);
 
+    std::vector<uint8_t> idle_loop_allowed;
+    idle_loop_cartridge_hash = cart_rom.image->hash;
+    if(idle_loop_filename) {
+        if(!LoadIdleLoopList(idle_loop_filename, idle_loop_cartridge_hash, idle_loop_allowed)) {
+            exit(EXIT_FAILURE);
+        }
+        colecovision_context->idle_loop_allowed = idle_loop_allowed.data();
+    }
+    idle_loop_context = colecovision_context;
+
+    if(hle) {
+        os7_hle = new OS7HLE(colecohw, hle_verify);
+        colecovision_context->hle = os7_hle;
+    }
+
     [[maybe_unused]] Debugger *debugger = NULL;
 #ifdef PROVIDE_DEBUGGER
     if(do_debugger) {
@@ -2077,6 +3492,51 @@ int main(int argc, char **argv)
 
     Z80Reset(&z80state);
 
+    // Code in a MegaCart's bank window changes with the bank, so each bank
+    // has its own block cache, swapped in before running the Z80.  Compiled
+    // ROMs don't cover MegaCarts.
+    std::vector<Z80_CACHE*> bank_block_caches;
+    for(int bank = 0; bank < colecovision_context->bank_count; bank++) {
+        bank_block_caches.push_back(Z80CreateBlockCache());
+    }
+    if(!bank_block_caches.empty()) {
+        z80state.block_cache = bank_block_caches[colecovision_context->bank];
+    } else {
+        z80state.block_cache = Z80CreateBlockCache();
+        if(z80state.block_cache) {
+            const CompiledROM *compiled = FindCompiledROM(bios_rom.image->hash, cart_rom.image->hash);
+            if(compiled) {
+                Z80SetCompiledBlocks(z80state.block_cache, compiled->blocks, compiled->count);
+            }
+        }
+    }
+
+    EventScheduler scheduler;
+    scheduler.schedule(clocks_per_retrace, VRETRACE);
+    scheduler.schedule(audio_batch_clocks, AUDIO_BATCH);
+
+    Machine machine(z80state, RAM, *colecohw, *colecovision_context, clk, scheduler, bios_rom.image->hash, cart_rom.image->hash);
+
+    BootSnapshot boot_snapshot(bios_rom.image->hash, cart_rom.image->hash);
+    bool restored = false;
+    if(load_state_filename) {
+        if(!machine.load_file(load_state_filename)) {
+            fprintf(stderr, "couldn't load a save state of this machine from %s\n", load_state_filename);
+            exit(EXIT_FAILURE);
+        }
+        restored = true;
+    } else if(fast_boot) {
+        restored = boot_snapshot.restore(machine);
+    }
+#ifdef ENABLE_AUTOMATION
+    if(restored) {
+        // Changes recorded before the restored state all apply at once
+        for(ControllerEvent& event: playback_events) {
+            event.clk = std::max(event.clk, clk);
+        }
+    }
+#endif
+
 #ifdef PROVIDE_DEBUGGER
     if(debugger) {
         enter_debugger = true;
@@ -2084,13 +3544,88 @@ int main(int argc, char **argv)
     }
 #endif
 
+    if(debugger) {
+        scheduler.schedule(clk + debugger_checkpoint_clocks, DEBUGGER_CHECKPOINT);
+    }
+#ifdef ENABLE_AUTOMATION
+    if(playback_controllers) {
+        scheduler.schedule(playback_events.front().clk, CONTROLLER_PLAYBACK);
+    }
+#endif
+
+    // With --run-ahead, at the end of each field the machine is saved, run
+    // that many fields further with the controllers as they are now, without
+    // audio and showing only the last field, then loaded back.  Games read
+    // the controllers in their NMI handler and draw the result a field or
+    // two later, which is then shown that much sooner.  Fields run for real
+    // aren't shown, only their VDP status is computed.
+    StateWriter run_ahead_state;
+    auto run_ahead = [colecovision_context, &clk, colecohw, platform_scanout, status_scanout, &scheduler, &bank_block_caches, &machine, &run_ahead_state, run_ahead_fields, &benchmark]() {
+        run_ahead_state.bytes.clear();
+        machine.save(run_ahead_state);
+
+        // Other events, like controller playback, wait for the machine to be
+        // loaded back
+        std::vector<ScheduledEvent> deferred;
+        int fields = 0;
+        while(fields < run_ahead_fields) {
+            if(colecovision_context->do_nmi) {
+                colecovision_context->do_nmi = 0;
+                scheduler.schedule(clk, NMI);
+            }
+
+            ScheduledEvent event;
+            if(scheduler.pop_due(clk, event)) {
+                switch(event.kind) {
+                    case VRETRACE:
+                        fields++;
+                        colecohw->vdp.perform_scanout((fields == run_ahead_fields) ? platform_scanout : status_scanout);
+                        colecohw->vdp.vsync();
+                        cv_check_nmi(colecovision_context);
+                        scheduler.schedule(event.clk + clocks_per_retrace, VRETRACE);
+                        break;
+
+                    case NMI:
+                        clk += Z80NonMaskableInterrupt (&z80state, colecovision_context);
+                        break;
+
+                    case AUDIO_BATCH:
+                        scheduler.schedule(event.clk + audio_batch_clocks, AUDIO_BATCH);
+                        break;
+
+                    default:
+                        deferred.push_back(event);
+                        break;
+                }
+                continue;
+            }
+
+            if(!bank_block_caches.empty()) {
+                z80state.block_cache = bank_block_caches[colecovision_context->bank];
+            }
+            clk += benchmark.emulate_z80(z80state, [&]() {
+                return Z80Emulate(&z80state, scheduler.next_deadline() - clk, colecovision_context);
+            });
+        }
+
+        machine.load(run_ahead_state.bytes.data(), run_ahead_state.bytes.size());
+        for(const ScheduledEvent& event: deferred) {
+            scheduler.schedule(event.clk, event.kind);
+        }
+    };
+
+    RewindBuffer rewind_buffer(rewind_megabytes * 1024 * 1024);
+    bool field_ended = false;
+    bool rewinding = false;
+
     std::chrono::time_point<std::chrono::system_clock> emulation_start_time = std::chrono::system_clock::now();
+    clk_t emulation_start_clock = clk;
     uint32_t prevTick;
 #if defined(ROSA)
     prevTick = HAL_GetTick();
 #endif
 
-    PlatformInterface::MainLoopBodyFunc main_loop_body = [colecovision_context, &clk, debugger, colecohw, &save_vdp, stereo_audio_flush, platform_scanout, &emulation_start_time, &prevTick, freerun]() {
+    PlatformInterface::MainLoopBodyFunc main_loop_body = [colecovision_context, &clk, debugger, colecohw, &save_vdp, stereo_audio_flush, platform_scanout, &emulation_start_time, &prevTick, freerun, &scheduler, play_controller_event, &bank_block_caches, &emulation_start_clock, &boot_snapshot, &machine, &state_filename, &rewind_buffer, &field_ended, &rewinding, status_scanout, run_ahead, run_ahead_fields, &benchmark]() {
         (void)debugger; // If !PROVIDE_DEBUGGER then debugger is not referenced.
         (void)prevTick; // If !ROSA then prevTick is not referenced. // XXX move iterate call to platform main loop
 
@@ -2100,10 +3635,20 @@ int main(int argc, char **argv)
             enter_debugger = false;
         } else
 #endif
+        if(rewinding) {
+            // One field back per field of real time, shown without changing
+            // the VDP's state.  Showing it also has the platform see the key
+            // being released.
+            if(rewind_buffer.step_back(machine)) {
+                scheduler.reschedule(DEBUGGER_CHECKPOINT, clk + debugger_checkpoint_clocks);
+            }
+            platform_scanout(colecohw->vdp.registers.data(), colecohw->vdp.memory.data(), colecohw->vdp.background);
+            sleep_for(1000 / 60);
+        } else
         {
             std::chrono::time_point<std::chrono::system_clock> now = std::chrono::system_clock::now();
             auto micros_since_start = std::chrono::duration_cast<std::chrono::microseconds>(now - emulation_start_time);
-            clk_t clock_now = machine_clock_rate * micros_since_start.count() / 1000000;
+            clk_t clock_now = emulation_start_clock + machine_clock_rate * micros_since_start.count() / 1000000;
             if((!freerun) && (clock_now < clk)) {
                 /* if we get ahead somehow, sleep a little to fall back */
                 sleep_for(2); // 1ms);
@@ -2113,13 +3658,104 @@ int main(int argc, char **argv)
             target_clock = clk + machine_clock_rate / 120;
             if(false) printf("was at %llu, need to be at %llu, need %llu (%.2f ms), will run %llu (%.2f ms)\n", clk, clock_now, clock_now - clk, (clock_now - clk) * 1000.0f / machine_clock_rate, target_clock - clk, (target_clock - clk) * 1000.0f / machine_clock_rate);
 
-            static constexpr uint32_t iterated_clock_quantum = 10000;
-
 #if defined(ROSA)
             // RoDebugOverlayPrintf("%ld\n", (int)(target_clock - clk));
 #endif /* ROSA */
 
-            while(clk < target_clock) {
+            while(true) {
+
+                // The NMI line rose during the last instructions emulated
+                // (see Z80_OUTPUT_BYTE in z80user.h) or the events handled
+                // since then; the NMI is taken before anything else runs.
+                if(colecovision_context->do_nmi) {
+                    colecovision_context->do_nmi = 0;
+                    scheduler.schedule(clk, NMI);
+                }
+
+                ScheduledEvent event;
+                if(scheduler.pop_due(clk, event)) {
+
+                    switch(event.kind) {
+
+                        case VRETRACE:
+                            benchmark.time(Benchmark::SCANOUT, [&]() {
+                                colecohw->vdp.perform_scanout((run_ahead_fields > 0) ? status_scanout : platform_scanout);
+                            });
+                            if(save_vdp) {
+                                static int which = 0;
+                                SaveVDPState(&colecohw->vdp, which++);
+                                save_vdp = false;
+                            }
+
+                            colecohw->vdp.vsync();
+                            cv_check_nmi(colecovision_context);
+                            scheduler.schedule(event.clk + clocks_per_retrace, VRETRACE);
+                            field_ended = true;
+                            if(benchmark.field_ended()) {
+                                benchmark.report(clk);
+                                exit(0);
+                            }
+                            break;
+
+                        case NMI:
+                            benchmark.time(Benchmark::Z80, [&]() {
+                                clk += Z80NonMaskableInterrupt (&z80state, colecovision_context);
+                            });
+                            break;
+
+                        case AUDIO_BATCH:
+                            benchmark.time(Benchmark::AUDIO, [&]() {
+                                colecohw->fill_flush_audio(clk, stereo_audio_flush);
+                            });
+                            scheduler.schedule(event.clk + audio_batch_clocks, AUDIO_BATCH);
+                            break;
+
+                        case CONTROLLER_PLAYBACK: {
+                            clk_t next;
+                            if(!play_controller_event(next)) {
+                                if(benchmark.fields > 0) {
+                                    // Keep going to the last frame
+                                    break;
+                                }
+                                ReportIdleLoops();
+                                ReportHLE();
+                                exit(0);
+                            }
+                            scheduler.schedule(next, CONTROLLER_PLAYBACK);
+                            break;
+                        }
+
+                        case DEBUGGER_CHECKPOINT:
+#ifdef PROVIDE_DEBUGGER
+                            if(enter_debugger || debugger->should_debug(&z80state)) {
+                                debugger->go(stdin, &z80state);
+                                enter_debugger = false;
+                            }
+#endif
+                            scheduler.schedule(event.clk + debugger_checkpoint_clocks, DEBUGGER_CHECKPOINT);
+                            break;
+                    }
+                    continue;
+                }
+
+                if(boot_snapshot.capturing && boot_snapshot.watch(z80state, colecohw->vdp)) {
+                    boot_snapshot.save(machine);
+                }
+
+                if(field_ended) {
+                    if(rewind_buffer.budget > 0) {
+                        rewind_buffer.push(machine);
+                    }
+                    if(run_ahead_fields > 0) {
+                        run_ahead();
+                    }
+                    field_ended = false;
+                }
+
+                if(clk >= target_clock) {
+                    break;
+                }
+
 #if 0
                 std::string dummy;
                 {
@@ -2135,34 +3771,19 @@ int main(int argc, char **argv)
                 // printf("PC is %04X\n", z80state.pc);
 #endif
 
-                clk_t clocks_this_step = Z80Emulate(&z80state, iterated_clock_quantum, colecovision_context);
-                clk += clocks_this_step;
-
-		// If Z80_PROCESS_CYCLES in z80user.h detects the clock
-                // crossed a video field boundary, it sets "do_vretrace_work"
-                // and causes Emulate to return early.
-                if(colecovision_context->do_vretrace_work) {
-                    colecovision_context->do_vretrace_work = 0;
-                    
-                    colecohw->vdp.perform_scanout(platform_scanout);
-                    if(save_vdp) {
-                        static int which = 0;
-                        SaveVDPState(&colecohw->vdp, which++);
-                        save_vdp = false;
-                    }
-
-                    colecohw->vdp.vsync();
-                }
-
-                colecohw->fill_flush_audio(clk, stereo_audio_flush);
-
-		// If Z80_PROCESS_CYCLES in z80user.h detects NMI
-		// was asserted (from the VDP vretrace and VDP registers),
-		// it sets "do_nmi" and causes Emulate to return early.
-                if(colecovision_context->do_nmi) {
-                    colecovision_context->do_nmi = 0;
-                    clk += Z80NonMaskableInterrupt (&z80state, colecovision_context);
+                // Run exactly up to the next event, or to the end of this
+                // slice of real time, whichever comes first.
+                clk_t deadline = std::min(scheduler.next_deadline(), target_clock);
+                if(!bank_block_caches.empty()) {
+                    z80state.block_cache = bank_block_caches[colecovision_context->bank];
                 }
+                clk_t clocks_this_step;
+                benchmark.time(Benchmark::Z80, [&]() {
+                    clocks_this_step = benchmark.emulate_z80(z80state, [&]() {
+                        return Z80Emulate(&z80state, deadline - clk, colecovision_context);
+                    });
+                });
+                clk += clocks_this_step;
 
 #if 0
                 if(false && is_HALT) {
@@ -2173,17 +3794,7 @@ int main(int argc, char **argv)
                     printf("HALT took %llu clocks\n", clocks_this_step);
                 }
 #endif
-
-#ifdef PROVIDE_DEBUGGER
-                if(debugger) {
-                    if(enter_debugger || debugger->should_debug(&z80state)) {
-                        debugger->go(stdin, &z80state);
-                        enter_debugger = false;
-                    }
-                }
-#endif
             }
-
 #if defined(ROSA)
             uint32_t nowTick = HAL_GetTick();
 #warning Setting this to + 16 made USB keyboard stop working.  
@@ -2205,6 +3816,25 @@ int main(int argc, char **argv)
                 dump_some_audio = 100;
             } else if(e.type == PlatformInterface::SAVE_VDP_STATE) {
                 save_vdp = true;
+            } else if(e.type == PlatformInterface::SAVE_STATE) {
+                if(!machine.save_file(state_filename)) {
+                    fprintf(stderr, "couldn't save state to %s\n", state_filename.c_str());
+                }
+            } else if(e.type == PlatformInterface::LOAD_STATE) {
+                if(machine.load_file(state_filename)) {
+                    scheduler.reschedule(DEBUGGER_CHECKPOINT, clk + debugger_checkpoint_clocks);
+                    emulation_start_time = std::chrono::system_clock::now();
+                    emulation_start_clock = clk;
+                } else {
+                    fprintf(stderr, "couldn't load a save state of this machine from %s\n", state_filename.c_str());
+                }
+            } else if(e.type == PlatformInterface::REWIND) {
+                rewinding = e.value != 0;
+                if(!rewinding) {
+                    // Throttle from where the rewind stopped
+                    emulation_start_time = std::chrono::system_clock::now();
+                    emulation_start_clock = clk;
+                }
             } else if(e.type == PlatformInterface::DEBUG_VDP_WRITES) {
                 do_save_images_on_vdp_write = !do_save_images_on_vdp_write;
             } else {
@@ -2215,8 +3845,12 @@ int main(int argc, char **argv)
 
     };
 
+    benchmark.start(clk);
     PlatformInterface::MainLoopAndShutdown(main_loop_body);
 
+    ReportIdleLoops();
+    ReportHLE();
+
     return 0;
 }
 
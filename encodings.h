@@ -0,0 +1,77 @@
+/* encodings.h
+ * Decoding tables for memory operands, conditions, RST addresses, and 
+ * overflows, shared by emulate() and code compiled from its handlers.
+ *
+ * Copyright (c) 2012-2017 Lin Ke-Fong
+ *
+ * This code is free, do whatever you want with it.
+ */
+
+#ifndef __ENCODINGS_INCLUDED__
+#define __ENCODINGS_INCLUDED__
+
+/* Indirect (HL) or prefixed indexed (IX + d) and (IY + d) memory operands are
+ * encoded using the 3 bits "110" (0x06).
+ */
+
+#define INDIRECT_HL     0x06
+
+/* Condition codes are encoded using 2 or 3 bits.  The xor table is needed for
+ * negated conditions, it is used along with the and table.
+ */
+
+static const int XOR_CONDITION_TABLE[8] = {
+
+        Z80_Z_FLAG,
+        0,
+        Z80_C_FLAG,
+        0,
+        Z80_P_FLAG,
+        0,
+        Z80_S_FLAG,
+        0,
+
+};
+
+static const int AND_CONDITION_TABLE[8] = {
+
+        Z80_Z_FLAG,
+        Z80_Z_FLAG,
+        Z80_C_FLAG,
+        Z80_C_FLAG,
+        Z80_P_FLAG,
+        Z80_P_FLAG,
+        Z80_S_FLAG,
+        Z80_S_FLAG,
+
+};
+
+/* RST instruction restart addresses, encoded by Y() bits of the opcode. */
+
+static const int RST_TABLE[8] = {
+
+        0x00,
+        0x08,
+        0x10,
+        0x18,
+        0x20,
+        0x28,
+        0x30,
+        0x38,
+
+};      
+
+/* There is an overflow if the xor of the carry out and the carry of the most
+ * significant bit is not zero.
+ */
+
+static const int OVERFLOW_TABLE[4] = {
+                        
+	0,
+       	Z80_V_FLAG,
+       	Z80_V_FLAG,
+       	0,
+
+};
+
+#endif
@@ -30,7 +30,8 @@
 #define OPCODE_OTIR             0xb3
 
 /* Instruction numbers, opcodes are converted to these numbers using tables
- * generated by maketables.c.
+ * generated by maketables.c. The "INDEXED" instructions are the (IX + d) and
+ * (IY + d) forms of the "INDIRECT_HL" ones that follow a 0xdd or 0xfd prefix.
  */
 
 enum {
@@ -41,8 +42,11 @@ enum {
         LD_R_N,
 
         LD_R_INDIRECT_HL,
+        LD_R_INDEXED,
         LD_INDIRECT_HL_R,
+        LD_INDEXED_R,
         LD_INDIRECT_HL_N,
+        LD_INDEXED_N,
 
         LD_A_INDIRECT_BC,
         LD_A_INDIRECT_DE,
@@ -86,39 +90,49 @@ enum {
         ADD_R,
         ADD_N,
         ADD_INDIRECT_HL,
+        ADD_INDEXED,
 
         ADC_R,
         ADC_N,
         ADC_INDIRECT_HL,
+        ADC_INDEXED,
 
         SUB_R,
         SUB_N,
         SUB_INDIRECT_HL,
+        SUB_INDEXED,
 
         SBC_R,
         SBC_N,
         SBC_INDIRECT_HL,
+        SBC_INDEXED,
 
         AND_R,
         AND_N,
         AND_INDIRECT_HL,
+        AND_INDEXED,
 
         XOR_R,
         XOR_N,
         XOR_INDIRECT_HL,
+        XOR_INDEXED,
 
         OR_R,
         OR_N,
         OR_INDIRECT_HL,
+        OR_INDEXED,
 
         CP_R,
         CP_N,
         CP_INDIRECT_HL,
+        CP_INDEXED,
 
         INC_R,
         INC_INDIRECT_HL,
+        INC_INDEXED,
         DEC_R,
         DEC_INDIRECT_HL,
+        DEC_INDEXED,
 
         /* 16-bit arithmetic group. */
 
@@ -157,20 +171,28 @@ enum {
 
         RLC_R,
         RLC_INDIRECT_HL,
+        RLC_INDEXED,
         RL_R,
         RL_INDIRECT_HL,
+        RL_INDEXED,
         RRC_R,
         RRC_INDIRECT_HL,
+        RRC_INDEXED,
         RR_R,
         RR_INDIRECT_HL,
+        RR_INDEXED,
         SLA_R,
         SLA_INDIRECT_HL,
+        SLA_INDEXED,
         SLL_R,
         SLL_INDIRECT_HL,
+        SLL_INDEXED,
         SRA_R,
         SRA_INDIRECT_HL,
+        SRA_INDEXED,
         SRL_R,
         SRL_INDIRECT_HL,
+        SRL_INDEXED,
 
         RLD_RRD,                /* Handle "RLD" and "RRD". */
 
@@ -178,10 +200,13 @@ enum {
 
         BIT_B_R,
         BIT_B_INDIRECT_HL,
+        BIT_B_INDEXED,
         SET_B_R,
         SET_B_INDIRECT_HL,
+        SET_B_INDEXED,
         RES_B_R,
         RES_B_INDIRECT_HL,
+        RES_B_INDEXED,
 
         /* Jump group. */
 
@@ -224,6 +249,7 @@ enum {
         /* Prefix group. */
 
         CB_PREFIX,
+        INDEXED_CB_PREFIX,
         DD_PREFIX,
         FD_PREFIX,
         ED_PREFIX,
@@ -16,7 +16,7 @@
 #define HC_FLAGS        (Z80_H_FLAG | Z80_C_FLAG)
 
 #define A               (state->registers.byte[Z80_A])
-#define F               (state->registers.byte[Z80_F])
+#define F_REGISTER      (state->registers.byte[Z80_F])
 #define B               (state->registers.byte[Z80_B])
 #define C               (state->registers.byte[Z80_C])
 
@@ -28,6 +28,43 @@
 
 #define HL_IX_IY        *((unsigned short *) registers[6])
 
+#ifdef Z80_LAZY_FLAGS
+
+/* With Z80_LAZY_FLAGS, emulate() records in lazy the last arithmetic 
+ * operation whose flags are not computed yet, and using F computes them 
+ * first. FLUSH_FLAGS does the same for code using F through AF, 
+ * DISCARD_FLAGS drops them before F is overwritten, and CARRY_FLAG reads 
+ * the carry without computing the other flags.
+ */
+
+#define F               (*(lazy.kind != LAZY_NONE                       \
+                                ? flush_flags(state, &lazy)             \
+                                : &F_REGISTER))
+
+#define FLUSH_FLAGS                                                     \
+{                                                                       \
+        if (lazy.kind != LAZY_NONE)                                     \
+                                                                        \
+                flush_flags(state, &lazy);                              \
+}
+
+#define DISCARD_FLAGS   lazy.kind = LAZY_NONE
+
+#define CARRY_FLAG      (lazy.kind == LAZY_NONE                         \
+                                ? F_REGISTER & Z80_C_FLAG               \
+                                : lazy.kind < LAZY_INC                  \
+                                ? (lazy.result >> 8) & 0x01             \
+                                : lazy.second)
+
+#else
+
+#define F               F_REGISTER
+#define FLUSH_FLAGS     {}
+#define DISCARD_FLAGS
+#define CARRY_FLAG      (F & Z80_C_FLAG)
+
+#endif
+
 /* Opcode decoding macros.  Y() is bits 5-3 of the opcode, Z() is bits 2-0,
  * P() bits 5-4, and Q() bits 4-3.
  */
@@ -45,8 +82,21 @@
 #define S(s)            *((unsigned char *) state->register_table[(s)])
 #define RR(rr)          *((unsigned short *) registers[(rr) + 8])
 #define SS(ss)          *((unsigned short *) registers[(ss) + 12])
+#ifdef Z80_LAZY_FLAGS
+
+#define CC(cc)          (lazy.kind != LAZY_NONE                         \
+                                ? lazy_condition(lazy, (cc))            \
+                                : (F_REGISTER                           \
+                                        ^ XOR_CONDITION_TABLE[(cc)])    \
+                                        & AND_CONDITION_TABLE[(cc)])
+
+#else
+
 #define CC(cc)          ((F ^ XOR_CONDITION_TABLE[(cc)])                \
                                 & AND_CONDITION_TABLE[(cc)])
+
+#endif
+
 #define DD(dd)          CC(dd)
 
 /* Macros to read constants, displacements, or addresses from code. */
@@ -105,40 +155,34 @@
                                                 
 #define READ_INDIRECT_HL(x)                                             \
 {                                                                       \
-        if (registers == state->register_table) {			\
-                                                                        \
-                READ_BYTE(HL, (x));                                     \
-                                                                        \
-        } else {                                                        \
-                                                                        \
-                int     d;                                              \
-                                                                        \
-                READ_D(d);                                              \
-                d += HL_IX_IY;                                          \
-                READ_BYTE(d, (x));                                      \
-                                                                        \
-                elapsed_cycles += 5;                                    \
-                                                                        \
-        }                                                               \
+        READ_BYTE(HL, (x));                                             \
 }
 
 #define WRITE_INDIRECT_HL(x)                                            \
 {                                                                       \
-        if (registers == state->register_table) {			\
-                                                                        \
-                WRITE_BYTE(HL, (x));                                    \
-                                                                        \
-        } else {                                                        \
+        WRITE_BYTE(HL, (x));                                            \
+}
+
+#define READ_INDEXED(x)                                                 \
+{                                                                       \
+        int     d;                                                      \
                                                                         \
-                int     d;                                              \
+        READ_D(d);                                                      \
+        d += HL_IX_IY;                                                  \
+        READ_BYTE(d, (x));                                              \
                                                                         \
-                READ_D(d);                                              \
-                d += HL_IX_IY;                                          \
-                WRITE_BYTE(d, (x));                                     \
+        elapsed_cycles += 5;                                            \
+}
+
+#define WRITE_INDEXED(x)                                                \
+{                                                                       \
+        int     d;                                                      \
                                                                         \
-                elapsed_cycles += 5;                                    \
+        READ_D(d);                                                      \
+        d += HL_IX_IY;                                                  \
+        WRITE_BYTE(d, (x));                                             \
                                                                         \
-        }                                                               \
+        elapsed_cycles += 5;                                            \
 }
 
 /* Stack operation macros. */
@@ -168,6 +212,94 @@
 
 /* 8-bit arithmetic and logic operations. */
 
+#ifdef Z80_LAZY_FLAGS
+
+/* The flags of these are computed by lazy_flags() in z80emu.c. */
+
+#define LAZY_OPERATION(operation, u, v, w)                              \
+{                                                                       \
+        lazy.kind = (operation);                                        \
+        lazy.first = (u);                                               \
+        lazy.second = (v);                                              \
+        lazy.result = (w);                                              \
+}
+
+#define ADD(x)                                                          \
+{                                                                       \
+        int     a, z;                                                   \
+                                                                        \
+        a = A;                                                          \
+        z = a + (x);                                                    \
+        LAZY_OPERATION(LAZY_ADD, a, (x), z);                            \
+                                                                        \
+        A = z;                                                          \
+}
+
+#define ADC(x)                                                          \
+{                                                                       \
+        int     a, z;                                                   \
+                                                                        \
+        a = A;                                                          \
+        z = a + (x) + CARRY_FLAG;                                       \
+        LAZY_OPERATION(LAZY_ADD, a, (x), z);                            \
+                                                                        \
+        A = z;                                                          \
+}
+
+#define SUB(x)                                                          \
+{                                                                       \
+        int     a, z;                                                   \
+                                                                        \
+        a = A;                                                          \
+        z = a - (x);                                                    \
+        LAZY_OPERATION(LAZY_SUB, a, (x), z);                            \
+                                                                        \
+        A = z;                                                          \
+}
+
+#define SBC(x)                                                          \
+{                                                                       \
+        int     a, z;                                                   \
+                                                                        \
+        a = A;                                                          \
+        z = a - (x) - CARRY_FLAG;                                       \
+        LAZY_OPERATION(LAZY_SUB, a, (x), z);                            \
+                                                                        \
+        A = z;                                                          \
+}
+
+#define CP(x)                                                           \
+{                                                                       \
+        int     a;                                                      \
+                                                                        \
+        a = A;                                                          \
+        LAZY_OPERATION(LAZY_CP, a, (x), a - (x));                       \
+}
+
+#define INC(x)                                                          \
+{                                                                       \
+        int     z, c;                                                   \
+                                                                        \
+        z = (x) + 1;                                                    \
+        c = CARRY_FLAG;                                                 \
+        LAZY_OPERATION(LAZY_INC, (x), c, z);                            \
+                                                                        \
+        (x) = z;                                                        \
+}
+
+#define DEC(x)                                                          \
+{                                                                       \
+        int     z, c;                                                   \
+                                                                        \
+        z = (x) - 1;                                                    \
+        c = CARRY_FLAG;                                                 \
+        LAZY_OPERATION(LAZY_DEC, (x), c, z);                            \
+                                                                        \
+        (x) = z;                                                        \
+}
+
+#else
+
 #define ADD(x)                                                          \
 {                                                                       \
         int     a, z, c, f;                                             \
@@ -238,21 +370,6 @@
         F = f;                                                          \
 }
 
-#define AND(x)                                                          \
-{                                                                       \
-        F = SZYXP_FLAGS_TABLE[A &= (x)] | Z80_H_FLAG;                   \
-}       
-
-#define OR(x)                                                           \
-{                                                                       \
-        F = SZYXP_FLAGS_TABLE[A |= (x)];                                \
-}
-
-#define XOR(x)                                                          \
-{                                                                       \
-        F = SZYXP_FLAGS_TABLE[A ^= (x)];                                \
-}
-         
 #define CP(x)                                                           \
 {                                                                       \
         int     a, z, c, f;                                             \
@@ -303,6 +420,26 @@
         F = f;                                                          \
 }
 
+#endif
+
+#define AND(x)                                                          \
+{                                                                       \
+        DISCARD_FLAGS;                                                  \
+        F = SZYXP_FLAGS_TABLE[A &= (x)] | Z80_H_FLAG;                   \
+}       
+
+#define OR(x)                                                           \
+{                                                                       \
+        DISCARD_FLAGS;                                                  \
+        F = SZYXP_FLAGS_TABLE[A |= (x)];                                \
+}
+
+#define XOR(x)                                                          \
+{                                                                       \
+        DISCARD_FLAGS;                                                  \
+        F = SZYXP_FLAGS_TABLE[A ^= (x)];                                \
+}
+         
 /* 0xcb prefixed logical operations. */
 
 #define RLC(x)                                                          \
@@ -311,6 +448,7 @@
                                                                         \
         c = (x) >> 7;                                                   \
         (x) = ((x) << 1) | c;                                           \
+        DISCARD_FLAGS;                                                  \
         F = SZYXP_FLAGS_TABLE[(x) & 0xff] | c;                          \
 }
 
@@ -319,7 +457,8 @@
         int     c;                                                      \
                                                                         \
         c = (x) >> 7;                                                   \
-        (x) = ((x) << 1) | (F & Z80_C_FLAG);                            \
+        (x) = ((x) << 1) | CARRY_FLAG;                                  \
+        DISCARD_FLAGS;                                                  \
         F = SZYXP_FLAGS_TABLE[(x) & 0xff] | c;                          \
 }
 
@@ -329,6 +468,7 @@
                                                                         \
         c = (x) & 0x01;                                                 \
         (x) = ((x) >> 1) | (c << 7);                                    \
+        DISCARD_FLAGS;                                                  \
         F = SZYXP_FLAGS_TABLE[(x) & 0xff] | c;                          \
 }
 
@@ -337,7 +477,8 @@
         int     c;                                                      \
                                                                         \
         c = (x) & 0x01;                                                 \
-        (x) = ((x) >> 1) | ((F & Z80_C_FLAG) << 7);                     \
+        (x) = ((x) >> 1) | (CARRY_FLAG << 7);                           \
+        DISCARD_FLAGS;                                                  \
         F = SZYXP_FLAGS_TABLE[(x) & 0xff] | c;                          \
 }
 
@@ -347,6 +488,7 @@
                                                                         \
         c = (x) >> 7;                                                   \
         (x) <<= 1;                                                      \
+        DISCARD_FLAGS;                                                  \
         F = SZYXP_FLAGS_TABLE[(x) & 0xff] | c;                          \
 }
 
@@ -356,6 +498,7 @@
                                                                         \
         c = (x) >> 7;                                                   \
         (x) = ((x) << 1) | 0x01;                                        \
+        DISCARD_FLAGS;                                                  \
         F = SZYXP_FLAGS_TABLE[(x) & 0xff] | c;                          \
 }
 
@@ -365,6 +508,7 @@
                                                                         \
         c = (x) & 0x01;                                                 \
         (x) = ((signed char) (x)) >> 1;  				\
+        DISCARD_FLAGS;                                                  \
         F = SZYXP_FLAGS_TABLE[(x) & 0xff] | c;                          \
 }
         
@@ -374,5 +518,6 @@
                                                                         \
         c = (x) & 0x01;                                                 \
         (x) >>= 1;                                                      \
+        DISCARD_FLAGS;                                                  \
         F = SZYXP_FLAGS_TABLE[(x) & 0xff] | c;                          \
 }
@@ -8,28 +8,65 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "z80emu.h"
 
 /* Encoding for indirect or indexed 8-bit memory operands. */
 
 #define INDIRECT_HL     0x06
 
-static void     make_instruction_table (void);
-static void     make_cb_instruction_table (void);
-static void     make_ed_instruction_table (void);
+static void     make_instruction_table (const char *name, int indexed);
+static void     make_cb_instruction_table (const char *name, int indexed);
+static void     make_ed_instruction_table (const char *name);
 
 static void     make_szyx_flags_table (void);
 static void     make_szyxp_flags_table (void);
 
-int main (void) 
+/* Instruction tables map opcodes to the instruction numbers in 
+ * instructions.h.  When run as "maketables dispatch", the same tables are 
+ * instead written as tables of label addresses for the direct-threaded 
+ * emulate() (see Z80_THREADED_DISPATCH in z80config.h), which includes them 
+ * inside its body.  The indexed tables decode the opcodes that follow a 0xdd
+ * or 0xfd prefix, (HL) operands are then (IX + d) or (IY + d) ones.
+ */
+
+static const char       *table_type = "const unsigned char";
+static const char       *entry_prefix = "";
+
+int main (int argc, char *argv[]) 
 {
         printf("/* Generated file, see maketables.c. */\n\n");
 
-        make_instruction_table();
+        if (argc > 1 && !strcmp(argv[1], "dispatch")) {
+
+                table_type = "void * const";
+                entry_prefix = "&&";
+
+                make_instruction_table("DISPATCH_TABLE", 0);
+                putchar('\n');
+                make_instruction_table("DD_DISPATCH_TABLE", 1);
+                putchar('\n');
+                make_instruction_table("FD_DISPATCH_TABLE", 1);
+                putchar('\n');
+                make_cb_instruction_table("CB_DISPATCH_TABLE", 0);
+                putchar('\n');
+                make_cb_instruction_table("INDEXED_CB_DISPATCH_TABLE", 1);
+                putchar('\n');
+                make_ed_instruction_table("ED_DISPATCH_TABLE");
+
+                return EXIT_SUCCESS;
+
+        }
+
+        make_instruction_table("INSTRUCTION_TABLE", 0);
+        putchar('\n');
+        make_instruction_table("INDEXED_INSTRUCTION_TABLE", 1);
+        putchar('\n');
+        make_cb_instruction_table("CB_INSTRUCTION_TABLE", 0);
         putchar('\n');
-        make_cb_instruction_table();
+        make_cb_instruction_table("INDEXED_CB_INSTRUCTION_TABLE", 1);
         putchar('\n');
-        make_ed_instruction_table();
+        make_ed_instruction_table("ED_INSTRUCTION_TABLE");
         putchar('\n');
 
         make_szyx_flags_table();
@@ -41,10 +78,10 @@ int main (void)
 
 /* Make single opcodes instruction table. */
 
-static void make_instruction_table (void)
+static void make_instruction_table (const char *name, int indexed)
 {
         int             i, j, k;
-        char            *s, *t;
+        char            *s, *t, *m;
         static char     *accumulator_operations[8] = {
 
                                 "ADD",
@@ -58,10 +95,11 @@ static void make_instruction_table (void)
 
                         };
 
-        printf("static const unsigned char INSTRUCTION_TABLE[256] = {\n\n");
+        m = indexed ? "INDEXED" : "INDIRECT_HL";
+        printf("static %s %s[256] = {\n\n", table_type, name);
         for (k = 0; k < (1 << 6); k++) {
 
-                putchar('\t');
+                printf("\t%s", entry_prefix);
                 i = k >> 3;
                 j = k & 0x07;
                 switch (j) {
@@ -143,7 +181,7 @@ static void make_instruction_table (void)
 
                                 if (i == INDIRECT_HL)
 
-                                        s = "INDIRECT_HL";
+                                        s = m;
 
                                 else
 
@@ -159,7 +197,9 @@ static void make_instruction_table (void)
 
                                 if (i == INDIRECT_HL)
 
-                                        s = "LD_INDIRECT_HL_N";
+                                        s = indexed 
+                                                ? "LD_INDEXED_N" 
+                                                : "LD_INDIRECT_HL_N";
 
                                 else    
 
@@ -216,27 +256,14 @@ static void make_instruction_table (void)
 
                                 s = "NOP";
 
-                        printf("\t%s,\n", s);
+                        printf("\t%s%s,\n", entry_prefix, s);
 
                 } else {
 
-                        if (i == INDIRECT_HL)
-
-                                s = "LD_INDIRECT_HL_";
-
-                        else
-
-                                s = "LD_R_";
-
-                        if (j == INDIRECT_HL)
-
-                                t = "INDIRECT_HL";
-
-                        else
-
-                                t = "R";
-
-                        printf("\t%s%s,\n", s, t);
+                        printf("\t%sLD_%s_%s,\n", 
+                                entry_prefix, 
+                                i == INDIRECT_HL ? m : "R", 
+                                j == INDIRECT_HL ? m : "R");
 
                 }
                 if (j == 0x07)
@@ -252,10 +279,10 @@ static void make_instruction_table (void)
                 s = accumulator_operations[i];
                 for (j = 0; j < (1 << 3); j++) {
 
-                        printf("\t%s_", s);
+                        printf("\t%s%s_", entry_prefix, s);
                         if (j == INDIRECT_HL)
 
-                                t = "INDIRECT_HL";
+                                t = m;
 
                         else
 
@@ -270,7 +297,7 @@ static void make_instruction_table (void)
 
         for (k = 0; k < (1 << 6); k++) {
 
-                putchar('\t');
+                printf("\t%s", entry_prefix);
                 i = k >> 3;
                 j = k & 0x07;
                 switch (j) {
@@ -326,6 +353,10 @@ static void make_instruction_table (void)
                                                 };
 
                                 s = strings[i];
+                                if (indexed && i == 1)
+
+                                        s = "INDEXED_CB_PREFIX";
+
                                 break;
 
                         }
@@ -386,12 +417,12 @@ static void make_instruction_table (void)
 
 /* Make 0xcb prefixed opcodes instruction table. */
 
-static void make_cb_instruction_table (void)
+static void make_cb_instruction_table (const char *name, int indexed)
 {
         int     i;
         char    *s;
 
-        printf("static const unsigned char CB_INSTRUCTION_TABLE[256] = {\n\n");
+        printf("static %s %s[256] = {\n\n", table_type, name);
 
         /* Rotation/shift operations. */
 
@@ -410,10 +441,10 @@ static void make_cb_instruction_table (void)
 
                                 };
 
-                printf("\t%s_", rotation_shift_operations[i >> 3]);
+                printf("\t%s%s_", entry_prefix, rotation_shift_operations[i >> 3]);
                 if ((i & 0x07) == INDIRECT_HL)
 
-                        s = "INDIRECT_HL";
+                        s = indexed ? "INDEXED" : "INDIRECT_HL";
 
                 else
 
@@ -432,13 +463,15 @@ static void make_cb_instruction_table (void)
 
                 if ((i & 0x07) == INDIRECT_HL)
 
-                        s = "BIT_B_INDIRECT_HL";
+                        s = indexed 
+                                ? "BIT_B_INDEXED" 
+                                : "BIT_B_INDIRECT_HL";
 
                 else
 
                         s = "BIT_B_R";
 
-                printf("\t%s,\n", s);
+                printf("\t%s%s,\n", entry_prefix, s);
                 if ((i & 0x07) == 0x07)
 
                         putchar('\n');
@@ -451,13 +484,15 @@ static void make_cb_instruction_table (void)
 
                 if ((i & 0x07) == INDIRECT_HL)
 
-                        s = "RES_B_INDIRECT_HL";
+                        s = indexed 
+                                ? "RES_B_INDEXED" 
+                                : "RES_B_INDIRECT_HL";
 
                 else
 
                         s = "RES_B_R";
 
-                printf("\t%s,\n", s);
+                printf("\t%s%s,\n", entry_prefix, s);
                 if ((i & 0x07) == 0x07)
 
                         putchar('\n');
@@ -470,13 +505,15 @@ static void make_cb_instruction_table (void)
 
                 if ((i & 0x07) == INDIRECT_HL)
 
-                        s = "SET_B_INDIRECT_HL";
+                        s = indexed 
+                                ? "SET_B_INDEXED" 
+                                : "SET_B_INDIRECT_HL";
 
                 else
 
                         s = "SET_B_R";
 
-                printf("\t%s,\n", s);
+                printf("\t%s%s,\n", entry_prefix, s);
                 if ((i & 0x07) == 0x07)
 
                         putchar('\n');
@@ -488,18 +525,18 @@ static void make_cb_instruction_table (void)
 
 /* Make 0xed prefixed opcodes instruction table. */
 
-static void make_ed_instruction_table (void)
+static void make_ed_instruction_table (const char *name)
 {
         int     i, j, k;
         char    *s, *t;
 
-        printf("static const unsigned char ED_INSTRUCTION_TABLE[256] = {\n\n");
+        printf("static %s %s[256] = {\n\n", table_type, name);
 
         /* Undefined opcodes are catched and will execute as NOPs. */
 
         for (i = 0; i < (1 << 6); i++) {
 
-                printf("\tED_UNDEFINED,\n");
+                printf("\t%sED_UNDEFINED,\n", entry_prefix);
                 if ((i & 0x07) == 0x07)
 
                         putchar('\n');
@@ -590,7 +627,7 @@ static void make_ed_instruction_table (void)
                         }
 
                 }
-                printf("\t%s%s,\n", s, t);
+                printf("\t%s%s%s,\n", entry_prefix, s, t);
                 if ((j & 0x07) == 0x07)
 
                         putchar('\n');
@@ -650,7 +687,7 @@ static void make_ed_instruction_table (void)
 
                         s = strings[i - 4][j];
 
-                printf("\t%s, \n", s);
+                printf("\t%s%s, \n", entry_prefix, s);
                 if ((j & 0x07) == 0x07)
 
                         putchar('\n');
@@ -659,7 +696,7 @@ static void make_ed_instruction_table (void)
 
         for (i = 0; i < (1 << 6); i++) {
 
-                printf("\tED_UNDEFINED,\n");
+                printf("\t%sED_UNDEFINED,\n", entry_prefix);
                 if ((i & 0x07) == 0x07)
 
                         putchar('\n');
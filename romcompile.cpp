@@ -0,0 +1,379 @@
+// romcompile: ahead-of-time recompilation of the BIOS and a cartridge to C++.
+//
+//     romcompile [-s z80emu.c] [-i instructions.h] COLECO.ROM cartridge > cartridge.cpp
+//
+// Code is traced from the reset, NMI, and RST vectors of the BIOS and from the
+// entry points in the cartridge header, following the targets of jumps, calls,
+// and restarts as decoded by bg80d.  Each block found is split exactly as the
+// z80emu block cache would split it, and is emitted as one C++ function built
+// from the source of z80emu's own instruction handlers, with the opcode,
+// register table, and program counter of every instruction made constants.
+// Linking the output into the emulator (see COMPILED_ROMS in the Makefile) lets
+// a USE_BLOCK_CACHE=1 build run those functions instead of the interpreter
+// whenever it would have run one of these blocks.  Everything else, including
+// computed jumps to code that was not traced, stays interpreted.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cinttypes>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <fstream>
+#include <sstream>
+
+#include "z80emu.h"
+#include "z80user.h"
+#include "compiled_rom.h"
+#include "bg80d.h"
+
+// Only decoded, never emulated
+extern "C" uint8_t cv_in_byte(void *context, uint16_t address) { return 0; }
+extern "C" void cv_out_byte(void *context, uint16_t address, uint8_t data) { }
+extern "C" void cv_in_block(void *context, uint16_t address, uint8_t *data, int count) { }
+extern "C" void cv_out_block(void *context, uint16_t address, const uint8_t *data, int count) { }
+extern "C" int cv_hle_routine(void *context, Z80_STATE *state, int *pc, int *r, int elapsed_cycles) { return 0; }
+
+static constexpr uint16_t BIOS_START = 0x0000;
+static constexpr uint16_t CARTRIDGE_START = 0x8000;
+static constexpr uint16_t CARTRIDGE_START_VECTOR = 0x800A;
+static constexpr uint16_t CARTRIDGE_FIRST_JUMP = 0x800C;        // RST 8 through NMI, JP nn each
+static constexpr uint16_t CARTRIDGE_LAST_JUMP = 0x8021;
+
+struct reader_context
+{
+    uint16_t address;
+    ColecovisionContext* colecovision_context;
+};
+
+uint8_t reader(void *p)
+{
+    auto* context = reinterpret_cast<reader_context*>(p);
+    uint8_t data = cv_read_byte(context->colecovision_context, context->address);
+    context->address++;
+    return data;
+}
+
+std::string read_file(const char *name)
+{
+    std::ifstream file(name, std::ios::binary);
+    if(!file) {
+        fprintf(stderr, "failed to open %s for reading\n", name);
+        exit(EXIT_FAILURE);
+    }
+    std::stringstream contents;
+    contents << file.rdbuf();
+    return contents.str();
+}
+
+// Names of the instruction numbers, in the order of the enum in instructions.h
+std::vector<std::string> read_instruction_names(const char *name)
+{
+    std::string source = read_file(name);
+    std::string text;
+    for(size_t i = 0; i < source.size(); i++) {
+        if(source.compare(i, 2, "/*") == 0) {
+            i = source.find("*/", i + 2) + 1;
+        } else {
+            text += source[i];
+        }
+    }
+
+    std::vector<std::string> names;
+    size_t start = text.find("enum {");
+    size_t end = text.find("};", start);
+    if((start == std::string::npos) || (end == std::string::npos)) {
+        fprintf(stderr, "couldn't find instruction enum in %s\n", name);
+        exit(EXIT_FAILURE);
+    }
+    std::stringstream list(text.substr(start + 6, end - start - 6));
+    std::string item;
+    while(std::getline(list, item, ',')) {
+        size_t first = item.find_first_not_of(" \t\r\n");
+        if(first != std::string::npos) {
+            names.push_back(item.substr(first, item.find_last_not_of(" \t\r\n") - first + 1));
+        }
+    }
+    return names;
+}
+
+// Bodies of "INSTRUCTION(NAME): { ... }" in emulate(), braces included
+std::map<std::string, std::string> read_handlers(const char *name)
+{
+    std::string source = read_file(name);
+    std::map<std::string, std::string> handlers;
+
+    size_t position = source.find("static int emulate (");
+    while((position = source.find("INSTRUCTION(", position)) != std::string::npos) {
+        size_t name_end = source.find(')', position);
+        std::string instruction = source.substr(position + 12, name_end - position - 12);
+        size_t body = name_end + 1;
+        if(source.compare(body, 1, ":") != 0) {
+            position = name_end;
+            continue;
+        }
+        body = source.find('{', body);
+
+        int depth = 0;
+        size_t i;
+        for(i = body; i < source.size(); i++) {
+            if(source.compare(i, 2, "/*") == 0) {
+                i = source.find("*/", i + 2) + 1;
+            } else if(source.compare(i, 2, "//") == 0) {
+                i = source.find('\n', i);
+            } else if((source[i] == '\'') || (source[i] == '"')) {
+                char quote = source[i];
+                for(i++; source[i] != quote; i++) {
+                    if(source[i] == '\\') {
+                        i++;
+                    }
+                }
+            } else if(source[i] == '{') {
+                depth++;
+            } else if((source[i] == '}') && (--depth == 0)) {
+                break;
+            }
+        }
+        if(i == source.size()) {
+            fprintf(stderr, "unbalanced braces in handler %s in %s\n", instruction.c_str(), name);
+            exit(EXIT_FAILURE);
+        }
+
+        // Line up the body with the code generated around it
+        size_t line_start = source.rfind('\n', i) + 1;
+        size_t indent = i - line_start;
+        std::string text;
+        for(size_t j = body; j <= i; j++) {
+            text += source[j];
+            if(source[j] == '\n') {
+                size_t k = 0;
+                while((k < indent) && (source[j + 1] == ' ')) {
+                    j++;
+                    k++;
+                }
+                if(source[j + 1] != '\n') {
+                    text += "                ";
+                }
+            }
+        }
+        handlers[instruction] = text;
+        position = i;
+    }
+    return handlers;
+}
+
+// Addresses where execution may continue after the instruction at "address"
+std::vector<int> successors(ColecovisionContext *colecovision_context, int address)
+{
+    reader_context context{.address = (uint16_t)address, .colecovision_context = colecovision_context};
+    bg80d::opcode_spec_t *opcode = bg80d::decode(reader, &context, address);
+    std::vector<int> targets;
+
+    std::string type = opcode->type;
+    bool conditional = (strncmp(opcode->summary, "if(", 3) == 0) || (strchr(opcode->summary, '?') != nullptr);
+    if(((type == "JP") || (type == "CALL")) && (opcode->extra_type == Z80_EXTRA_T_NN)) {
+        targets.push_back(opcode->parameter1 & 0xFFFF);
+    } else if((type == "JR") || (type == "DJNZ")) {
+        targets.push_back((opcode->pc_after + (int8_t)opcode->parameter1) & 0xFFFF);
+    } else if(type == "RST") {
+        targets.push_back(opcode->opcode & 0x38);
+    }
+    if(conditional || ((type != "JP") && (type != "JR") && (type != "RET"))) {
+        targets.push_back(opcode->pc_after);
+    }
+    return targets;
+}
+
+void usage(const char *progname)
+{
+    fprintf(stderr, "usage: %s [-s z80emu.c] [-i instructions.h] COLECO.ROM cartridge\n", progname);
+}
+
+int main(int argc, char **argv)
+{
+    const char *progname = argv[0];
+    const char *source_name = "z80emu.c";
+    const char *instructions_name = "instructions.h";
+
+    argc--;
+    argv++;
+    while((argc > 0) && (argv[0][0] == '-')) {
+        if((strcmp(argv[0], "-s") == 0) && (argc > 1)) {
+            source_name = argv[1];
+        } else if((strcmp(argv[0], "-i") == 0) && (argc > 1)) {
+            instructions_name = argv[1];
+        } else {
+            usage(progname);
+            exit(EXIT_FAILURE);
+        }
+        argc -= 2;
+        argv += 2;
+    }
+    if(argc != 2) {
+        usage(progname);
+        exit(EXIT_FAILURE);
+    }
+    const char *bios_name = argv[0];
+    const char *cart_name = argv[1];
+
+    std::string bios = read_file(bios_name);
+    if(bios.size() != 0x2000) {
+        fprintf(stderr, "ROM read from %s was unexpectedly %zd bytes\n", bios_name, bios.size());
+        exit(EXIT_FAILURE);
+    }
+    std::string cart = read_file(cart_name);
+    if(cart.size() > 0x8000) {
+        // The emulator doesn't use compiled blocks with MegaCarts, whose
+        // code at 0xC000 changes with the bank
+        fprintf(stderr, "%s is a bank-switched cartridge (%zd bytes), which can't be compiled\n", cart_name, cart.size());
+        exit(EXIT_FAILURE);
+    }
+    if(cart.size() < 0x2000) {
+        fprintf(stderr, "ROM read from %s was unexpectedly short (%zd bytes)\n", cart_name, cart.size());
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t bios_hash = HashROM(reinterpret_cast<const uint8_t*>(bios.data()), bios.size());
+    uint64_t cartridge_hash = HashROM(reinterpret_cast<const uint8_t*>(cart.data()), cart.size());
+
+    // Map the ROMs as the emulator does, with storage padded to whole pages
+    std::vector<uint8_t> bios_bytes((bios.size() + CV_PAGE_SIZE - 1) & ~CV_PAGE_OFFSET_MASK, 0);
+    std::vector<uint8_t> cart_bytes((cart.size() + CV_PAGE_SIZE - 1) & ~CV_PAGE_OFFSET_MASK, 0);
+    std::copy(bios.begin(), bios.end(), bios_bytes.begin());
+    std::copy(cart.begin(), cart.end(), cart_bytes.begin());
+
+    static ColecovisionContext colecovision_context;
+    cv_clear_pages(&colecovision_context);
+    cv_map_pages(&colecovision_context, BIOS_START, bios_bytes.size(), bios_bytes.data(), 0xFFFF, 0);
+    cv_map_pages(&colecovision_context, CARTRIDGE_START, cart_bytes.size(), cart_bytes.data(), 0xFFFF, 0);
+
+    std::vector<int> work = {0x0000, 0x0066, cv_read_word(&colecovision_context, CARTRIDGE_START_VECTOR)};
+    for(int address = 0x08; address <= 0x38; address += 8) {
+        work.push_back(address);
+    }
+    for(int address = CARTRIDGE_FIRST_JUMP; address <= CARTRIDGE_LAST_JUMP; address += 3) {
+        work.push_back(address);
+    }
+
+    std::map<int, std::vector<Z80_BLOCK_INSTRUCTION>> blocks;
+    std::set<int> visited;
+    while(!work.empty()) {
+        int address = work.back();
+        work.pop_back();
+        if(visited.count(address) || !cv_code_is_cacheable(&colecovision_context, address)) {
+            continue;
+        }
+        visited.insert(address);
+
+        // An instruction the cache leaves to the interpreter is only followed
+        Z80_BLOCK_INSTRUCTION instructions[Z80_MAXIMUM_BLOCK_INSTRUCTIONS];
+        int count = Z80DescribeBlock(address, instructions, &colecovision_context);
+        int last = address;
+        if(count > 0) {
+            blocks[address].assign(instructions, instructions + count);
+            last = instructions[count - 1].address;
+        }
+        for(int target: successors(&colecovision_context, last)) {
+            work.push_back(target);
+        }
+    }
+
+    if(blocks.empty()) {
+        fprintf(stderr, "no code found to compile in %s and %s\n", bios_name, cart_name);
+        exit(EXIT_FAILURE);
+    }
+
+    std::vector<std::string> names = read_instruction_names(instructions_name);
+    std::map<std::string, std::string> handlers = read_handlers(source_name);
+
+    printf("// Generated by romcompile from %s and %s, do not edit.\n\n", bios_name, cart_name);
+    printf("#include \"compiled_rom.h\"\n");
+    printf("#include \"z80emu.h\"\n");
+    printf("#include \"z80user.h\"\n");
+    printf("#include \"instructions.h\"\n");
+    printf("#include \"macros.h\"\n");
+    printf("#include \"tables.h\"\n");
+    printf("#include \"encodings.h\"\n\n");
+    printf("#define END_INSTRUCTION break\n");
+    // Idle loops are only detected by the interpreter
+    printf("#define IDLE_LOOP(target, end)\n");
+    printf("#define LEAVE_IDLE_LOOP\n");
+    // BIOS routines called from compiled blocks run as compiled code
+    printf("#define HLE_ROUTINE\n");
+
+    for(const auto& [address, instructions]: blocks) {
+        std::string code;
+        for(const Z80_BLOCK_INSTRUCTION& instruction: instructions) {
+            const std::string& name = names.at(instruction.instruction);
+            auto handler = handlers.find(name);
+            if(handler == handlers.end()) {
+                fprintf(stderr, "no handler for %s in %s\n", name.c_str(), source_name);
+                exit(EXIT_FAILURE);
+            }
+
+            const char *table = "register_table";
+            if((instruction.prefix == 0xdd) || (instruction.prefix == 0xddcb)) {
+                table = "dd_register_table";
+            } else if((instruction.prefix == 0xfd) || (instruction.prefix == 0xfdcb)) {
+                table = "fd_register_table";
+            }
+
+            char prologue[512];
+            snprintf(prologue, sizeof(prologue),
+                "\n"
+                "        /* %04X: %s */\n"
+                "\n"
+                "        elapsed_cycles += %d;\n"
+                "        r += %d;\n"
+                "        pc = 0x%04x;\n"
+                "        {\n"
+                "                [[maybe_unused]] const int opcode = 0x%02x;\n"
+                "                [[maybe_unused]] void **registers = state->%s;\n"
+                "\n"
+                "                do ",
+                instruction.address, name.c_str(),
+                instruction.cycles, instruction.r,
+                instruction.address + instruction.length,
+                instruction.opcode, table);
+            code += prologue;
+            code += handler->second;
+            code += " while (0);\n        }\n";
+        }
+
+        printf("\nstatic int block_%04x (Z80_STATE *state,\n", address);
+        printf("        int *block_pc, int *block_r,\n");
+        printf("        int elapsed_cycles, int *block_number_cycles,\n");
+        printf("        void *context)\n");
+        printf("{\n");
+        printf("        int     pc, r, number_cycles;\n\n");
+        printf("        r = *block_r;\n");
+        printf("        number_cycles = *block_number_cycles;\n");
+        fputs(code.c_str(), stdout);
+        // Handlers that stop the emulation may be compiled out by z80config.h
+        printf("\nstop_emulation: __attribute__((unused));\n");
+        printf("\n        *block_pc = pc;\n");
+        printf("        *block_r = r;\n");
+        printf("        *block_number_cycles = number_cycles;\n\n");
+        printf("        return elapsed_cycles;\n");
+        printf("}\n");
+    }
+
+    printf("\nstatic const Z80_COMPILED_BLOCK compiled_blocks[] = {\n\n");
+    for(const auto& [address, instructions]: blocks) {
+        printf("        { 0x%04x, %zd, block_%04x },\n", address, instructions.size(), address);
+    }
+    printf("\n};\n\n");
+    printf("static const CompiledROM compiled_rom = {\n");
+    printf("    0x%016" PRIx64 "ULL,\n", bios_hash);
+    printf("    0x%016" PRIx64 "ULL,\n", cartridge_hash);
+    printf("    compiled_blocks,\n");
+    printf("    %zd\n", blocks.size());
+    printf("};\n\n");
+    printf("[[maybe_unused]] static bool registered = RegisterCompiledROM(&compiled_rom);\n");
+
+    fprintf(stderr, "%zd blocks compiled\n", blocks.size());
+    return 0;
+}
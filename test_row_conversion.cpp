@@ -0,0 +1,163 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <array>
+#include <string>
+#include <vector>
+
+#include "tms9918.h"
+
+// Checks the row converters of tms9918.h on every row of VDP register and
+// memory dumps saved with VDP_OUT_BASE, such as VDP_TESTS/*.vdp: the SSSE3
+// converters against the scalar ones, which otherwise never run on x86, the
+// RGB8 frame against the dump's _ref.ppm image, and the 4BitPixmap rows
+// against Set4BitPixmapColor.
+
+using namespace TMS9918A;
+
+typedef std::array<uint8_t, SCREEN_X * SCREEN_Y * 3> RGB8Frame;
+
+bool ReadVDPDump(const char *vdp_dump_name, std::array<uint8_t, 8>& registers, std::array<uint8_t, 16384>& memory)
+{
+    FILE *vdp_dump_in = fopen(vdp_dump_name, "r");
+    if(!vdp_dump_in) {
+        fprintf(stderr, "couldn't open %s\n", vdp_dump_name);
+        return false;
+    }
+    char line[512];
+    bool success = fgets(line, sizeof(line), vdp_dump_in) != nullptr;
+    for(size_t i = 0; success && i < 8; i++) {
+        unsigned int v;
+        success = fscanf(vdp_dump_in, " %u", &v) == 1;
+        registers[i] = v;
+    }
+    for(size_t i = 0; success && i < 16384; i++) {
+        unsigned int v;
+        success = fscanf(vdp_dump_in, " %u", &v) == 1;
+        memory[i] = v;
+    }
+    fclose(vdp_dump_in);
+    if(!success) {
+        fprintf(stderr, "%s is not a VDP dump\n", vdp_dump_name);
+    }
+    return success;
+}
+
+bool ReadRGB8P6(const char *image_name, RGB8Frame& frame)
+{
+    FILE *fp = fopen(image_name, "rb");
+    if(!fp) {
+        fprintf(stderr, "couldn't open %s\n", image_name);
+        return false;
+    }
+    int width, height, max;
+    bool success = (fscanf(fp, "P6 %d %d %d", &width, &height, &max) == 3) &&
+        (width == SCREEN_X) && (height == SCREEN_Y) && (max == 255) &&
+        (fgetc(fp) != EOF) &&
+        (fread(frame.data(), frame.size(), 1, fp) == 1);
+    fclose(fp);
+    if(!success) {
+        fprintf(stderr, "%s is not a %d by %d P6 image\n", image_name, SCREEN_X, SCREEN_Y);
+    }
+    return success;
+}
+
+// Compare "count" bytes of the row "row" converted by "name" with "expected"
+bool CompareRow(const char *vdp_dump_name, int row, const char *name, const uint8_t *converted, const uint8_t *expected, size_t count)
+{
+    if(memcmp(converted, expected, count) != 0) {
+        fprintf(stderr, "%s: row %d differs in %s\n", vdp_dump_name, row, name);
+        return false;
+    }
+    return true;
+}
+
+bool TestVDPDump(const char *vdp_dump_name, int& rows_tested)
+{
+    std::array<uint8_t, 8> registers;
+    std::array<uint8_t, 16384> memory;
+    if(!ReadVDPDump(vdp_dump_name, registers, memory)) {
+        return false;
+    }
+
+    std::string image_name = vdp_dump_name;
+    image_name.replace(image_name.rfind(".vdp"), 4, "_ref.ppm");
+    RGB8Frame reference;
+    if(!ReadRGB8P6(image_name.c_str(), reference)) {
+        return false;
+    }
+
+#if defined(TMS9918A_CONVERT_ROW_SSSE3)
+    bool ssse3 = __builtin_cpu_supports("ssse3");
+#endif
+
+    bool success = true;
+    auto row_tester = [&](int row, const uint8_t* row_colors) {
+        uint8_t rgb8[SCREEN_X * 3], bgr8[SCREEN_X * 3], rgbx8[SCREEN_X * 4];
+        uint8_t converted[SCREEN_X * 4];
+
+        ConvertRowScalar<3, 0, 1, 2>(row_colors, rgb8);
+        ConvertRowScalar<3, 2, 1, 0>(row_colors, bgr8);
+        ConvertRowScalar<4, 0, 1, 2>(row_colors, rgbx8);
+        success = CompareRow(vdp_dump_name, row, "scalar RGB8 against the reference image", rgb8, reference.data() + row * SCREEN_X * 3, sizeof(rgb8)) && success;
+
+#if defined(TMS9918A_CONVERT_ROW_SSSE3)
+        if(ssse3) {
+            ConvertRowToRGB8SSSE3(row_colors, converted);
+            success = CompareRow(vdp_dump_name, row, "SSSE3 RGB8", converted, rgb8, sizeof(rgb8)) && success;
+            ConvertRowToBGR8SSSE3(row_colors, converted);
+            success = CompareRow(vdp_dump_name, row, "SSSE3 BGR8", converted, bgr8, sizeof(bgr8)) && success;
+            ConvertRowToRGBX8SSSE3(row_colors, converted);
+            success = CompareRow(vdp_dump_name, row, "SSSE3 RGBX8", converted, rgbx8, sizeof(rgbx8)) && success;
+        }
+#endif
+
+        ConvertRowToRGB8(row_colors, converted);
+        success = CompareRow(vdp_dump_name, row, "ConvertRowToRGB8", converted, rgb8, sizeof(rgb8)) && success;
+        ConvertRowToBGR8(row_colors, converted);
+        success = CompareRow(vdp_dump_name, row, "ConvertRowToBGR8", converted, bgr8, sizeof(bgr8)) && success;
+        ConvertRowToRGBX8(row_colors, converted);
+        success = CompareRow(vdp_dump_name, row, "ConvertRowToRGBX8", converted, rgbx8, sizeof(rgbx8)) && success;
+
+        // Set4BitPixmapColor only addresses rows of a whole pixmap
+        static uint8_t pixmap[128 * 192];
+        for(int col = 0; col < SCREEN_X; col++) {
+            Set4BitPixmapColor(pixmap, col, row, row_colors[col]);
+        }
+        ConvertRowTo4BitPixmap(row_colors, converted);
+        success = CompareRow(vdp_dump_name, row, "ConvertRowTo4BitPixmap", converted, pixmap + row * 128, SCREEN_X / 2) && success;
+
+        rows_tested++;
+    };
+    CreateRowsAndReturnFlags(registers.data(), memory.data(), row_tester);
+
+    return success;
+}
+
+int main(int argc, char **argv)
+{
+    if(argc < 2) {
+        fprintf(stderr, "usage: %s dump.vdp [...]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    int rows_tested = 0;
+    std::vector<const char *> failed;
+    for(int i = 1; i < argc; i++) {
+        if(!TestVDPDump(argv[i], rows_tested)) {
+            failed.push_back(argv[i]);
+        }
+    }
+
+#if defined(TMS9918A_CONVERT_ROW_SSSE3)
+    const char *converters = __builtin_cpu_supports("ssse3") ? "scalar and SSSE3" : "scalar";
+#else
+    const char *converters = "scalar";
+#endif
+    printf("%d rows of %d dumps converted with the %s converters, %zd dumps failed\n", rows_tested, argc - 1, converters, failed.size());
+    for(const char *name: failed) {
+        printf("    %s\n", name);
+    }
+
+    exit(failed.empty() ? EXIT_SUCCESS : EXIT_FAILURE);
+}
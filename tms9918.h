@@ -3,12 +3,18 @@
 
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
+#include <algorithm>
 #include <array>
+#include <bitset>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 // On desktop: call CreateImageAndReturnFlags as done previously to an RGB8 image
 // On Rosa: call CreateImageAndReturnFlags to 4BitPixmap on scanout?
 //     Maybe later optimization to keep track of sprites startrow-stoprow
-// AddSpritesToRow should operate on a 4BitPixmap
+// SpriteFrame::draw_row should operate on a 4BitPixmap
 
 namespace TMS9918A
 {
@@ -279,7 +285,7 @@ static void Set4BitPixmapColorIncrementingX(uint8_t pixmap[128 * 192], int x, in
     }
 }
 
-static void Set4BitPixmapColor(uint8_t pixmap[128 * 192], int x, int y, uint8_t color)
+[[maybe_unused]] static void Set4BitPixmapColor(uint8_t pixmap[128 * 192], int x, int y, uint8_t color)
 {
     uint8_t& pixelpair = pixmap[x / 2 + y * 128];
     uint8_t shift = (x % 2) * 4;
@@ -294,284 +300,676 @@ static void Clear4BitPixmap(uint8_t pixmap[128 * 192], uint8_t color)
     }
 }
 
-template <typename SetPixelFunc>
-static void DrawPatternFromGraphicsI(const uint8_t* registers, const uint8_t* memory, SetPixelFunc SetPixel)
+// Rows of color indices from CreateRowsAndReturnFlags are converted to
+// pixels through the palette a whole row at a time.  On x86 the palette is
+// looked up 16 pixels at a time with pshufb when the CPU has SSSE3, checked
+// once at startup, and otherwise a pixel at a time.
+
+// Colors as one table of 16 entries per channel, for pshufb
+static const std::array<std::array<uint8_t, 16>, 3> ColorChannels = []() {
+    std::array<std::array<uint8_t, 16>, 3> channels;
+    for(int color = 0; color < 16; color++) {
+        for(int channel = 0; channel < 3; channel++) {
+            channels[channel][color] = Colors[color][channel];
+        }
+    }
+    return channels;
+}();
+
+// Store RED, GREEN, and BLUE of each color of "row_colors" at those offsets
+// into PIXEL_BYTES-byte "pixels", the fourth byte of 4-byte pixels being 0
+template <int PIXEL_BYTES, int RED, int GREEN, int BLUE>
+static void ConvertRowScalar(const uint8_t* row_colors, uint8_t* pixels)
+{
+    for(int col = 0; col < SCREEN_X; col++) {
+        const uint8_t *color = Colors[row_colors[col]];
+        uint8_t *pixel = pixels + col * PIXEL_BYTES;
+        pixel[RED] = color[0];
+        pixel[GREEN] = color[1];
+        pixel[BLUE] = color[2];
+        if(PIXEL_BYTES == 4) {
+            pixel[3] = 0;
+        }
+    }
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define TMS9918A_CONVERT_ROW_SSSE3
+
+// pshufb controls moving channel "channel" of 16 pixels into part "part" of
+// their 48 bytes as 3-byte pixels, at [part * 3 + channel]
+static constexpr std::array<std::array<uint8_t, 16>, 9> ThreeBytePixelShuffles = []() {
+    std::array<std::array<uint8_t, 16>, 9> shuffles{};
+    for(int part = 0; part < 3; part++) {
+        for(int channel = 0; channel < 3; channel++) {
+            for(int i = 0; i < 16; i++) {
+                int byte = part * 16 + i;
+                shuffles[part * 3 + channel][i] = (byte % 3 == channel) ? (byte / 3) : 0x80;
+            }
+        }
+    }
+    return shuffles;
+}();
+
+// Store 3-byte pixels of "first", "second", and "third" channel tables
+__attribute__((target("ssse3")))
+static void ConvertRowTo3BytePixelsSSSE3(const uint8_t* row_colors, uint8_t* pixels, const uint8_t* first, const uint8_t* second, const uint8_t* third)
 {
-    uint8_t backdrop = GetBackdropColor(registers);
+    __m128i tables[3] = {
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(first)),
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(second)),
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(third)),
+    };
+    __m128i shuffles[9];
+    for(int i = 0; i < 9; i++) {
+        shuffles[i] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ThreeBytePixelShuffles[i].data()));
+    }
 
-    for(uint16_t name_y = 0; name_y < 24; name_y++) {
+    for(int col = 0; col < SCREEN_X; col += 16) {
+        __m128i indices = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row_colors + col));
+        __m128i channels[3];
+        for(int channel = 0; channel < 3; channel++) {
+            channels[channel] = _mm_shuffle_epi8(tables[channel], indices);
+        }
+        for(int part = 0; part < 3; part++) {
+            __m128i bytes = _mm_or_si128(
+                _mm_or_si128(_mm_shuffle_epi8(channels[0], shuffles[part * 3 + 0]), _mm_shuffle_epi8(channels[1], shuffles[part * 3 + 1])),
+                _mm_shuffle_epi8(channels[2], shuffles[part * 3 + 2]));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(pixels + col * 3 + part * 16), bytes);
+        }
+    }
+}
 
-        for(uint16_t name_x = 0; name_x < 32; name_x++) {
+__attribute__((target("ssse3")))
+static void ConvertRowToRGB8SSSE3(const uint8_t* row_colors, uint8_t* pixels)
+{
+    ConvertRowTo3BytePixelsSSSE3(row_colors, pixels, ColorChannels[0].data(), ColorChannels[1].data(), ColorChannels[2].data());
+}
 
-            uint8_t pattern_name = PatternName(registers, memory, name_x, name_y);
+__attribute__((target("ssse3")))
+static void ConvertRowToBGR8SSSE3(const uint8_t* row_colors, uint8_t* pixels)
+{
+    ConvertRowTo3BytePixelsSSSE3(row_colors, pixels, ColorChannels[2].data(), ColorChannels[1].data(), ColorChannels[0].data());
+}
 
-            const uint8_t *pattern_rows = GetStandardPatternRows(registers, memory, pattern_name);
+__attribute__((target("ssse3")))
+static void ConvertRowToRGBX8SSSE3(const uint8_t* row_colors, uint8_t* pixels)
+{
+    __m128i red = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ColorChannels[0].data()));
+    __m128i green = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ColorChannels[1].data()));
+    __m128i blue = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ColorChannels[2].data()));
+    __m128i zero = _mm_setzero_si128();
 
-            uint8_t color_pair = GetStandardColorPair(registers, memory, pattern_name);
-            uint8_t color0 = color_pair & 0xf;
-            uint8_t color1 = (color_pair >> 4) & 0xf;
+    for(int col = 0; col < SCREEN_X; col += 16) {
+        __m128i indices = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row_colors + col));
+        __m128i r = _mm_shuffle_epi8(red, indices);
+        __m128i g = _mm_shuffle_epi8(green, indices);
+        __m128i b = _mm_shuffle_epi8(blue, indices);
+        __m128i rg_low = _mm_unpacklo_epi8(r, g);
+        __m128i rg_high = _mm_unpackhi_epi8(r, g);
+        __m128i bx_low = _mm_unpacklo_epi8(b, zero);
+        __m128i bx_high = _mm_unpackhi_epi8(b, zero);
+        __m128i *dst = reinterpret_cast<__m128i*>(pixels + col * 4);
+        _mm_storeu_si128(dst + 0, _mm_unpacklo_epi16(rg_low, bx_low));
+        _mm_storeu_si128(dst + 1, _mm_unpackhi_epi16(rg_low, bx_low));
+        _mm_storeu_si128(dst + 2, _mm_unpacklo_epi16(rg_high, bx_high));
+        _mm_storeu_si128(dst + 3, _mm_unpackhi_epi16(rg_high, bx_high));
+    }
+}
 
-            if(color0 == TRANSPARENT_COLOR_INDEX) {
-                color0 = backdrop;
-            }
-            if(color1 == TRANSPARENT_COLOR_INDEX) {
-                color1 = backdrop;
-            }
+#endif /* x86 */
 
-            for(uint16_t pattern_row_index = 0; pattern_row_index < 8; pattern_row_index++) {
+typedef void (*ConvertRowFunc)(const uint8_t* row_colors, uint8_t* pixels);
 
-                uint8_t pattern_row_byte = pattern_rows[pattern_row_index];
+struct RowConverters
+{
+    ConvertRowFunc rgb8;
+    ConvertRowFunc bgr8;
+    ConvertRowFunc rgbx8;
+};
 
-#pragma unroll 8
-                for(int pattern_col = 0; pattern_col < 8; pattern_col++) {
+static const RowConverters RowConversion = []() {
+    RowConverters converters {
+        ConvertRowScalar<3, 0, 1, 2>,
+        ConvertRowScalar<3, 2, 1, 0>,
+        ConvertRowScalar<4, 0, 1, 2>,
+    };
+#if defined(TMS9918A_CONVERT_ROW_SSSE3)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("ssse3")) {
+        converters = { ConvertRowToRGB8SSSE3, ConvertRowToBGR8SSSE3, ConvertRowToRGBX8SSSE3 };
+    }
+#endif
+    return converters;
+}();
 
-                    bool bit = pattern_row_byte & (0x80 >> pattern_col);
-                    uint8_t color = bit ? color1 : color0;
+// Store SCREEN_X "row_colors" as 3-byte pixels, red first
+inline void ConvertRowToRGB8(const uint8_t* row_colors, uint8_t* pixels)
+{
+    RowConversion.rgb8(row_colors, pixels);
+}
 
-                    SetPixel(name_x * 8 + pattern_col, name_y * 8 + pattern_row_index, color);
-                }
-            }
+// Store SCREEN_X "row_colors" as 3-byte pixels, blue first
+inline void ConvertRowToBGR8(const uint8_t* row_colors, uint8_t* pixels)
+{
+    RowConversion.bgr8(row_colors, pixels);
+}
+
+// Store SCREEN_X "row_colors" as 4-byte pixels, red first and the fourth byte 0
+inline void ConvertRowToRGBX8(const uint8_t* row_colors, uint8_t* pixels)
+{
+    RowConversion.rgbx8(row_colors, pixels);
+}
+
+// Store SCREEN_X "row_colors" as a row of a 4BitPixmap, even pixels in the low
+// nybble
+inline void ConvertRowTo4BitPixmap(const uint8_t* row_colors, uint8_t pixmap_row[SCREEN_X / 2])
+{
+    int col = 0;
+#if defined(__SSE2__)
+    __m128i low_nybbles = _mm_set1_epi16(0x000F);
+    for(; col < SCREEN_X; col += 16) {
+        __m128i pairs = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row_colors + col));
+        __m128i packed = _mm_or_si128(_mm_and_si128(pairs, low_nybbles), _mm_srli_epi16(pairs, 4));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(pixmap_row + col / 2), _mm_packus_epi16(packed, packed));
+    }
+#endif
+    for(; col < SCREEN_X; col += 2) {
+        pixmap_row[col / 2] = row_colors[col] | (row_colors[col + 1] << 4);
+    }
+}
+
+// Each pattern byte as its 8 pixels in screen order, 0xFF where the bit is set
+// and 0 where it is clear, so a uint64_t read from memory selects between two
+// colors replicated across 8 bytes
+static const std::array<uint64_t, 256> PatternPixelMasks = []() {
+    std::array<uint64_t, 256> masks;
+    for(int pattern = 0; pattern < 256; pattern++) {
+        uint8_t pixels[8];
+        for(int pattern_col = 0; pattern_col < 8; pattern_col++) {
+            pixels[pattern_col] = (pattern & (0x80 >> pattern_col)) ? 0xFF : 0x00;
         }
+        memcpy(&masks[pattern], pixels, sizeof(pixels));
+    }
+    return masks;
+}();
+
+// Store the 8 color indices of "pattern_row_byte" drawn in the colors of
+// "color_pair" at "pixels", transparent colors showing the backdrop
+inline void DrawPatternByte(uint8_t* pixels, uint8_t pattern_row_byte, uint8_t color_pair, uint8_t backdrop)
+{
+    constexpr uint64_t EACH_BYTE = 0x0101010101010101ULL;
+
+    uint8_t color0 = color_pair & 0xf;
+    uint8_t color1 = (color_pair >> 4) & 0xf;
+
+    if(color0 == TRANSPARENT_COLOR_INDEX) {
+        color0 = backdrop;
     }
+    if(color1 == TRANSPARENT_COLOR_INDEX) {
+        color1 = backdrop;
+    }
+
+    uint64_t mask = PatternPixelMasks[pattern_row_byte];
+    uint64_t colors = ((color1 * EACH_BYTE) & mask) | ((color0 * EACH_BYTE) & ~mask);
+    memcpy(pixels, &colors, sizeof(colors));
 }
 
-template <typename SetPixelFunc>
-static void DrawPatternFromGraphicsII(const uint8_t* registers, const uint8_t* memory, SetPixelFunc SetPixel)
+// Draw row "row" of the pattern colors into "row_colors", only for the names
+// of the row with their bit set in "columns"
+static void DrawPatternRowFromGraphicsI(int row, const uint8_t* registers, const uint8_t* memory, uint8_t row_colors[TMS9918A::SCREEN_X], uint32_t columns = 0xFFFFFFFF)
 {
     uint8_t backdrop = GetBackdropColor(registers);
 
-    // uint16_t address_mask = ((registers[3] & VR3_ADDRESS_MASK_BITMAP) << VR3_ADDRESS_MASK_SHIFT) | ADDRESS_MASK_FILL;
+    const uint8_t *names = memory + GetPatternNameTableBase(registers) + (row / 8) * 32;
+    const uint8_t *pattern_table = memory + GetStandardPatternGeneratorTableBase(registers) + row % 8;
+    const uint8_t *color_table = memory + GetStandardColorTableBase(registers);
 
-    for(uint16_t name_y = 0; name_y < 24; name_y++) {
+    for(uint16_t name_x = 0; name_x < 32; name_x++) {
 
-        uint16_t sector = (name_y / 8) << THIRD_SHIFT;
+        if(!(columns & (1u << name_x))) {
+            continue;
+        }
 
-        for(uint16_t name_x = 0; name_x < 32; name_x++) {
+        uint8_t pattern_name = names[name_x];
 
-            uint8_t pattern_name = PatternName(registers, memory, name_x, name_y);
+        uint8_t pattern_row_byte = pattern_table[pattern_name * 8];
+        uint8_t color_pair = color_table[pattern_name / 8];
 
-            const uint8_t *pattern_rows = GetBitmapPatternRows(registers, memory, sector, pattern_name);
+        DrawPatternByte(row_colors + name_x * 8, pattern_row_byte, color_pair, backdrop);
+    }
+}
 
-            const uint8_t *color_pair_rows = GetBitmapColorRows(registers, memory, sector, pattern_name);
+static void DrawPatternRowFromGraphicsII(int row, const uint8_t* registers, const uint8_t* memory, uint8_t row_colors[TMS9918A::SCREEN_X], uint32_t columns = 0xFFFFFFFF)
+{
+    uint8_t backdrop = GetBackdropColor(registers);
 
-            for(uint16_t pattern_row_index = 0; pattern_row_index < 8; pattern_row_index++) {
+    uint16_t name_y = row / 8;
+    uint16_t pattern_row_index = row % 8;
+    uint16_t sector = (name_y / 8) << THIRD_SHIFT;
+    uint16_t address_mask = ((registers[3] & VR3_ADDRESS_MASK_BITMAP) << VR3_ADDRESS_MASK_SHIFT) | ADDRESS_MASK_FILL;
 
-                uint8_t pattern_row_byte = pattern_rows[pattern_row_index];
+    const uint8_t *names = memory + GetPatternNameTableBase(registers) + name_y * 32;
+    const uint8_t *pattern_table = memory + GetBitmapPatternGeneratorTableBase(registers) + pattern_row_index;
+    const uint8_t *color_table = memory + GetBitmapColorTableBase(registers) + pattern_row_index;
 
-                uint8_t color_pair = color_pair_rows[pattern_row_index];
-                uint8_t color0 = color_pair & 0xf;
-                uint8_t color1 = (color_pair >> 4) & 0xf;
+    for(uint16_t name_x = 0; name_x < 32; name_x++) {
 
-                if(color0 == TRANSPARENT_COLOR_INDEX) {
-                    color0 = backdrop;
-                }
-                if(color1 == TRANSPARENT_COLOR_INDEX) {
-                    color1 = backdrop;
-                }
+        if(!(columns & (1u << name_x))) {
+            continue;
+        }
 
-#pragma unroll 8
-                for(int pattern_col = 0; pattern_col < 8; pattern_col++) {
+        uint8_t pattern_name = names[name_x];
+        uint16_t table_offset = ((pattern_name * 8) + sector) & address_mask;
 
-                    bool bit = pattern_row_byte & (0x80 >> pattern_col);
-                    uint8_t color = bit ? color1 : color0;
+        uint8_t pattern_row_byte = pattern_table[table_offset];
+        uint8_t color_pair = color_table[table_offset];
 
-                    SetPixel(name_x * 8 + pattern_col, name_y * 8 + pattern_row_index, color);
-                }
+        DrawPatternByte(row_colors + name_x * 8, pattern_row_byte, color_pair, backdrop);
+    }
+}
+
+// Sprite pattern bytes with their leftmost pixel in bit 0, and the same with
+// each pixel doubled for magnified sprites
+static const std::array<uint8_t, 256> SpritePixelBits = []() {
+    std::array<uint8_t, 256> bits;
+    for(int pattern = 0; pattern < 256; pattern++) {
+        bits[pattern] = 0;
+        for(int col = 0; col < 8; col++) {
+            if(pattern & (0x80 >> col)) {
+                bits[pattern] |= 1 << col;
             }
         }
     }
-}
+    return bits;
+}();
+
+static const std::array<uint16_t, 256> SpritePixelBitsMagnified = []() {
+    std::array<uint16_t, 256> bits;
+    for(int pattern = 0; pattern < 256; pattern++) {
+        bits[pattern] = 0;
+        for(int col = 0; col < 8; col++) {
+            if(pattern & (0x80 >> col)) {
+                bits[pattern] |= 3 << (col * 2);
+            }
+        }
+    }
+    return bits;
+}();
+
+// The sprites of a frame, decoded from the attribute table once and listed by
+// the rows they cover, so a row only visits its own sprites.  A row's sprites
+// are drawn as bits of a 256-bit mask, colliding where they share a bit with
+// the sprites before them.
+//
+// Only the first row with more than 4 sprites stops at 4, where the fifth
+// sprite flag is set; rows after it draw all of their sprites.
+struct SpriteFrame
+{
+    const uint8_t* memory;
+    bool mag2x;
+    bool size4;
+    int pattern_base;
+
+    // Visible sprites in attribute table order
+    int count{0};
+    std::array<uint8_t, 32> index;
+    std::array<int16_t, 32> x;
+    std::array<int16_t, 32> y;
+    std::array<uint8_t, 32> name;
+    std::array<uint8_t, 32> color;
+
+    std::array<uint8_t, SCREEN_Y> sprites_in_row{};
+    std::array<std::array<uint8_t, 32>, SCREEN_Y> row_sprites;
+
+    int fifth_sprite_row{SCREEN_Y};
+    uint8_t fifth_sprite_flags{0};
+
+    SpriteFrame(const uint8_t* registers, const uint8_t* memory) :
+        memory(memory),
+        mag2x(SpritesAreMagnified2X(registers)),
+        size4(SpritesAreSize4(registers)),
+        pattern_base(GetSpritePatternTableBase(registers))
+    {
+        const uint8_t *attributes = memory + GetSpriteAttributeTableBase(registers);
+
+        int size_pixels = 8;
+        if(mag2x) {
+            size_pixels *= 2;
+        }
+        if(size4) {
+            size_pixels *= 2;
+        }
 
-template <typename SetPixelFunc>
-static void DrawPatternColors(const uint8_t* registers, const uint8_t* memory, SetPixelFunc SetPixel)
-{
-    using namespace TMS9918A;
+        for(int i = 0; i < 32; i++) {
+            auto sprite = attributes + i * 4;
+            if(sprite[0] == 0xD0) {
+                break;
+            }
 
-    GraphicsMode mode = GetGraphicsMode(registers);
+            int sprite_y_byte = (sprite[0] + 1) & 0xFF;
+            int sprite_y = (sprite_y_byte > 209) ? (sprite_y_byte - 256) : sprite_y_byte;
+            int sprite_x = sprite[1];
+            if(sprite[3] & SPRITE_EARLY_CLOCK_MASK) {
+                sprite_x -= 32;
+            }
+            int start_y = std::max(0, sprite_y);
+            int end_y = std::min(sprite_y + size_pixels, SCREEN_Y) - 1;
 
-    if(mode == GraphicsMode::GRAPHICS_I) {
+            if(start_y > end_y) {
+                continue;
+            }
 
-        DrawPatternFromGraphicsI(registers, memory, SetPixel);
+            index[count] = i;
+            x[count] = sprite_x;
+            y[count] = sprite_y;
+            name[count] = size4 ? (sprite[2] & SPRITE_NAME_MASK_SIZE4) : sprite[2];
+            color[count] = sprite[3] & SPRITE_COLOR_MASK;
+            for(int row = start_y; row <= end_y; row++) {
+                row_sprites[row][sprites_in_row[row]++] = count;
+            }
+            count++;
+        }
 
-    } else if(mode == GraphicsMode::GRAPHICS_II) {
-        
-        DrawPatternFromGraphicsII(registers, memory, SetPixel);
+        for(int row = 0; row < SCREEN_Y; row++) {
+            if(sprites_in_row[row] > 4) {
+                fifth_sprite_row = row;
+                fifth_sprite_flags = VDP_STATUS_5S_BIT | (index[row_sprites[row][4]] & VDP_STATUS_5S_MASK);
+                sprites_in_row[row] = 4;
+                break;
+            }
+        }
+    }
 
-    } else {
+    // The pixels of visible sprite "s" on "row", from its x in bit 0
+    uint64_t row_pixels(int s, int row) const
+    {
+        int within_sprite_y = mag2x ? ((row - y[s]) / 2) : (row - y[s]);
+        uint8_t left, right;
+        if(size4) {
+            int quadrant_y = within_sprite_y / 8;
+            int within_quadrant_y = within_sprite_y % 8;
+            left = memory[pattern_base | (name[s] << SPRITE_NAME_SHIFT) | (quadrant_y << 3) | within_quadrant_y];
+            right = memory[pattern_base | (name[s] << SPRITE_NAME_SHIFT) | ((quadrant_y + 2) << 3) | within_quadrant_y];
+        } else {
+            left = memory[pattern_base | (name[s] << SPRITE_NAME_SHIFT) | within_sprite_y];
+            right = 0;
+        }
+        if(mag2x) {
+            return SpritePixelBitsMagnified[left] | (uint64_t(SpritePixelBitsMagnified[right]) << 16);
+        } else {
+            return SpritePixelBits[left] | (SpritePixelBits[right] << 8);
+        }
+    }
 
-        bool M1 = registers[1] & VR1_M1_MASK;
-        bool M2 = registers[1] & VR1_M2_MASK;
-        bool M3 = registers[0] & VR0_M3_MASK;
-        printf("unhandled video mode M1 = %d M2 = %d M3 = %d\n", M1, M2, M3);
+    // Draw the sprites of "row" over "row_colors", unless it is nullptr, and
+    // set the collision flag in "flags_set" if any of them share a pixel
+    void draw_row(int row, uint8_t* row_colors, uint8_t& flags_set) const
+    {
+        // One more word than the row so a sprite's second word always has one
+        uint64_t touched[SCREEN_X / 64 + 1] = {};
+
+        for(int i = 0; i < sprites_in_row[row]; i++) {
+            int s = row_sprites[row][i];
+
+            uint64_t pixels = row_pixels(s, row);
+            int sprite_x = x[s];
+            if(sprite_x < 0) {
+                pixels >>= -sprite_x;
+                sprite_x = 0;
+            }
+            int word = sprite_x / 64;
+            int shift = sprite_x % 64;
+            uint64_t mask[2] = {
+                pixels << shift,
+                ((shift == 0) || (word == SCREEN_X / 64 - 1)) ? 0 : (pixels >> (64 - shift)),
+            };
+
+            uint64_t uncovered[2] = {mask[0] & ~touched[word], mask[1] & ~touched[word + 1]};
+            if((uncovered[0] != mask[0]) || (uncovered[1] != mask[1])) {
+                flags_set |= VDP_STATUS_C_BIT;
+            }
+            touched[word] |= mask[0];
+            touched[word + 1] |= mask[1];
 
-        for(int y = 0; y < SCREEN_Y; y++) {
-            for(int x = 0; x < SCREEN_X; x++) {
-                SetPixel(x, y, 8);
+            if(row_colors && (color[s] != TRANSPARENT_COLOR_INDEX)) {
+                for(int half = 0; half < 2; half++) {
+                    for(uint64_t bits = uncovered[half]; bits != 0; bits &= bits - 1) {
+                        row_colors[(word + half) * 64 + __builtin_ctzll(bits)] = color[s];
+                    }
+                }
             }
         }
     }
-}
+};
 
-template <typename SetPixelFunc>
-static void DrawSprites(int row, const uint8_t* registers, const uint8_t* memory, uint8_t& flags_set, SetPixelFunc SetPixel)
+// Call SetRow(row, row_colors) with each row of the image in turn, pattern
+// colors with sprites drawn over them as SCREEN_X color indices, and return
+// the status flags set by the sprites
+template <typename SetRowFunc>
+static uint8_t CreateRowsAndReturnFlags(const uint8_t* registers, const uint8_t* memory, SetRowFunc SetRow)
 {
     using namespace TMS9918A;
 
-    static bool sprite_touched[SCREEN_X];
-
-    std::fill(sprite_touched, sprite_touched + SCREEN_X, false);
+    uint8_t flags_set = 0;
+    uint8_t row_colors[SCREEN_X];
 
-    // XXX do per row here because will do this per row on Rosa
-    int sprite_table_address = GetSpriteAttributeTableBase(registers);
-    bool mag2x = SpritesAreMagnified2X(registers);
-    bool size4 = SpritesAreSize4(registers);
-    int sprite_count = 32;
-    for(int i = 0; i < 32; i++) {
-        auto sprite = memory + sprite_table_address + i * 4;
-        if(sprite[0] == 0xD0) {
-            sprite_count = i;
-            break;
+    if(ActiveDisplayAreaIsBlanked(registers)) {
+        std::fill(row_colors, row_colors + SCREEN_X, GetBackdropColor(registers));
+        for(int row = 0; row < SCREEN_Y; row++) {
+            SetRow(row, row_colors);
         }
+        return flags_set;
     }
 
-    int size_pixels = 8;
-    if(mag2x) {
-        size_pixels *= 2;
+    GraphicsMode mode = GetGraphicsMode(registers);
+    if((mode != GraphicsMode::GRAPHICS_I) && (mode != GraphicsMode::GRAPHICS_II)) {
+        bool M1 = registers[1] & VR1_M1_MASK;
+        bool M2 = registers[1] & VR1_M2_MASK;
+        bool M3 = registers[0] & VR0_M3_MASK;
+        printf("unhandled video mode M1 = %d M2 = %d M3 = %d\n", M1, M2, M3);
     }
-
-    if(size4) {
-        size_pixels *= 2;
+    bool sprites_visible = SpritesVisible(registers);
+    SpriteFrame sprites(registers, memory);
+    if(sprites_visible) {
+        flags_set |= sprites.fifth_sprite_flags;
     }
 
-    int sprites_in_row = 0;
-    for(int i = 0; i < sprite_count; i++) {
-        auto sprite = memory + sprite_table_address + i * 4;
-
-        int sprite_y_byte = (sprite[0] + 1) & 0xFF;
-        int sprite_y = (sprite_y_byte > 209) ? (sprite_y_byte - 256) : sprite_y_byte;
-        int sprite_x = sprite[1];
-        int sprite_name = sprite[2];
-        bool sprite_earlyclock = sprite[3] & SPRITE_EARLY_CLOCK_MASK;
-        int sprite_color = sprite[3] & SPRITE_COLOR_MASK;
+    for(int row = 0; row < SCREEN_Y; row++) {
+        if(mode == GraphicsMode::GRAPHICS_I) {
+            DrawPatternRowFromGraphicsI(row, registers, memory, row_colors);
+        } else if(mode == GraphicsMode::GRAPHICS_II) {
+            DrawPatternRowFromGraphicsII(row, registers, memory, row_colors);
+        } else {
+            std::fill(row_colors, row_colors + SCREEN_X, 8);
+        }
+        if(sprites_visible) {
+            sprites.draw_row(row, row_colors, flags_set);
+        }
+        SetRow(row, row_colors);
+    }
 
-        // printf("sprite %d: %d %d %d %d\n", i, sprite_x, sprite_y, sprite_name, sprite_color);
+    return flags_set;
+}
 
-        if(sprite_earlyclock) {
-            sprite_x -= 32;
+template <typename SetPixelFunc>
+static uint8_t CreateImageAndReturnFlags(const uint8_t* registers, const uint8_t* memory, SetPixelFunc SetPixel)
+{
+    auto pixel_row_setter = [&SetPixel](int row, const uint8_t* row_colors) {
+        for(int col = 0; col < SCREEN_X; col++) {
+            SetPixel(col, row, row_colors[col]);
         }
+    };
 
-        int start_x = std::max(0, sprite_x);
-        int start_y = std::max(0, sprite_y);
-        int end_x = std::min(sprite_x + size_pixels, SCREEN_X) - 1;
-        int end_y = std::min(sprite_y + size_pixels, SCREEN_Y) - 1;
+    return CreateRowsAndReturnFlags(registers, memory, pixel_row_setter);
+}
 
-        if(start_y <= row && row <= end_y) {
+// The pattern colors of the last frame drawn, kept so the next frame draws
+// again only the names whose name table entry, pattern, or colors were
+// written since.  The VDP reports every write to VRAM with memory_written;
+// changes to the registers choosing the tables are found by comparing them
+// with those the colors were drawn from.
+struct Background
+{
+    static constexpr int MEMORY_SIZE = 16384;
+    static constexpr int UNIT_BYTES = 8;        // one pattern or 8 names
 
-            int within_sprite_y = mag2x ? ((row - sprite_y) / 2) : (row - sprite_y);
+    std::bitset<MEMORY_SIZE / UNIT_BYTES> written_units;
+    bool drawn{false};
+    std::array<uint8_t, REGISTER_COUNT> drawn_registers{};
+    std::array<uint8_t, SCREEN_X * SCREEN_Y> colors{};
 
-            sprites_in_row ++;
-            if(!SpritesCollided(flags_set) && sprites_in_row > 4) {
-                flags_set |= VDP_STATUS_5S_BIT;
-                flags_set |= i & VDP_STATUS_5S_MASK;
-                break;
-            }
+    void memory_written(uint16_t address)
+    {
+        written_units.set(address / UNIT_BYTES);
+    }
 
-            auto set_color_from_bit = [&flags_set, sprite_color, &SetPixel, row](int bit, int x) {
-                if(bit) {
-                    if(!sprite_touched[x]) {
-                        sprite_touched[x] = true;
-                        if(sprite_color != TRANSPARENT_COLOR_INDEX) {
-                            SetPixel(x, row, sprite_color);
-                        }
-                    } else {
-                        flags_set |= VDP_STATUS_C_BIT;
-                    }
-                }
-            };
+    // "count" bytes from "address", not wrapping around VRAM
+    void memory_written(uint16_t address, size_t count)
+    {
+        if(count == 0) {
+            return;
+        }
+        for(size_t unit = address / UNIT_BYTES; unit <= (address + count - 1) / UNIT_BYTES; unit++) {
+            written_units.set(unit);
+        }
+    }
 
-            if(size4) {
-                int within_quadrant_y = within_sprite_y % 8;
-                int quadrant_y = within_sprite_y / 8;
-                int masked_sprite_name = sprite_name & SPRITE_NAME_MASK_SIZE4;
+    // All of VRAM may have changed, as after loading a state
+    void everything_written()
+    {
+        drawn = false;
+    }
 
-#pragma unroll 8
-                for(int x = start_x; x <= end_x; x++) {
+    // As CreateRowsAndReturnFlags, drawing only the pattern colors of names
+    // written since the last call
+    template <typename SetRowFunc>
+    uint8_t create_rows_and_return_flags(const uint8_t* registers, const uint8_t* memory, SetRowFunc SetRow)
+    {
+        GraphicsMode mode = GetGraphicsMode(registers);
+        if(ActiveDisplayAreaIsBlanked(registers) || ((mode != GRAPHICS_I) && (mode != GRAPHICS_II))) {
+            return CreateRowsAndReturnFlags(registers, memory, SetRow);
+        }
 
-                    int within_sprite_x = mag2x ? ((x - sprite_x) / 2) : (x - sprite_x);
+        update(registers, memory);
 
-                    int quadrant = quadrant_y + (within_sprite_x / 8) * 2;
-                    int within_quadrant_x = within_sprite_x % 8;
-                    int sprite_pattern_address = GetSpritePatternTableBase(registers) | (masked_sprite_name << SPRITE_NAME_SHIFT) | (quadrant << 3) | within_quadrant_y;
-                    int bit = memory[sprite_pattern_address] & (0x80 >> within_quadrant_x);
-                    set_color_from_bit(bit, x);
-                }
+        SpriteFrame sprites(registers, memory);
+        uint8_t flags_set = sprites.fifth_sprite_flags;
+        uint8_t row_colors[SCREEN_X];
 
-            } else {
+        for(int row = 0; row < SCREEN_Y; row++) {
+            memcpy(row_colors, colors.data() + row * SCREEN_X, SCREEN_X);
+            sprites.draw_row(row, row_colors, flags_set);
+            SetRow(row, row_colors);
+        }
 
-                int sprite_pattern_address = GetSpritePatternTableBase(registers) | (sprite_name << SPRITE_NAME_SHIFT) | within_sprite_y;
-                int bitpattern = memory[sprite_pattern_address];
+        return flags_set;
+    }
 
-#pragma unroll 8
-                for(int x = start_x; x <= end_x; x++) {
+    bool written(uint32_t address) const
+    {
+        return written_units.test(address / UNIT_BYTES);
+    }
 
-                    int within_sprite_x = mag2x ? ((x - sprite_x) / 2) : (x - sprite_x);
+    // Whether the pattern colors of "registers" come from the same tables in
+    // the same mode and backdrop as those of "drawn_registers"
+    bool same_tables(const uint8_t* registers) const
+    {
+        return (registers[0] == drawn_registers[0]) &&
+            ((registers[1] & (VR1_M1_MASK | VR1_M2_MASK)) == (drawn_registers[1] & (VR1_M1_MASK | VR1_M2_MASK))) &&
+            std::equal(registers + 2, registers + 5, drawn_registers.begin() + 2) &&
+            (registers[7] == drawn_registers[7]);
+    }
 
-                    int bit = bitpattern & (0x80 >> within_sprite_x);
-                    set_color_from_bit(bit, x);
+    // Set the bits in "columns" of names of each row of names whose entry,
+    // pattern, or colors were written
+    void find_written_names(const uint8_t* registers, const uint8_t* memory, std::array<uint32_t, 24>& columns) const
+    {
+        uint16_t name_table_base = GetPatternNameTableBase(registers);
+
+        // By pattern name and then by third of the screen in Graphics II
+        std::array<bool, 256 * 3> pattern_written;
+
+        if(GetGraphicsMode(registers) == GRAPHICS_I) {
+            uint16_t pattern_base = GetStandardPatternGeneratorTableBase(registers);
+            uint16_t color_base = GetStandardColorTableBase(registers);
+            for(int pattern_name = 0; pattern_name < 256; pattern_name++) {
+                bool was_written = written(pattern_base + pattern_name * 8) || written(color_base + pattern_name / 8);
+                for(int third = 0; third < 3; third++) {
+                    pattern_written[third * 256 + pattern_name] = was_written;
+                }
+            }
+        } else {
+            uint16_t pattern_base = GetBitmapPatternGeneratorTableBase(registers);
+            uint16_t color_base = GetBitmapColorTableBase(registers);
+            uint16_t address_mask = ((registers[3] & VR3_ADDRESS_MASK_BITMAP) << VR3_ADDRESS_MASK_SHIFT) | ADDRESS_MASK_FILL;
+            for(int third = 0; third < 3; third++) {
+                for(int pattern_name = 0; pattern_name < 256; pattern_name++) {
+                    uint16_t table_offset = ((pattern_name * 8) + (third << THIRD_SHIFT)) & address_mask;
+                    pattern_written[third * 256 + pattern_name] = written(pattern_base + table_offset) || written(color_base + table_offset);
                 }
             }
-
         }
-    }
-}
 
-static void AddSpritesToRow(int row, uint8_t row_colors[TMS9918A::SCREEN_X], const uint8_t* registers, const uint8_t* memory, uint8_t& flags_set)
-{
-    auto RowSetPixel = [row_colors, row](int x, int y, int color) {
-        // We know row is constant so ignore it.
-        if(row_colors) {
-            row_colors[x] = color;
+        for(int name_y = 0; name_y < 24; name_y++) {
+            columns[name_y] = 0;
+            for(int name_x = 0; name_x < 32; name_x++) {
+                uint16_t address = name_table_base + name_y * 32 + name_x;
+                if(written(address) || pattern_written[(name_y / 8) * 256 + memory[address]]) {
+                    columns[name_y] |= 1u << name_x;
+                }
+            }
         }
-    };
-    DrawSprites(row, registers, memory, flags_set, RowSetPixel);
-}
+    }
 
-template <typename SetPixelFunc>
-static uint8_t CreateImageAndReturnFlags(const uint8_t* registers, const uint8_t* memory, SetPixelFunc SetPixel)
-{
-    using namespace TMS9918A;
+    void update(const uint8_t* registers, const uint8_t* memory)
+    {
+        std::array<uint32_t, 24> columns;
 
-    uint8_t flags_set = 0;
+        if(!drawn || !same_tables(registers)) {
+            columns.fill(0xFFFFFFFF);
+        } else if(written_units.none()) {
+            return;
+        } else {
+            find_written_names(registers, memory, columns);
+        }
 
-    if(ActiveDisplayAreaIsBlanked(registers)) {
-        uint8_t backdrop = GetBackdropColor(registers);
+        bool graphics_i = GetGraphicsMode(registers) == GRAPHICS_I;
         for(int row = 0; row < SCREEN_Y; row++) {
-            for(int col = 0; col < SCREEN_X; col++) {
-                SetPixel(col, row, backdrop);
+            uint32_t row_columns = columns[row / 8];
+            if(row_columns == 0) {
+                continue;
+            }
+            if(graphics_i) {
+                DrawPatternRowFromGraphicsI(row, registers, memory, colors.data() + row * SCREEN_X, row_columns);
+            } else {
+                DrawPatternRowFromGraphicsII(row, registers, memory, colors.data() + row * SCREEN_X, row_columns);
             }
         }
-        return flags_set;
-    }
 
-    DrawPatternColors(registers, memory, SetPixel);
-    if(SpritesVisible(registers)) {
-        for(int row = 0; row < SCREEN_Y; row++) {
-            DrawSprites(row, registers, memory, flags_set, SetPixel);
-        }
+        written_units.reset();
+        drawn = true;
+        std::copy(registers, registers + REGISTER_COUNT, drawn_registers.begin());
     }
+};
 
-    return flags_set;
-}
-
+// The flags CreateImageAndReturnFlags would return, without drawing
 [[maybe_unused]] static uint8_t GetStatusFromSpriteConfiguration(const uint8_t* registers, const uint8_t* memory)
 {
     using namespace TMS9918A;
 
     uint8_t flags_set = 0;
 
-    for(int row = 0; row < SCREEN_Y; row++) {
-        if(SpritesVisible(registers)) {
-            AddSpritesToRow(row, nullptr, registers, memory, flags_set);
+    if(ActiveDisplayAreaIsBlanked(registers) || !SpritesVisible(registers)) {
+        return flags_set;
+    }
+
+    SpriteFrame sprites(registers, memory);
+    flags_set |= sprites.fifth_sprite_flags;
+
+    for(int row = 0; (row < SCREEN_Y) && !(flags_set & VDP_STATUS_C_BIT); row++) {
+        if(sprites.sprites_in_row[row] > 1) {
+            sprites.draw_row(row, nullptr, flags_set);
         }
     }
 
@@ -580,11 +978,11 @@ static uint8_t CreateImageAndReturnFlags(const uint8_t* registers, const uint8_t
 
 [[maybe_unused]] static uint8_t Create4BitPixmap(const uint8_t* registers, const uint8_t* memory, uint8_t fb[128 * 192])
 {
-    auto pixel_setter = [fb](int x, int y, uint8_t color) {
-        TMS9918A::Set4BitPixmapColor(fb, x, y, color);
+    auto row_setter = [fb](int row, const uint8_t* row_colors) {
+        TMS9918A::ConvertRowTo4BitPixmap(row_colors, fb + row * (TMS9918A::SCREEN_X / 2));
     };
 
-    return TMS9918A::CreateImageAndReturnFlags(registers, memory, pixel_setter);
+    return TMS9918A::CreateRowsAndReturnFlags(registers, memory, row_setter);
 }
 
 };
@@ -79,4 +79,92 @@
 
 /* #define Z80_MASK_IM2_VECTOR_ADDRESS */
 
+/* By default, emulate() decodes each instruction through a single switch 
+ * statement, which is the reference implementation. Define this macro to 
+ * instead build it as a direct-threaded interpreter using the "labels as 
+ * values" extension of GCC and Clang: each instruction handler then ends with
+ * its own fetch and indirect jump through per-opcode label tables (separate 
+ * ones for unprefixed, 0xcb, 0xed, 0xdd, and 0xfd opcodes, see dispatch.h), 
+ * which the host's branch predictor handles much better. The instruction 
+ * variable is not available to the user macros in this configuration. The 
+ * Makefile defines it when built with USE_THREADED_DISPATCH=1.
+ */
+
+/* #define Z80_THREADED_DISPATCH */
+
+/* Define this macro to have emulate() predecode straight-line runs of code
+ * that never changes into blocks, kept in the Z80_STATE's block_cache (see 
+ * Z80CreateBlockCache()), and run them without fetching and decoding opcodes 
+ * and prefixes again. A block is only run when elapsed_cycles stays below
+ * number_cycles until its last instruction, so that the instructions inside it
+ * only check whether a user macro lowered number_cycles, as Z80_READ_BYTE does
+ * to stop the emulation at a bank switch. Blocks end with input and output
+ * instructions. Each block is also chained to the blocks that followed it, so
+ * that code running from one block to the next does not look them up again.
+ * The user macro Z80_CODE_IS_CACHEABLE() must be defined, see z80user.h. The
+ * Makefile defines it when built with USE_BLOCK_CACHE=1.
+ */
+
+/* #define Z80_BLOCK_CACHE */
+
+/* Define this macro to have emulate() detect idle loops, which wait for an 
+ * interrupt by polling memory or Z80_IDLE_INPUT() ports: short loops closed 
+ * by a JR or JP instruction, made of instructions that neither write nor 
+ * transfer control. Once the registers stay the same over two iterations, the
+ * following iterations are skipped up to number_cycles, adding their cycles
+ * and R increments without running them. Only code accepted by 
+ * Z80_CODE_IS_CACHEABLE() is considered, and the memory and ports read by a
+ * loop must not change while Z80Emulate() runs but through the loop itself.
+ * The user macros Z80_IDLE_INPUT(), Z80_IDLE_LOOP_ALLOWED(), and 
+ * Z80_IDLE_LOOP_SKIPPED() must be defined as well, see z80user.h. The 
+ * Makefile defines it when built with USE_IDLE_LOOPS=1.
+ */
+
+/* #define Z80_IDLE_LOOPS */
+
+/* Define this macro to let the user macro Z80_HLE_ROUTINE() run routines 
+ * natively instead of emulating their code. It is run by each taken CALL 
+ * instruction once the return address is pushed and pc is set to the 
+ * routine's address. To replace the routine, it updates the registers and 
+ * memory as the routine would, pops pc like its RET would, and adds the 
+ * routine's cycles and R increments to elapsed_cycles and r. See z80user.h. 
+ * The Makefile defines it when built with USE_HLE=1.
+ */
+
+/* #define Z80_HLE */
+
+/* Define this macro to have LDIR, LDDR, INIR, INDR, OTIR, and OTDR run all the
+ * iterations before their next check of number_cycles at once, through the 
+ * user macros Z80_COPY_BLOCK(), Z80_INPUT_BLOCK(), and Z80_OUTPUT_BLOCK() 
+ * instead of one byte at a time. These must give the same result as the 
+ * single byte macros would, see z80user.h. It can't be used with 
+ * Z80_HANDLE_SELF_MODIFYING_CODE. The Makefile defines it when built with
+ * USE_BLOCK_TRANSFERS=1.
+ */
+
+/* #define Z80_BLOCK_TRANSFERS */
+
+/* Define this macro to have the 8-bit ADD, ADC, SUB, SBC, CP, INC, and DEC 
+ * instructions record their operands and result instead of computing F. The
+ * flags are only computed, with the same undocumented bits, when an 
+ * instruction reads F, pushes or exchanges AF, or when the emulation stops, 
+ * and conditional jumps on Z or C test the recorded result directly. F is 
+ * always up to date once Z80Emulate() returns. The Makefile defines it when 
+ * built with USE_LAZY_FLAGS=1.
+ */
+
+/* #define Z80_LAZY_FLAGS */
+
+/* Define this macro, along with Z80_BLOCK_CACHE, to have the blocks entered
+ * Z80_JIT_THRESHOLD times (16 unless defined) translated to x86-64 code, run
+ * as compiled blocks, see z80jit.c. Translated code reads and writes memory
+ * and ports through the user macros, which must only use state, context, and
+ * number_cycles, and not elapsed_cycles. Blocks are only translated on 
+ * x86-64 hosts that allow memory to be both writable and executable, and 
+ * without Z80_DOCUMENTED_FLAGS_ONLY. The translations are discarded with the
+ * cache. The Makefile defines it when built with USE_JIT=1.
+ */
+
+/* #define Z80_JIT */
+
 #endif
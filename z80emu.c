@@ -7,81 +7,320 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
 #include "z80emu.h"
 #include "z80user.h"
 #include "instructions.h"
 #include "macros.h"
 #include "tables.h"
+#include "encodings.h"
 
-/* Indirect (HL) or prefixed indexed (IX + d) and (IY + d) memory operands are
- * encoded using the 3 bits "110" (0x06).
+#ifdef Z80_JIT
+
+#ifndef Z80_BLOCK_CACHE
+#error "Z80_JIT translates the blocks of Z80_BLOCK_CACHE"
+#endif
+
+#include "z80jit.h"
+
+/* Number of times a block is entered before it is translated. */
+
+#ifndef Z80_JIT_THRESHOLD
+#define Z80_JIT_THRESHOLD       16
+#endif
+
+#endif
+
+#ifdef Z80_BLOCK_CACHE
+
+/* With Z80_BLOCK_CACHE, entry and block_end delimit the rest of the block
+ * being run, if any.  Instructions inside a block follow each other without
+ * cycle checks, LOOKUP_BLOCK() only enters a block if none of these checks 
+ * could have stopped the emulation before its last instruction.  last_block 
+ * is the block whose last instruction has just been run, or NULL if it was 
+ * run by the interpreter.
+ */
+
+#ifdef Z80_THREADED_DISPATCH
+
+#define GOTO_BLOCK_ENTRY        goto *(entry++)->handler
+
+#else
+
+#define GOTO_BLOCK_ENTRY                                                \
+{                                                                       \
+        instruction = (entry++)->instruction;                           \
+        goto emulate_block_entry;                                       \
+}
+
+#endif
+
+#define DISPATCH_BLOCK_ENTRY                                            \
+{                                                                       \
+        elapsed_cycles += entry->cycles;                                \
+        r += entry->r;                                                  \
+        pc += entry->length;                                            \
+        opcode = entry->opcode;                                         \
+        registers = (void **) ((char *) state + entry->registers);      \
+        GOTO_BLOCK_ENTRY;                                               \
+}
+
+/* A block is only run when it ends before number_cycles, so elapsed_cycles
+ * reaching number_cycles inside it means that a user macro lowered it to stop
+ * the emulation, as a data read switching MegaCart banks does.
  */
 
-#define INDIRECT_HL     0x06
+#define CONTINUE_BLOCK                                                  \
+{                                                                       \
+        if (entry != block_end && elapsed_cycles < number_cycles)       \
+                                                                        \
+                DISPATCH_BLOCK_ENTRY;                                   \
+}
 
-/* Condition codes are encoded using 2 or 3 bits.  The xor table is needed for
- * negated conditions, it is used along with the and table.
+/* A compiled block leaves pc and r as its last instruction would have, 
+ * end_compiled_block then finishes that instruction like the interpreter.
  */
 
-static const int XOR_CONDITION_TABLE[8] = {
+#define RUN_COMPILED_BLOCK(block)                                       \
+{                                                                       \
+        LEAVE_IDLE_LOOP;                                                \
+        FLUSH_FLAGS;                                                    \
+        elapsed_cycles = (block)->compiled(state, &pc, &r,              \
+                elapsed_cycles, &number_cycles, context);               \
+        if (state->status)                                              \
+                                                                        \
+                goto stop_emulation;                                    \
+                                                                        \
+        goto end_compiled_block;                                        \
+}
+
+#ifdef Z80_JIT
 
-        Z80_Z_FLAG,
-        0,
-        Z80_C_FLAG,
-        0,
-        Z80_P_FLAG,
-        0,
-        Z80_S_FLAG,
-        0,
+/* With Z80_JIT, a block is translated to a compiled function the 
+ * Z80_JIT_THRESHOLD-th time it is entered, and only then.
+ */
 
-};
+#define TRANSLATE_BLOCK(block)                                          \
+{                                                                       \
+        if ((block)->compiled == NULL                                   \
+                && (block)->runs < Z80_JIT_THRESHOLD                    \
+                && ++(block)->runs == Z80_JIT_THRESHOLD)                \
+                                                                        \
+                (block)->compiled = translate_block(state, pc, context);\
+}
 
-static const int AND_CONDITION_TABLE[8] = {
+#else
 
-        Z80_Z_FLAG,
-        Z80_Z_FLAG,
-        Z80_C_FLAG,
-        Z80_C_FLAG,
-        Z80_P_FLAG,
-        Z80_P_FLAG,
-        Z80_S_FLAG,
-        Z80_S_FLAG,
+#define TRANSLATE_BLOCK(block)
 
-};
+#endif
+
+#define LOOKUP_BLOCK                                                    \
+{                                                                       \
+        Z80_BLOCK       *block;                                         \
+                                                                        \
+        if (state->block_cache != NULL) {                               \
+                                                                        \
+                block = next_block(state->block_cache, last_block, pc,  \
+                        BLOCK_HANDLERS, context);                       \
+                if (block != NULL                                       \
+                        && elapsed_cycles + block->cycles               \
+                                < number_cycles) {                      \
+                                                                        \
+                        last_block = block;                             \
+                        TRANSLATE_BLOCK(block);                         \
+                        if (block->compiled != NULL)                    \
+                                                                        \
+                                RUN_COMPILED_BLOCK(block);              \
+                                                                        \
+                        entry = block->entries;                         \
+                        block_end = entry + block->count;               \
+                        DISPATCH_BLOCK_ENTRY;                           \
+                                                                        \
+                }                                                       \
+                last_block = NULL;                                      \
+                                                                        \
+        }                                                               \
+}
 
-/* RST instruction restart addresses, encoded by Y() bits of the opcode. */
+#else
 
-static const int RST_TABLE[8] = {
+#define CONTINUE_BLOCK
+#define LOOKUP_BLOCK
 
-        0x00,
-        0x08,
-        0x10,
-        0x18,
-        0x20,
-        0x28,
-        0x30,
-        0x38,
+#endif
 
-};      
+#ifdef Z80_IDLE_LOOPS
 
-/* There is an overflow if the xor of the carry out and the carry of the most
- * significant bit is not zero.
+/* IDLE_LOOP() is run by taken JR and JP instructions, before pc is set to 
+ * target, and skips iterations of the loop if it is idle. LEAVE_IDLE_LOOP 
+ * forgets the loop being tracked when it could be left in other ways than by
+ * a branch not taken at its end.
  */
 
-static const int OVERFLOW_TABLE[4] = {
-                        
-	0,
-       	Z80_V_FLAG,
-       	Z80_V_FLAG,
-       	0,
+#define IDLE_LOOP(target, end)                                          \
+{                                                                       \
+        int     iterations;                                             \
+                                                                        \
+        if ((target) < (end)) {                                         \
+                                                                        \
+                FLUSH_FLAGS;                                            \
+                iterations = skip_idle_loop(&idle_loop, state,          \
+                        (target), (end),                                \
+                        elapsed_cycles, number_cycles, r,               \
+                        context);                                       \
+                elapsed_cycles += iterations * idle_loop.cycles;        \
+                r += iterations * idle_loop.r_increment;                \
+                                                                        \
+        }                                                               \
+}
 
-};
+#define LEAVE_IDLE_LOOP         idle_loop.start = -1
+
+#else
+
+#define IDLE_LOOP(target, end)
+#define LEAVE_IDLE_LOOP
+
+#endif
+
+#ifdef Z80_HLE
+
+/* HLE_ROUTINE is run by taken CALL instructions, once the return address is
+ * pushed and pc is set to the routine's address, see Z80_HLE in z80config.h.
+ */
+
+#define HLE_ROUTINE                                                     \
+{                                                                       \
+        FLUSH_FLAGS;                                                    \
+        Z80_HLE_ROUTINE();                                              \
+}
+
+#else
+
+#define HLE_ROUTINE
+
+#endif
+
+#ifdef Z80_BLOCK_TRANSFERS
+
+#ifdef Z80_HANDLE_SELF_MODIFYING_CODE
+#error "Z80_BLOCK_TRANSFERS can't handle self modifying code"
+#endif
+
+/* Number of the first count iterations of LDIR, LDDR, INIR, INDR, OTIR, or 
+ * OTDR that run before the check of number_cycles stops the instruction, at
+ * least one. elapsed_cycles must not include the 8 cycles of its fetch yet,
+ * and every iteration but the last takes 21 cycles.
+ */
+
+#define REPEAT_ITERATIONS(count, n)                                     \
+{                                                                       \
+        int     remaining;                                              \
+                                                                        \
+        remaining = number_cycles - elapsed_cycles;                     \
+        (n) = remaining > 0 ? (remaining - 1) / 21 + 1 : 1;             \
+        if ((n) > (count))                                              \
+                                                                        \
+                (n) = (count);                                          \
+}
+
+#endif
+
+/* Instruction handlers in emulate() are written once and compiled either as
+ * the cases of a switch statement, or with Z80_THREADED_DISPATCH as labels of
+ * a direct-threaded interpreter.  In the threaded version, each handler ends
+ * with its own cycle check, opcode fetch, and indirect jump through the label
+ * tables generated into dispatch.h, instead of sharing the single switch.
+ * DISPATCH() continues decoding opcode, which has just been fetched, after a
+ * prefix.
+ */
+
+#ifdef Z80_THREADED_DISPATCH
+
+#define INSTRUCTION(instruction)        instruction
+
+#define DISPATCH(instruction_table, dispatch_table)                     \
+{                                                                       \
+        elapsed_cycles += 4;                                            \
+        r++;                                                            \
+        goto *(dispatch_table)[opcode];                                 \
+}
+
+#ifdef Z80_BLOCK_CACHE
+
+/* The block lookup is shared at enter_block rather than copied into every
+ * handler.
+ */
+
+#define ENTER_BLOCK                                                     \
+{                                                                       \
+        if (state->block_cache != NULL)                                 \
+                                                                        \
+                goto enter_block;                                       \
+}
+
+#else
+
+#define ENTER_BLOCK
+
+#endif
+
+#define END_INSTRUCTION                                                 \
+{                                                                       \
+        CONTINUE_BLOCK;                                                 \
+                                                                        \
+        if (elapsed_cycles >= number_cycles)                            \
+                                                                        \
+                goto stop_emulation;                                    \
+                                                                        \
+        ENTER_BLOCK;                                                    \
+        Z80_FETCH_BYTE(pc, opcode);                                     \
+        pc++;                                                           \
+        registers = state->register_table;                              \
+        DISPATCH(INSTRUCTION_TABLE, DISPATCH_TABLE);                    \
+}
+
+#else
+
+#define INSTRUCTION(instruction)        case instruction
+
+#define DISPATCH(instruction_table, dispatch_table)                     \
+{                                                                       \
+        instruction = (instruction_table)[opcode];                      \
+        goto emulate_next_instruction;                                  \
+}
+
+#define END_INSTRUCTION                 break
+
+#ifdef Z80_BLOCK_CACHE
+
+#define BLOCK_HANDLERS                  NULL
+
+#endif
+
+#endif
 
 static int	emulate (Z80_STATE * state, 
 			int opcode,
 			int elapsed_cycles, int number_cycles,
 			void *context);
 
+/* Interrupts are accepted after the HALT instruction being executed, if any.
+ */
+
+static void leave_halt (Z80_STATE *state)
+{
+        if (state->halted) {
+
+                state->pc = (state->pc + 1) & 0xffff;
+                state->halted = 0;
+
+        }
+}
+
 void Z80Reset (Z80_STATE *state)
 {
         int     i;
@@ -90,6 +329,7 @@ void Z80Reset (Z80_STATE *state)
         AF = 0xffff;
         SP = 0xffff;
         state->i = state->pc = state->iff1 = state->iff2 = state->in_nmi = 0;
+        state->halted = 0;
         state->im = Z80_INTERRUPT_MODE_0;
         
         /* Build register decoding tables for both 3-bit encoded 8-bit
@@ -156,6 +396,7 @@ int Z80Interrupt (Z80_STATE *state, int data_on_bus, void *context)
         state->status = 0;
         if (state->iff1) {
 				
+                leave_halt(state);
                 state->iff1 = state->iff2 = 0;
                 state->r = (state->r & 0x80) | ((state->r + 1) & 0x7f);
                 switch (state->im) {
@@ -219,6 +460,7 @@ int Z80NonMaskableInterrupt (Z80_STATE *state, void *context)
 	int	elapsed_cycles;
 
         state->status = 0;
+        leave_halt(state);
 
         state->iff2 = state->iff1;
         state->iff1 = 0;
@@ -233,29 +475,1469 @@ int Z80NonMaskableInterrupt (Z80_STATE *state, void *context)
         return elapsed_cycles + 11;
 }
 
-int Z80Emulate (Z80_STATE *state, int number_cycles, void *context)
-{
-        int     elapsed_cycles, pc, opcode;
+int Z80Emulate (Z80_STATE *state, int number_cycles, void *context)
+{
+        int     elapsed_cycles, pc, opcode;
+
+        state->status = 0;
+	elapsed_cycles = 0;
+	pc = state->pc;
+        Z80_FETCH_BYTE(pc, opcode);
+        state->pc = pc + 1;
+
+        return emulate(state, opcode, elapsed_cycles, number_cycles, context);
+}
+
+#if defined(Z80_BLOCK_CACHE) || defined(Z80_IDLE_LOOPS)
+
+/* Values returned by decode_instruction(). */
+
+enum {
+
+        BLOCK_EXCLUDED,
+        BLOCK_CONTINUES,
+        BLOCK_ENDS
+
+};
+
+/* Decode the instruction at pc, and set *length and *cycles to its total size
+ * and number of cycles. Control transfer and input/output instructions are
+ * returned as ending the block, their cycles are not needed. Instructions 
+ * that may stop the emulation on their own, modify number_cycles, or whose 
+ * timing depends on their operands (HALT, DI, EI, and the repeated block 
+ * instructions), are left to the interpreter, as well as unusual prefix
+ * combinations. The decoder is shared by the block cache and the detection of
+ * idle loops.
+ */
+
+static int decode_instruction (Z80_BLOCK_INSTRUCTION *decoded, 
+        int *length, int *cycles,
+        int pc, 
+        void *context)
+{
+        int     opcode, instruction, operands, prefixed, indexable;
+        int     status;
+
+        if (!Z80_CODE_IS_CACHEABLE(pc))
+
+                return BLOCK_EXCLUDED;
+
+        Z80_FETCH_BYTE(pc, opcode);
+        instruction = INSTRUCTION_TABLE[opcode];
+        decoded->address = pc;
+        decoded->prefix = 0;
+        decoded->length = 1;
+        decoded->cycles = 4;
+        decoded->r = 1;
+        prefixed = 0;
+
+        if (instruction == DD_PREFIX || instruction == FD_PREFIX) {
+
+                decoded->prefix = opcode;
+                if (!Z80_CODE_IS_CACHEABLE(pc + 1))
+
+                        return BLOCK_EXCLUDED;
+
+                Z80_FETCH_BYTE(pc + 1, opcode);
+                instruction = INDEXED_INSTRUCTION_TABLE[opcode];
+                decoded->length = 2;
+                decoded->cycles = 8;
+                decoded->r = 2;
+                prefixed = 1;
+
+                if (instruction == INDEXED_CB_PREFIX) {
+
+                        /* The displacement comes before the opcode, and pc
+                         * is left on it for the handler. Only the (IX + d)
+                         * and (IY + d) forms are cached.
+                         */
+
+                        if (!Z80_CODE_IS_CACHEABLE(pc + 3))
+
+                                return BLOCK_EXCLUDED;
+
+                        Z80_FETCH_BYTE(pc + 3, opcode);
+                        if (Z(opcode) != INDIRECT_HL)
+
+                                return BLOCK_EXCLUDED;
+
+                        instruction = INDEXED_CB_INSTRUCTION_TABLE[opcode];
+                        decoded->prefix = decoded->prefix << 8 | 0xcb;
+                        decoded->cycles = 12;
+
+                } else if (instruction == DD_PREFIX
+                        || instruction == FD_PREFIX
+                        || instruction == ED_PREFIX)
+
+                        return BLOCK_EXCLUDED;
+
+        } else if (instruction == CB_PREFIX || instruction == ED_PREFIX) {
+
+                decoded->prefix = opcode;
+                if (!Z80_CODE_IS_CACHEABLE(pc + 1))
+
+                        return BLOCK_EXCLUDED;
+
+                Z80_FETCH_BYTE(pc + 1, opcode);
+                instruction = decoded->prefix == 0xcb 
+                        ? CB_INSTRUCTION_TABLE[opcode]
+                        : ED_INSTRUCTION_TABLE[opcode];
+                decoded->length = 2;
+                decoded->cycles = 8;
+                decoded->r = 2;
+
+        }
+
+        /* Documented timings of the unprefixed forms, including the 0xcb and
+         * 0xed prefixes.
+         */
+
+        operands = indexable = 0;
+        status = BLOCK_CONTINUES;
+        switch (instruction) {
+
+                case JP_HL:
+                case RET:
+                case RET_CC:
+                case RETI_RETN:
+                case RST_P:
+                case IN_R_C:
+                case INI_IND:
+                case OUT_C_R:
+                case OUTI_OUTD: {
+
+                        *cycles = 0;
+                        status = BLOCK_ENDS;
+                        break;
+
+                }
+
+                case JR_E:
+                case JR_DD_E:
+                case DJNZ_E:
+                case IN_A_N:
+                case OUT_N_A: {
+
+                        *cycles = 0;
+                        operands = 1;
+                        status = BLOCK_ENDS;
+                        break;
+
+                }
+
+                case JP_NN:
+                case JP_CC_NN:
+                case CALL_NN:
+                case CALL_CC_NN: {
+
+                        *cycles = 0;
+                        operands = 2;
+                        status = BLOCK_ENDS;
+                        break;
+
+                }
+
+                case LD_R_R:
+                case EX_DE_HL:
+                case EX_AF_AF_PRIME:
+                case EXX:
+                case ADD_R:
+                case ADC_R:
+                case SUB_R:
+                case SBC_R:
+                case AND_R:
+                case XOR_R:
+                case OR_R:
+                case CP_R:
+                case INC_R:
+                case DEC_R:
+                case DAA:
+                case CPL:
+                case CCF:
+                case SCF:
+                case NOP:
+                case RLCA:
+                case RLA:
+                case RRCA:
+                case RRA: {
+
+                        *cycles = 4;
+                        break;
+
+                }
+
+                case LD_SP_HL:
+                case INC_RR:
+                case DEC_RR: {
+
+                        *cycles = 6;
+                        break;
+
+                }
+
+                case LD_R_N:
+                case ADD_N:
+                case ADC_N:
+                case SUB_N:
+                case SBC_N:
+                case AND_N:
+                case XOR_N:
+                case OR_N:
+                case CP_N: {
+
+                        *cycles = 7;
+                        operands = 1;
+                        break;
+
+                }
+
+                case LD_R_INDIRECT_HL:
+                case LD_R_INDEXED:
+                case LD_INDIRECT_HL_R:
+                case LD_INDEXED_R:
+                case ADD_INDIRECT_HL:
+                case ADD_INDEXED:
+                case ADC_INDIRECT_HL:
+                case ADC_INDEXED:
+                case SUB_INDIRECT_HL:
+                case SUB_INDEXED:
+                case SBC_INDIRECT_HL:
+                case SBC_INDEXED:
+                case AND_INDIRECT_HL:
+                case AND_INDEXED:
+                case XOR_INDIRECT_HL:
+                case XOR_INDEXED:
+                case OR_INDIRECT_HL:
+                case OR_INDEXED:
+                case CP_INDIRECT_HL:
+                case CP_INDEXED: {
+
+                        *cycles = 7;
+                        indexable = 1;
+                        break;
+
+                }
+
+                case LD_A_INDIRECT_BC:
+                case LD_A_INDIRECT_DE:
+                case LD_INDIRECT_BC_A:
+                case LD_INDIRECT_DE_A: {
+
+                        *cycles = 7;
+                        break;
+
+                }
+
+                case NEG:
+                case IM_N:
+                case RLC_R:
+                case RL_R:
+                case RRC_R:
+                case RR_R:
+                case SLA_R:
+                case SLL_R:
+                case SRA_R:
+                case SRL_R:
+                case BIT_B_R:
+                case SET_B_R:
+                case RES_B_R: {
+
+                        *cycles = 8;
+                        break;
+
+                }
+
+#ifndef Z80_CATCH_ED_UNDEFINED
+
+                case ED_UNDEFINED: {
+
+                        *cycles = 8;
+                        break;
+
+                }
+
+#endif
+
+                case LD_A_I_LD_A_R:
+                case LD_I_A_LD_R_A: {
+
+                        *cycles = 9;
+                        break;
+
+                }
+
+                case LD_INDIRECT_HL_N:
+                case LD_INDEXED_N: {
+
+                        /* The indexed form fetches the constant during the
+                         * cycles that other indexed forms take to compute
+                         * the address, and takes 19 cycles instead of 22.
+                         */
+
+                        *cycles = prefixed ? 10 - 3 : 10;
+                        operands = 1;
+                        indexable = 1;
+                        break;
+
+                }
+
+                case LD_RR_NN: {
+
+                        *cycles = 10;
+                        operands = 2;
+                        break;
+
+                }
+
+                case POP_SS: {
+
+                        *cycles = 10;
+                        break;
+
+                }
+
+                case PUSH_SS:
+                case ADD_HL_RR: {
+
+                        *cycles = 11;
+                        break;
+
+                }
+
+                case INC_INDIRECT_HL:
+                case INC_INDEXED:
+                case DEC_INDIRECT_HL:
+                case DEC_INDEXED: {
+
+                        *cycles = 11;
+                        indexable = 1;
+                        break;
+
+                }
+
+                case BIT_B_INDIRECT_HL:
+                case BIT_B_INDEXED: {
+
+                        *cycles = 12;
+                        break;
+
+                }
+
+                case LD_A_INDIRECT_NN:
+                case LD_INDIRECT_NN_A: {
+
+                        *cycles = 13;
+                        operands = 2;
+                        break;
+
+                }
+
+                case ADC_HL_RR:
+                case SBC_HL_RR:
+                case RLC_INDIRECT_HL:
+                case RLC_INDEXED:
+                case RL_INDIRECT_HL:
+                case RL_INDEXED:
+                case RRC_INDIRECT_HL:
+                case RRC_INDEXED:
+                case RR_INDIRECT_HL:
+                case RR_INDEXED:
+                case SLA_INDIRECT_HL:
+                case SLA_INDEXED:
+                case SLL_INDIRECT_HL:
+                case SLL_INDEXED:
+                case SRA_INDIRECT_HL:
+                case SRA_INDEXED:
+                case SRL_INDIRECT_HL:
+                case SRL_INDEXED:
+                case SET_B_INDIRECT_HL:
+                case SET_B_INDEXED:
+                case RES_B_INDIRECT_HL:
+                case RES_B_INDEXED: {
+
+                        *cycles = 15;
+                        break;
+
+                }
+
+                case LD_HL_INDIRECT_NN:
+                case LD_INDIRECT_NN_HL: {
+
+                        *cycles = 16;
+                        operands = 2;
+                        break;
+
+                }
+
+                case LDI_LDD:
+                case CPI_CPD: {
+
+                        *cycles = 16;
+                        break;
+
+                }
+
+                case RLD_RRD: {
+
+                        *cycles = 18;
+                        break;
+
+                }
+
+                case EX_INDIRECT_SP_HL: {
+
+                        *cycles = 19;
+                        break;
+
+                }
+
+                case LD_RR_INDIRECT_NN:
+                case LD_INDIRECT_NN_RR: {
+
+                        *cycles = 20;
+                        operands = 2;
+                        break;
+
+                }
+
+                default:
+
+                        return BLOCK_EXCLUDED;
+
+        }
+
+        /* A 0xdd or 0xfd prefix adds 4 cycles, and turns (HL) operands into
+         * (IX + d) or (IY + d), which adds a displacement and 8 cycles. With
+         * 0xcb, the displacement and the opcode are both left to the handler
+         * to skip, and the indexed forms take 8 more cycles than (HL) ones.
+         */
+
+        if (prefixed) {
+
+                if ((decoded->prefix & 0xff) == 0xcb) {
+
+                        *cycles += 8;
+                        operands = 2;
+
+                } else {
+
+                        *cycles += 4;
+                        if (indexable) {
+
+                                operands++;
+                                *cycles += 8;
+
+                        }
+
+                }
+
+        }
+        *length = decoded->length + operands;
+        decoded->instruction = instruction;
+        decoded->opcode = opcode;
+
+        return status;
+}
+
+#endif
+
+#ifdef Z80_BLOCK_CACHE
+
+/* Block cache. A block is a straight-line run of instructions predecoded from
+ * memory that Z80_CODE_IS_CACHEABLE() reports as never changing. Each entry 
+ * keeps what the opcode and prefix fetches leave behind for the handler:
+ * handler, opcode, register table, number of bytes fetched, and their cycles
+ * and refresh count. Operands are still read by the handlers themselves.
+ */
+
+typedef struct Z80_BLOCK_ENTRY {
+
+#ifdef Z80_THREADED_DISPATCH
+
+        void            *handler;
+
+#else
+
+        int             instruction;
+
+#endif
+
+        unsigned short  registers;      /* Offset of the register table in
+                                         * Z80_STATE.
+                                         */
+        unsigned char   opcode, length, cycles, r;
+
+} Z80_BLOCK_ENTRY;
+
+/* cycles is the sum of the cycles of all instructions but the last, which is
+ * the only one that may take a variable number of cycles. Blocks are chained
+ * to the blocks that have followed them, and their start addresses, in 
+ * next[] and next_pc[]: the first pair is for the address right after the
+ * block, the second for the most recent other one. A NULL next block means
+ * that none can start there. If compiled is not NULL, it runs the whole block
+ * instead of its entries, see Z80SetCompiledBlocks(). With Z80_JIT, runs 
+ * counts the times the block is entered until it is translated.
+ */
+
+typedef struct Z80_BLOCK {
+
+        int                     cycles, count;
+        int                     end_pc, next_pc[2];
+        struct Z80_BLOCK        *next[2];
+        Z80_COMPILED_FUNCTION   compiled;
+
+#ifdef Z80_JIT
+
+        int                     runs;
+
+#endif
+
+        Z80_BLOCK_ENTRY         entries[];
+
+} Z80_BLOCK;
+
+/* Blocks are indexed by their start address, through tables allocated for
+ * each 256 bytes page the first time code on it is run.  Addresses where no
+ * block can start point to NO_BLOCK.
+ */
+
+struct Z80_CACHE {
+
+        Z80_BLOCK                       **pages[256];
+        const Z80_COMPILED_BLOCK        *compiled_blocks;
+        int                             compiled_count;
+
+#ifdef Z80_JIT
+
+        Z80_TRANSLATIONS                *jit;   /* Allocated by the first
+                                                 * translation.
+                                                 */
+
+#endif
+
+};
+
+static Z80_BLOCK        NO_BLOCK;
+
+/* Indexes of the tables used to decode an entry, see BLOCK_HANDLERS. */
+
+enum {
+
+        BLOCK_TABLE,
+        BLOCK_DD_TABLE,
+        BLOCK_FD_TABLE,
+        BLOCK_CB_TABLE,
+        BLOCK_INDEXED_CB_TABLE,
+        BLOCK_ED_TABLE
+
+};
+
+/* Decode the instructions of the block starting at pc, return their number,
+ * and set *cycles to the sum of the cycles of all but the last one and *end_pc
+ * to the address that follows the block.
+ */
+
+static int describe_block (Z80_BLOCK_INSTRUCTION *instructions,
+        int *cycles, int *end_pc,
+        int pc,
+        void *context)
+{
+        int     count, length, instruction_cycles, status;
+
+        count = *cycles = instruction_cycles = 0;
+        do {
+
+                /* Never run past 0xffff, where the decoded addresses would 
+                 * wrap around.
+                 */
+
+                if (pc > 0xffff - 4)
+
+                        break;
+
+                status = decode_instruction(&instructions[count], 
+                        &length, &instruction_cycles,
+                        pc, context);
+                if (status == BLOCK_EXCLUDED)
+
+                        break;
+
+                *cycles += instruction_cycles;
+                pc += length;
+                count++;
+
+        } while (status == BLOCK_CONTINUES 
+                && count < Z80_MAXIMUM_BLOCK_INSTRUCTIONS);
+
+        *cycles -= instruction_cycles;
+        *end_pc = pc;
+
+        return count;
+}
+
+/* Return the function that compiles the block starting at address and made
+ * of count instructions, or NULL if there is none.
+ */
+
+static Z80_COMPILED_FUNCTION find_compiled_block (Z80_CACHE *cache, 
+        int address, 
+        int count)
+{
+        int     low, high, middle;
+
+        low = 0;
+        high = cache->compiled_count - 1;
+        while (low <= high) {
+
+                middle = (low + high) / 2;
+                if (cache->compiled_blocks[middle].address < address)
+
+                        low = middle + 1;
+
+                else if (cache->compiled_blocks[middle].address > address)
+
+                        high = middle - 1;
+
+                else 
+
+                        return cache->compiled_blocks[middle].count == count
+                                ? cache->compiled_blocks[middle].function
+                                : NULL;
+
+        }
+
+        return NULL;
+}
+
+/* Decode the block starting at pc, or return &NO_BLOCK if its first 
+ * instruction cannot be cached. handlers is NULL in the switch version of 
+ * emulate().
+ */
+
+static Z80_BLOCK *decode_block (Z80_CACHE *cache,
+        int pc, 
+        void * const * const *handlers, 
+        void *context)
+{
+        Z80_BLOCK_INSTRUCTION   instructions[Z80_MAXIMUM_BLOCK_INSTRUCTIONS];
+        Z80_BLOCK               *block;
+        int                     count, cycles, end_pc, i;
+
+        count = describe_block(instructions, &cycles, &end_pc, pc, context);
+        if (count == 0)
+
+                return &NO_BLOCK;
+
+        block = malloc(offsetof(Z80_BLOCK, entries)
+                + count * sizeof(Z80_BLOCK_ENTRY));
+        if (block == NULL)
+
+                return &NO_BLOCK;
+
+        block->cycles = cycles;
+        block->count = count;
+        block->end_pc = end_pc;
+        block->next_pc[0] = block->next_pc[1] = -1;
+        block->next[0] = block->next[1] = NULL;
+        block->compiled = find_compiled_block(cache, pc, count);
+
+#ifdef Z80_JIT
+
+        block->runs = 0;
+
+#endif
+
+        for (i = 0; i < count; i++) {
+
+                Z80_BLOCK_ENTRY         *entry;
+                Z80_BLOCK_INSTRUCTION   *decoded;
+                int                     table;
+
+                entry = &block->entries[i];
+                decoded = &instructions[i];
+                entry->registers = offsetof(Z80_STATE, register_table);
+                switch (decoded->prefix) {
+
+                        case 0xdd: {
+
+                                table = BLOCK_DD_TABLE;
+                                entry->registers 
+                                        = offsetof(Z80_STATE, dd_register_table);
+                                break;
+
+                        }
+
+                        case 0xfd: {
+
+                                table = BLOCK_FD_TABLE;
+                                entry->registers 
+                                        = offsetof(Z80_STATE, fd_register_table);
+                                break;
+
+                        }
+
+                        case 0xddcb: {
+
+                                table = BLOCK_INDEXED_CB_TABLE;
+                                entry->registers 
+                                        = offsetof(Z80_STATE, dd_register_table);
+                                break;
+
+                        }
+
+                        case 0xfdcb: {
+
+                                table = BLOCK_INDEXED_CB_TABLE;
+                                entry->registers 
+                                        = offsetof(Z80_STATE, fd_register_table);
+                                break;
+
+                        }
+
+                        case 0xcb: {
+
+                                table = BLOCK_CB_TABLE;
+                                break;
+
+                        }
+
+                        case 0xed: {
+
+                                table = BLOCK_ED_TABLE;
+                                break;
+
+                        }
+
+                        default: {
+
+                                table = BLOCK_TABLE;
+                                break;
+
+                        }
+
+                }
+                entry->opcode = decoded->opcode;
+                entry->length = decoded->length;
+                entry->cycles = decoded->cycles;
+                entry->r = decoded->r;
+
+#ifdef Z80_THREADED_DISPATCH
+
+                entry->handler = handlers[table][decoded->opcode];
+
+#else
+
+                entry->instruction = decoded->instruction;
+                (void) table;
+
+#endif
+
+        }
+
+        return block;
+}
+
+/* Return the block starting at pc, decoding it if needed, or NULL if there is
+ * none.
+ */
+
+static Z80_BLOCK *find_block (Z80_CACHE *cache, 
+        int pc, 
+        void * const * const *handlers, 
+        void *context)
+{
+        Z80_BLOCK       **blocks, *block;
+
+        pc &= 0xffff;
+        blocks = cache->pages[pc >> 8];
+        if (blocks == NULL) {
+
+                if (!Z80_CODE_IS_CACHEABLE(pc))
+
+                        return NULL;
+
+                blocks = calloc(256, sizeof(Z80_BLOCK *));
+                if (blocks == NULL)
+
+                        return NULL;
+
+                cache->pages[pc >> 8] = blocks;
+
+        }
+        block = blocks[pc & 0xff];
+        if (block == NULL)
+
+                blocks[pc & 0xff] = block 
+                        = decode_block(cache, pc, handlers, context);
+
+        return block->count ? block : NULL;
+}
+
+/* Same as find_block(), but first try the blocks chained to last_block, if 
+ * not NULL, and chain the result to it.
+ */
+
+static Z80_BLOCK *next_block (Z80_CACHE *cache, 
+        Z80_BLOCK *last_block,
+        int pc, 
+        void * const * const *handlers, 
+        void *context)
+{
+        Z80_BLOCK       *block;
+        int             i;
+
+        if (last_block == NULL)
+
+                return find_block(cache, pc, handlers, context);
+
+        pc &= 0xffff;
+        if (last_block->next_pc[0] == pc)
+
+                return last_block->next[0];
+
+        if (last_block->next_pc[1] == pc)
+
+                return last_block->next[1];
+
+        block = find_block(cache, pc, handlers, context);
+        i = pc == last_block->end_pc ? 0 : 1;
+        last_block->next_pc[i] = pc;
+        last_block->next[i] = block;
+
+        return block;
+}
+
+Z80_CACHE *Z80CreateBlockCache (void)
+{
+        return calloc(1, sizeof(Z80_CACHE));
+}
+
+void Z80FlushBlockCache (Z80_CACHE *cache)
+{
+        int     i, j;
+
+        for (i = 0; i < 256; i++) {
+
+                if (cache->pages[i] == NULL)
+
+                        continue;
+
+                for (j = 0; j < 256; j++)
+
+                        if (cache->pages[i][j] != &NO_BLOCK)
+
+                                free(cache->pages[i][j]);
+
+                free(cache->pages[i]);
+                cache->pages[i] = NULL;
+
+        }
+
+#ifdef Z80_JIT
+
+        Z80JitFlush(cache->jit);
+
+#endif
+
+}
+
+void Z80DestroyBlockCache (Z80_CACHE *cache)
+{
+        if (cache != NULL) {
+
+                Z80FlushBlockCache(cache);
+
+#ifdef Z80_JIT
+
+                Z80JitDestroy(cache->jit);
+
+#endif
+
+                free(cache);
+
+        }
+}
+
+int Z80DescribeBlock (int address, 
+        Z80_BLOCK_INSTRUCTION *instructions, 
+        void *context)
+{
+        int     cycles, end_pc;
+
+        return describe_block(instructions, &cycles, &end_pc, 
+                address, context);
+}
+
+void Z80SetCompiledBlocks (Z80_CACHE *cache, 
+        const Z80_COMPILED_BLOCK *blocks, 
+        int count)
+{
+        Z80FlushBlockCache(cache);
+        cache->compiled_blocks = blocks;
+        cache->compiled_count = count;
+}
+
+#else
+
+Z80_CACHE *Z80CreateBlockCache (void)
+{
+        return NULL;
+}
+
+void Z80FlushBlockCache (Z80_CACHE *cache)
+{
+}
+
+void Z80DestroyBlockCache (Z80_CACHE *cache)
+{
+}
+
+int Z80DescribeBlock (int address, 
+        Z80_BLOCK_INSTRUCTION *instructions, 
+        void *context)
+{
+        return 0;
+}
+
+void Z80SetCompiledBlocks (Z80_CACHE *cache, 
+        const Z80_COMPILED_BLOCK *blocks, 
+        int count)
+{
+}
+
+#endif
+
+#ifdef Z80_IDLE_LOOPS
+
+/* An idle loop is a short loop ending with a JR or JP instruction back to its
+ * start, and whose other instructions only read memory, the input ports that
+ * Z80_IDLE_INPUT() accepts, and registers, none of them transferring control.
+ * emulate() tracks the last loop that was branched back to. Once the registers
+ * are found unchanged over two iterations in a row, every further iteration is
+ * the same until an interrupt or another device changes what the loop reads,
+ * which can only happen once the emulation has stopped. The iterations that 
+ * run before the cycle check would stop it are skipped, keeping 
+ * elapsed_cycles and R as if they had been emulated.
+ */
+
+#define IDLE_LOOP_MAXIMUM_LENGTH        32
+
+typedef struct Z80_IDLE_LOOP {
+
+        int             start, end, idle, iterations;
+        int             elapsed_cycles, r;
+        int             cycles, r_increment;        /* Per iteration. */
+        unsigned short  registers[7];
+
+} Z80_IDLE_LOOP;
+
+/* Return non-zero if the code from start to end is an idle loop. */
+
+static int is_idle_loop (int start, int end, void *context)
+{
+        Z80_BLOCK_INSTRUCTION   decoded;
+        int                     pc, length, cycles, port;
+
+        if (start < 0 || end > 0x10000
+                || end - start > IDLE_LOOP_MAXIMUM_LENGTH 
+                || !Z80_IDLE_LOOP_ALLOWED(start))
+
+                return 0;
+
+        for (pc = start; pc < end; pc += length) {
+
+                if (decode_instruction(&decoded, &length, &cycles, 
+                        pc, context) == BLOCK_EXCLUDED)
+
+                        return 0;
+
+                switch (decoded.instruction) {
+
+                        case LD_R_R:
+                        case LD_R_N:
+                        case LD_R_INDIRECT_HL:
+                        case LD_R_INDEXED:
+                        case LD_A_INDIRECT_BC:
+                        case LD_A_INDIRECT_DE:
+                        case LD_A_INDIRECT_NN:
+                        case LD_RR_NN:
+                        case LD_HL_INDIRECT_NN:
+                        case LD_RR_INDIRECT_NN:
+                        case EX_DE_HL:
+                        case ADD_R:
+                        case ADD_N:
+                        case ADD_INDIRECT_HL:
+                        case ADD_INDEXED:
+                        case ADC_R:
+                        case ADC_N:
+                        case ADC_INDIRECT_HL:
+                        case ADC_INDEXED:
+                        case SUB_R:
+                        case SUB_N:
+                        case SUB_INDIRECT_HL:
+                        case SUB_INDEXED:
+                        case SBC_R:
+                        case SBC_N:
+                        case SBC_INDIRECT_HL:
+                        case SBC_INDEXED:
+                        case AND_R:
+                        case AND_N:
+                        case AND_INDIRECT_HL:
+                        case AND_INDEXED:
+                        case XOR_R:
+                        case XOR_N:
+                        case XOR_INDIRECT_HL:
+                        case XOR_INDEXED:
+                        case OR_R:
+                        case OR_N:
+                        case OR_INDIRECT_HL:
+                        case OR_INDEXED:
+                        case CP_R:
+                        case CP_N:
+                        case CP_INDIRECT_HL:
+                        case CP_INDEXED:
+                        case INC_R:
+                        case DEC_R:
+                        case ADD_HL_RR:
+                        case ADC_HL_RR:
+                        case SBC_HL_RR:
+                        case INC_RR:
+                        case DEC_RR:
+                        case DAA:
+                        case CPL:
+                        case NEG:
+                        case CCF:
+                        case SCF:
+                        case NOP:
+                        case RLCA:
+                        case RLA:
+                        case RRCA:
+                        case RRA:
+                        case RLC_R:
+                        case RL_R:
+                        case RRC_R:
+                        case RR_R:
+                        case SLA_R:
+                        case SLL_R:
+                        case SRA_R:
+                        case SRL_R:
+                        case BIT_B_R:
+                        case BIT_B_INDIRECT_HL:
+                        case BIT_B_INDEXED:
+                        case SET_B_R:
+                        case RES_B_R: {
+
+                                if (pc + length >= end)
+
+                                        return 0;
+
+                                break;
+
+                        }
+
+                        case IN_A_N: {
+
+                                Z80_FETCH_BYTE(pc + decoded.length, port);
+                                if (!Z80_IDLE_INPUT(port) 
+                                        || pc + length >= end)
+
+                                        return 0;
+
+                                break;
+
+                        }
+
+                        case JP_NN:
+                        case JP_CC_NN:
+                        case JR_E:
+                        case JR_DD_E: {
+
+                                if (pc + length != end)
+
+                                        return 0;
+
+                                break;
+
+                        }
+
+                        default:
+
+                                return 0;
+
+                }
+
+        }
+
+        return 1;
+}
+
+/* Called when a JR or JP instruction ending at end has branched back to start,
+ * return the number of iterations of the loop to skip. 
+ */
+
+static int skip_idle_loop (Z80_IDLE_LOOP *loop, 
+        Z80_STATE *state, 
+        int start, int end,
+        int elapsed_cycles, int number_cycles, int r,
+        void *context)
+{
+        int     iterations;
+
+        if (start != loop->start || end != loop->end) {
+
+                loop->start = start;
+                loop->end = end;
+                loop->idle = is_idle_loop(start, end, context);
+                loop->iterations = 0;
+
+        } else if (loop->iterations > 0
+                && memcmp(loop->registers, &state->registers, 
+                        sizeof(loop->registers))) 
+
+                loop->iterations = 0;
+
+        if (!loop->idle)
+
+                return 0;
+
+        loop->cycles = elapsed_cycles - loop->elapsed_cycles;
+        loop->r_increment = r - loop->r;
+        loop->elapsed_cycles = elapsed_cycles;
+        loop->r = r;
+
+        /* The first iteration may have read a VDP status that was cleared by
+         * that read, the registers must be unchanged after the second one.
+         */
+
+        if (++loop->iterations < 3) {
+
+                memcpy(loop->registers, &state->registers, 
+                        sizeof(loop->registers));
+
+                return 0;
+
+        }
+
+        /* The checks after the current instruction and inside the skipped
+         * iterations must not stop the emulation, the one after the last
+         * skipped iteration is done by the caller.
+         */
+
+        iterations = (number_cycles - elapsed_cycles) / loop->cycles;
+        if (iterations < 0)
+
+                iterations = 0;
+
+        if (iterations > 0)
+
+                Z80_IDLE_LOOP_SKIPPED(start, iterations * loop->cycles);
+
+        loop->elapsed_cycles += iterations * loop->cycles;
+        loop->r += iterations * loop->r_increment;
+
+        return iterations;
+}
+
+#endif
+
+#ifdef Z80_JIT
+
+#ifdef Z80_IDLE_LOOPS
+
+/* Return non-zero if the block ending with instruction at end may be part of
+ * an idle loop: if it branches back to one, or polls a port that one may 
+ * read. Its translation would not skip the loop's iterations.
+ */
+
+static int may_be_idle (const Z80_BLOCK_INSTRUCTION *instruction, 
+        int end, 
+        void *context)
+{
+        int     operand, target, x;
+
+        operand = instruction->address + instruction->length;
+        switch (instruction->instruction) {
+
+                case JP_NN:
+                case JP_CC_NN: {
+
+                        Z80_FETCH_WORD(operand, target);
+                        break;
+
+                }
+
+                case JR_E:
+                case JR_DD_E: {
+
+                        Z80_FETCH_BYTE(operand, x);
+                        target = end + (signed char) x;
+                        break;
+
+                }
+
+                case IN_A_N: {
+
+                        Z80_FETCH_BYTE(operand, x);
+
+                        return Z80_IDLE_INPUT(x);
+
+                }
+
+                default:
+
+                        return 0;
+
+        }
+
+        return target < end && is_idle_loop(target, end, context);
+}
+
+#endif
+
+/* Translate the block starting at pc, or return NULL to keep interpreting
+ * it.
+ */
+
+static Z80_COMPILED_FUNCTION translate_block (Z80_STATE *state, 
+        int pc, 
+        void *context)
+{
+        Z80_BLOCK_INSTRUCTION   instructions[Z80_MAXIMUM_BLOCK_INSTRUCTIONS];
+        Z80_CACHE               *cache;
+        int                     count, cycles, end_pc;
+
+        count = describe_block(instructions, &cycles, &end_pc, 
+                pc & 0xffff, context);
+        if (count == 0)
+
+                return NULL;
+
+#ifdef Z80_IDLE_LOOPS
+
+        if (may_be_idle(&instructions[count - 1], end_pc, context))
+
+                return NULL;
+
+#endif
+
+        cache = state->block_cache;
+        if (cache->jit == NULL)
+
+                cache->jit = Z80JitCreate();
+
+        if (cache->jit == NULL)
+
+                return NULL;
+
+        return Z80JitTranslate(cache->jit, state, instructions, count, 
+                context);
+}
+
+#endif
+
+#ifdef Z80_LAZY_FLAGS
+
+/* Operation whose flags are pending, see Z80_LAZY_FLAGS in z80config.h. first
+ * and second are the operands, except for INC and DEC where first is the 
+ * operand and second the carry flag they leave unchanged. result isn't 
+ * truncated to 8 bits.
+ */
+
+enum {
+
+        LAZY_NONE,
+        LAZY_ADD,
+        LAZY_SUB,
+        LAZY_CP,
+        LAZY_INC,
+        LAZY_DEC
+
+};
+
+typedef struct LAZY_FLAGS {
+
+        int     kind, first, second, result;
+
+} LAZY_FLAGS;
+
+/* Return the flags of the pending operation, the same as the macros of 
+ * macros.h would compute without Z80_LAZY_FLAGS.
+ */
+
+static int lazy_flags (LAZY_FLAGS lazy)
+{
+        int     z, c, f;
+
+        z = lazy.result;
+        switch (lazy.kind) {
+
+                case LAZY_ADD: {
+
+                        c = lazy.first ^ lazy.second ^ z;
+                        f = c & Z80_H_FLAG;
+                        f |= SZYX_FLAGS_TABLE[z & 0xff];
+                        f |= OVERFLOW_TABLE[c >> 7];
+                        f |= z >> (8 - Z80_C_FLAG_SHIFT);
+                        return f;
+
+                }
+
+                case LAZY_SUB: 
+                case LAZY_CP: {
+
+                        c = lazy.first ^ lazy.second ^ z;
+                        f = Z80_N_FLAG | (c & Z80_H_FLAG);
+                        if (lazy.kind == LAZY_SUB)
+
+                                f |= SZYX_FLAGS_TABLE[z & 0xff];
+
+                        else {
+
+                                f |= SZYX_FLAGS_TABLE[z & 0xff] & SZ_FLAGS;
+                                f |= lazy.second & YX_FLAGS;
+
+                        }
+                        c &= 0x0180;
+                        f |= OVERFLOW_TABLE[c >> 7];
+                        f |= c >> (8 - Z80_C_FLAG_SHIFT);
+                        return f;
+
+                }
+
+                default: {
+
+                        c = lazy.first ^ z;
+                        f = lazy.kind == LAZY_DEC ? Z80_N_FLAG : 0;
+                        f |= lazy.second;
+                        f |= c & Z80_H_FLAG;
+                        f |= SZYX_FLAGS_TABLE[z & 0xff];
+                        f |= OVERFLOW_TABLE[(c >> 7) & 0x03];
+                        return f;
+
+                }
+
+        }
+}
+
+/* Store the flags of the pending operation into F and return F's address. A 
+ * function call, so that an expression can use F twice.
+ */
+
+static unsigned char *flush_flags (Z80_STATE *state, LAZY_FLAGS *lazy)
+{
+        F_REGISTER = lazy_flags(*lazy);
+        lazy->kind = LAZY_NONE;
+
+        return &F_REGISTER;
+}
+
+/* Return CC() for the pending operation, Z and C are tested without 
+ * computing the other flags.
+ */
+
+static int lazy_condition (LAZY_FLAGS lazy, int cc)
+{
+        int     carry;
+
+        switch (cc) {
+
+                case 0:
+                case 1:
+
+                        return ((lazy.result & 0xff) == 0) == cc;
+
+                case 2:
+                case 3: {
+
+                        carry = lazy.kind < LAZY_INC
+                                ? (lazy.result >> 8) & 0x01
+                                : lazy.second;
+                        return carry == cc - 2;
+
+                }
+
+                default: 
+
+                        return (lazy_flags(lazy) ^ XOR_CONDITION_TABLE[cc])
+                                & AND_CONDITION_TABLE[cc];
+
+        }
+}
+
+#endif
+
+/* Actual emulation function. opcode is the first opcode to emulate, this is 
+ * needed by Z80Interrupt() for interrupt mode 0.
+ */
+
+static int emulate (Z80_STATE * state, 
+	int opcode, 
+	int elapsed_cycles, int number_cycles, 
+	void *context)
+{
+        int	pc, r;
+        void    **registers; 
+
+#ifdef Z80_BLOCK_CACHE
+
+        const Z80_BLOCK_ENTRY   *entry, *block_end;
+        Z80_BLOCK               *last_block;
+
+        entry = block_end = NULL;
+        last_block = NULL;
+
+#endif
+
+#ifdef Z80_IDLE_LOOPS
+
+        Z80_IDLE_LOOP           idle_loop;
+
+        idle_loop.start = -1;
+
+#endif
+
+#ifdef Z80_LAZY_FLAGS
+
+        LAZY_FLAGS              lazy;
+
+        lazy.kind = LAZY_NONE;
+
+#endif
+
+#ifdef Z80_THREADED_DISPATCH
+
+#include "dispatch.h"
+
+#ifdef Z80_BLOCK_CACHE
+
+        static void * const * const     BLOCK_HANDLERS[] = {
 
-        state->status = 0;
-	elapsed_cycles = 0;
-	pc = state->pc;
-        Z80_FETCH_BYTE(pc, opcode);
-        state->pc = pc + 1;
+                DISPATCH_TABLE,
+                DD_DISPATCH_TABLE,
+                FD_DISPATCH_TABLE,
+                CB_DISPATCH_TABLE,
+                INDEXED_CB_DISPATCH_TABLE,
+                ED_DISPATCH_TABLE
 
-        return emulate(state, opcode, elapsed_cycles, number_cycles, context);
-}
+        };
 
-/* Actual emulation function. opcode is the first opcode to emulate, this is 
- * needed by Z80Interrupt() for interrupt mode 0.
- */
+#endif
 
-static int emulate (Z80_STATE * state, 
-	int opcode, 
-	int elapsed_cycles, int number_cycles, 
-	void *context)
-{
-        int	pc, r;
+        pc = state->pc;
+        r = state->r & 0x7f;
+        registers = state->register_table;
+        DISPATCH(INSTRUCTION_TABLE, DISPATCH_TABLE);
+
+        /* These match the braces of the for and switch statements of the
+         * reference core, which are not needed here.
+         */
+
+        {
+                {
+
+#else
+
+        int     instruction;
 
         pc = state->pc;
         r = state->r & 0x7f;
@@ -263,159 +1945,161 @@ static int emulate (Z80_STATE * state,
 
         for ( ; ; ) {   
 
-                void    **registers; 
-                int     instruction;
-
                 Z80_FETCH_BYTE(pc, opcode);
                 pc++;
 
 start_emulation:                
 
                 registers = state->register_table;
-
-emulate_next_opcode:
-
                 instruction = INSTRUCTION_TABLE[opcode];
 
 emulate_next_instruction:
 
                 elapsed_cycles += 4;
                 r++;
+
+#ifdef Z80_BLOCK_CACHE
+
+emulate_block_entry:
+
+#endif
+
                 switch (instruction) {
 
+#endif
+
                         /* 8-bit load group. */
 
-                        case LD_R_R: {
+                        INSTRUCTION(LD_R_R): {
 
                                 R(Y(opcode)) = R(Z(opcode));
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case LD_R_N: {
+                        INSTRUCTION(LD_R_N): {
 
                                 READ_N(R(Y(opcode)));
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case LD_R_INDIRECT_HL: {
+                        INSTRUCTION(LD_R_INDIRECT_HL): {
 
-                                if (registers == state->register_table) {
+                                READ_BYTE(HL, R(Y(opcode)));
+                                END_INSTRUCTION;
 
-                                        READ_BYTE(HL, R(Y(opcode)));
+                        }
 
-                                } else {
+                        INSTRUCTION(LD_R_INDEXED): {
 
-                                        int     d;
+                                int     d;
 
-                                        READ_D(d);
-                                        d += HL_IX_IY;
-                                        READ_BYTE(d, S(Y(opcode)));
+                                READ_D(d);
+                                d += HL_IX_IY;
+                                READ_BYTE(d, S(Y(opcode)));
 
-                                        elapsed_cycles += 5;
+                                elapsed_cycles += 5;
 
-                                }
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case LD_INDIRECT_HL_R: {
+                        INSTRUCTION(LD_INDIRECT_HL_R): {
 
-                                if (registers == state->register_table) {
+                                WRITE_BYTE(HL, R(Z(opcode)));
+                                END_INSTRUCTION;
 
-                                        WRITE_BYTE(HL, R(Z(opcode)));
+                        }
 
-                                } else {
+                        INSTRUCTION(LD_INDEXED_R): {
 
-                                        int     d;
+                                int     d;
 
-                                        READ_D(d);
-                                        d += HL_IX_IY;
-                                        WRITE_BYTE(d, S(Z(opcode)));
+                                READ_D(d);
+                                d += HL_IX_IY;
+                                WRITE_BYTE(d, S(Z(opcode)));
 
-                                        elapsed_cycles += 5;
+                                elapsed_cycles += 5;
 
-                                }
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case LD_INDIRECT_HL_N: {
+                        INSTRUCTION(LD_INDIRECT_HL_N): {
 
                                 int     n;
 
-                                if (registers == state->register_table) {
-
-                                        READ_N(n);
-                                        WRITE_BYTE(HL, n);
+                                READ_N(n);
+                                WRITE_BYTE(HL, n);
+                                END_INSTRUCTION;
 
-                                } else {
+                        }
 
-                                        int     d;
+                        INSTRUCTION(LD_INDEXED_N): {
 
-                                        READ_D(d);
-                                        d += HL_IX_IY;
-                                        READ_N(n);
-                                        WRITE_BYTE(d, n);
+                                int     d, n;
 
-                                        elapsed_cycles += 2;
+                                READ_D(d);
+                                d += HL_IX_IY;
+                                READ_N(n);
+                                WRITE_BYTE(d, n);
 
-                                }
+                                elapsed_cycles += 2;
 
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case LD_A_INDIRECT_BC: {
+                        INSTRUCTION(LD_A_INDIRECT_BC): {
 
                                 READ_BYTE(BC, A);
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case LD_A_INDIRECT_DE: {
+                        INSTRUCTION(LD_A_INDIRECT_DE): {
 
                                 READ_BYTE(DE, A);
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case LD_A_INDIRECT_NN: {
+                        INSTRUCTION(LD_A_INDIRECT_NN): {
 
                                 int     nn;
 
                                 READ_NN(nn);
                                 READ_BYTE(nn, A);
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case LD_INDIRECT_BC_A: {
+                        INSTRUCTION(LD_INDIRECT_BC_A): {
 
                                 WRITE_BYTE(BC, A);
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case LD_INDIRECT_DE_A: {
+                        INSTRUCTION(LD_INDIRECT_DE_A): {
 
                                 WRITE_BYTE(DE, A);
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case LD_INDIRECT_NN_A: {
+                        INSTRUCTION(LD_INDIRECT_NN_A): {
 
                                 int     nn;
 
                                 READ_NN(nn);
                                 WRITE_BYTE(nn, A);
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case LD_A_I_LD_A_R: {
+                        INSTRUCTION(LD_A_I_LD_A_R): {
 
                                 int     a, f;
 
@@ -437,11 +2121,11 @@ emulate_next_instruction:
 
                                 elapsed_cycles++;
 
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case LD_I_A_LD_R_A: {
+                        INSTRUCTION(LD_I_A_LD_R_A): {
 
                                 if (opcode == OPCODE_LD_I_A)
 
@@ -449,6 +2133,7 @@ emulate_next_instruction:
 
                                 else {
 
+                                        state->opcode_fetches += r - (state->r & 0x7f);
                                         state->r = A;
                                         r = A & 0x7f;
 
@@ -456,108 +2141,117 @@ emulate_next_instruction:
 
                                 elapsed_cycles++;
 
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
                         /* 16-bit load group. */
 
-                        case LD_RR_NN: {
+                        INSTRUCTION(LD_RR_NN): {
 
                                 READ_NN(RR(P(opcode)));
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case LD_HL_INDIRECT_NN: {
+                        INSTRUCTION(LD_HL_INDIRECT_NN): {
 
                                 int     nn;
 
                                 READ_NN(nn);
                                 READ_WORD(nn, HL_IX_IY);
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case LD_RR_INDIRECT_NN: {
+                        INSTRUCTION(LD_RR_INDIRECT_NN): {
 
                                 int     nn;
 
                                 READ_NN(nn);
                                 READ_WORD(nn, RR(P(opcode)));
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case LD_INDIRECT_NN_HL: {
+                        INSTRUCTION(LD_INDIRECT_NN_HL): {
 
                                 int     nn;
 
                                 READ_NN(nn);
                                 WRITE_WORD(nn, HL_IX_IY);
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case LD_INDIRECT_NN_RR: {
+                        INSTRUCTION(LD_INDIRECT_NN_RR): {
 
                                 int     nn;
 
                                 READ_NN(nn);
                                 WRITE_WORD(nn, RR(P(opcode)));
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case LD_SP_HL: {
+                        INSTRUCTION(LD_SP_HL): {
 
                                 SP = HL_IX_IY;
                                 elapsed_cycles += 2;
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case PUSH_SS: {
+                        INSTRUCTION(PUSH_SS): {
+
+                                if (P(opcode) == 3)
+
+                                        FLUSH_FLAGS;
 
                                 PUSH(SS(P(opcode)));
                                 elapsed_cycles++;
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case POP_SS: {
+                        INSTRUCTION(POP_SS): {
+
+                                if (P(opcode) == 3)
+
+                                        DISCARD_FLAGS;
 
                                 POP(SS(P(opcode)));
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
                         /* Exchange, block transfer and search group. */
 
-                        case EX_DE_HL: {
+                        INSTRUCTION(EX_DE_HL): {
 
                                 EXCHANGE(DE, HL);
-                                break;                          
+                                END_INSTRUCTION;
 
                         }
 
-                        case EX_AF_AF_PRIME: {
+                        INSTRUCTION(EX_AF_AF_PRIME): {
 
+                                FLUSH_FLAGS;
                                 EXCHANGE(AF, state->alternates[Z80_AF]);
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case EXX: {
+                        INSTRUCTION(EXX): {
 
                                 EXCHANGE(BC, state->alternates[Z80_BC]);
                                 EXCHANGE(DE, state->alternates[Z80_DE]);
                                 EXCHANGE(HL, state->alternates[Z80_HL]);
-                                break;
+                                END_INSTRUCTION;
 
                         }                                               
 
-                        case EX_INDIRECT_SP_HL: {
+                        INSTRUCTION(EX_INDIRECT_SP_HL): {
 
                                 int     t;
 
@@ -567,10 +2261,10 @@ emulate_next_instruction:
 
                                 elapsed_cycles += 3;
 
-                                break;                                               
+                                END_INSTRUCTION;
                         }
 
-                        case LDI_LDD: {
+                        INSTRUCTION(LDI_LDD): {
 
                                 int     n, f, d;
 
@@ -597,11 +2291,11 @@ emulate_next_instruction:
 
                                 elapsed_cycles += 2;
 
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case LDIR_LDDR: {
+                        INSTRUCTION(LDIR_LDDR): {
 
                                 int     d, f, bc, de, hl, n;
                                 
@@ -623,6 +2317,40 @@ emulate_next_instruction:
 
                                 r -= 2;
                                 elapsed_cycles -= 8;
+
+#ifdef Z80_BLOCK_TRANSFERS
+
+                                {
+                                        int     count, done;
+
+                                        /* BC = 0 repeats 65536 times. A bank
+                                         * switch may stop the emulation
+                                         * before count iterations.
+                                         */
+
+                                        bc = ((bc - 1) & 0xffff) + 1;
+                                        REPEAT_ITERATIONS(bc, count);
+                                        Z80_COPY_BLOCK(de, hl, count, d, done,
+                                                n);
+
+                                        r += 2 * done;
+                                        hl += d * done;
+                                        de += d * done;
+                                        bc -= done;
+                                        elapsed_cycles += 21 * done;
+                                        if (bc) {
+
+                                                f |= Z80_P_FLAG;
+                                                pc -= 2;
+
+                                        } else
+
+                                                elapsed_cycles -= 5;
+
+                                }
+
+#else
+
                                 for ( ; ; ) {
 
                                         r += 2;
@@ -671,6 +2399,8 @@ emulate_next_instruction:
 
                                 } 
 
+#endif
+
                                 HL = hl;
                                 DE = de;
                                 BC = bc;
@@ -686,11 +2416,11 @@ emulate_next_instruction:
 
                                 F = f;
 
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case CPI_CPD: {
+                        INSTRUCTION(CPI_CPD): {
 
                                 int     a, n, z, f;
 
@@ -717,11 +2447,11 @@ emulate_next_instruction:
 
                                 elapsed_cycles += 5;
 
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case CPIR_CPDR: {
+                        INSTRUCTION(CPIR_CPDR): {
                                         
                                 int     d, a, bc, hl, n, z, f;
 
@@ -783,303 +2513,385 @@ emulate_next_instruction:
                                 f |= bc ? Z80_P_FLAG : 0;
                                 F = f | Z80_N_FLAG | (F & Z80_C_FLAG);
 
-                                break;
+                                END_INSTRUCTION;
 
                         }                               
 
                         /* 8-bit arithmetic and logical group. */
 
-                        case ADD_R: {
+                        INSTRUCTION(ADD_R): {
 
                                 ADD(R(Z(opcode)));
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case ADD_N: {
+                        INSTRUCTION(ADD_N): {
 
                                 int     n;
 
                                 READ_N(n);
                                 ADD(n);
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case ADD_INDIRECT_HL: {
+                        INSTRUCTION(ADD_INDIRECT_HL): {
 
                                 int     x;
 
                                 READ_INDIRECT_HL(x);
                                 ADD(x);
-                                break;
+                                END_INSTRUCTION;
+
+                        }
+
+                        INSTRUCTION(ADD_INDEXED): {
+
+                                int     x;
+
+                                READ_INDEXED(x);
+                                ADD(x);
+                                END_INSTRUCTION;
 
                         }
 
-                        case ADC_R: {
+                        INSTRUCTION(ADC_R): {
 
                                 ADC(R(Z(opcode)));
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case ADC_N: {
+                        INSTRUCTION(ADC_N): {
 
                                 int     n;
 
                                 READ_N(n);
                                 ADC(n);
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case ADC_INDIRECT_HL: {
+                        INSTRUCTION(ADC_INDIRECT_HL): {
 
                                 int     x;
 
                                 READ_INDIRECT_HL(x);
                                 ADC(x);
-                                break;
+                                END_INSTRUCTION;
+
+                        }
+
+                        INSTRUCTION(ADC_INDEXED): {
+
+                                int     x;
+
+                                READ_INDEXED(x);
+                                ADC(x);
+                                END_INSTRUCTION;
 
                         }
 
-                        case SUB_R: {
+                        INSTRUCTION(SUB_R): {
 
                                 SUB(R(Z(opcode)));
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case SUB_N: {
+                        INSTRUCTION(SUB_N): {
 
                                 int     n;
 
                                 READ_N(n);
                                 SUB(n);
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case SUB_INDIRECT_HL: {
+                        INSTRUCTION(SUB_INDIRECT_HL): {
 
                                 int     x;
 
                                 READ_INDIRECT_HL(x);
                                 SUB(x);
-                                break;
+                                END_INSTRUCTION;
+
+                        }
+
+                        INSTRUCTION(SUB_INDEXED): {
+
+                                int     x;
+
+                                READ_INDEXED(x);
+                                SUB(x);
+                                END_INSTRUCTION;
 
                         }
 
-                        case SBC_R: {
+                        INSTRUCTION(SBC_R): {
 
                                 SBC(R(Z(opcode)));
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case SBC_N: {
+                        INSTRUCTION(SBC_N): {
 
                                 int     n;
 
                                 READ_N(n);
                                 SBC(n);
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case SBC_INDIRECT_HL: {
+                        INSTRUCTION(SBC_INDIRECT_HL): {
 
                                 int     x;
 
                                 READ_INDIRECT_HL(x);
                                 SBC(x);
-                                break;
+                                END_INSTRUCTION;
+
+                        }
+
+                        INSTRUCTION(SBC_INDEXED): {
+
+                                int     x;
+
+                                READ_INDEXED(x);
+                                SBC(x);
+                                END_INSTRUCTION;
 
                         }
 
-                        case AND_R: {
+                        INSTRUCTION(AND_R): {
 
                                 AND(R(Z(opcode)));
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case AND_N: {
+                        INSTRUCTION(AND_N): {
 
                                 int     n;
 
                                 READ_N(n);
                                 AND(n);
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case AND_INDIRECT_HL: {
+                        INSTRUCTION(AND_INDIRECT_HL): {
 
                                 int     x;
 
                                 READ_INDIRECT_HL(x);
                                 AND(x);
-                                break;
+                                END_INSTRUCTION;
+
+                        }
+
+                        INSTRUCTION(AND_INDEXED): {
+
+                                int     x;
+
+                                READ_INDEXED(x);
+                                AND(x);
+                                END_INSTRUCTION;
 
                         }
 
-                        case OR_R: {
+                        INSTRUCTION(OR_R): {
 
                                 OR(R(Z(opcode)));
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case OR_N: {
+                        INSTRUCTION(OR_N): {
 
                                 int     n;
 
                                 READ_N(n);
                                 OR(n);
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case OR_INDIRECT_HL: {
+                        INSTRUCTION(OR_INDIRECT_HL): {
 
                                 int     x;
 
                                 READ_INDIRECT_HL(x);
                                 OR(x);
-                                break;
+                                END_INSTRUCTION;
+
+                        }
+
+                        INSTRUCTION(OR_INDEXED): {
+
+                                int     x;
+
+                                READ_INDEXED(x);
+                                OR(x);
+                                END_INSTRUCTION;
 
                         }
 
-                        case XOR_R: {
+                        INSTRUCTION(XOR_R): {
 
                                 XOR(R(Z(opcode)));
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case XOR_N: {
+                        INSTRUCTION(XOR_N): {
 
                                 int     n;
 
                                 READ_N(n);
                                 XOR(n);
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case XOR_INDIRECT_HL: {
+                        INSTRUCTION(XOR_INDIRECT_HL): {
 
                                 int     x;
 
                                 READ_INDIRECT_HL(x);
                                 XOR(x);
-                                break;
+                                END_INSTRUCTION;
+
+                        }
+
+                        INSTRUCTION(XOR_INDEXED): {
+
+                                int     x;
+
+                                READ_INDEXED(x);
+                                XOR(x);
+                                END_INSTRUCTION;
 
                         }
 
-                        case CP_R: {
+                        INSTRUCTION(CP_R): {
 
                                 CP(R(Z(opcode)));
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case CP_N: {
+                        INSTRUCTION(CP_N): {
 
                                 int     n;
 
                                 READ_N(n);
                                 CP(n);
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case CP_INDIRECT_HL: {
+                        INSTRUCTION(CP_INDIRECT_HL): {
 
                                 int     x;
 
                                 READ_INDIRECT_HL(x);
                                 CP(x);
-                                break;
+                                END_INSTRUCTION;
+
+                        }
+
+                        INSTRUCTION(CP_INDEXED): {
+
+                                int     x;
+
+                                READ_INDEXED(x);
+                                CP(x);
+                                END_INSTRUCTION;
 
                         }
 
-                        case INC_R: {
+                        INSTRUCTION(INC_R): {
 
                                 INC(R(Y(opcode)));
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case INC_INDIRECT_HL: {
+                        INSTRUCTION(INC_INDIRECT_HL): {
 
                                 int     x;
 
-                                if (registers == state->register_table) {
+                                READ_BYTE(HL, x);
+                                INC(x);
+                                WRITE_BYTE(HL, x);
 
-                                        READ_BYTE(HL, x);
-                                        INC(x);
-                                        WRITE_BYTE(HL, x);
+                                elapsed_cycles++;
 
-                                        elapsed_cycles++;
+                                END_INSTRUCTION;
 
-                                } else {
+                        }
 
-                                        int     d;
+                        INSTRUCTION(INC_INDEXED): {
 
-                                        READ_D(d);
-                                        d += HL_IX_IY;
-                                        READ_BYTE(d, x);
-                                        INC(x);
-                                        WRITE_BYTE(d, x);
+                                int     d, x;
 
-                                        elapsed_cycles += 6;
+                                READ_D(d);
+                                d += HL_IX_IY;
+                                READ_BYTE(d, x);
+                                INC(x);
+                                WRITE_BYTE(d, x);
 
-                                }
-                                break;
+                                elapsed_cycles += 6;
+
+                                END_INSTRUCTION;
 
                         }
 
-                        case DEC_R: {
+                        INSTRUCTION(DEC_R): {
 
                                 DEC(R(Y(opcode)));
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case DEC_INDIRECT_HL: {
+                        INSTRUCTION(DEC_INDIRECT_HL): {
 
                                 int     x;
 
-                                if (registers == state->register_table) {
+                                READ_BYTE(HL, x);
+                                DEC(x);
+                                WRITE_BYTE(HL, x);
 
-                                        READ_BYTE(HL, x);
-                                        DEC(x);
-                                        WRITE_BYTE(HL, x);
+                                elapsed_cycles++;
 
-                                        elapsed_cycles++;
+                                END_INSTRUCTION;
 
-                                } else {
+                        }
 
-                                        int     d;
+                        INSTRUCTION(DEC_INDEXED): {
 
-                                        READ_D(d);
-                                        d += HL_IX_IY;
-                                        READ_BYTE(d, x);
-                                        DEC(x);
-                                        WRITE_BYTE(d, x);
+                                int     d, x;
 
-                                        elapsed_cycles += 6;
+                                READ_D(d);
+                                d += HL_IX_IY;
+                                READ_BYTE(d, x);
+                                DEC(x);
+                                WRITE_BYTE(d, x);
 
-                                }
-                                break;
+                                elapsed_cycles += 6;
+
+                                END_INSTRUCTION;
 
                         }
 
                         /* General-purpose arithmetic and CPU control group. */
 
-                        case DAA: {
+                        INSTRUCTION(DAA): {
                         
                                 int     a, c, d;
 
@@ -1107,11 +2919,11 @@ emulate_next_instruction:
                                         | (F & Z80_N_FLAG)
                                         | c;
 
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case CPL: {
+                        INSTRUCTION(CPL): {
 
                                 A = ~A;
                                 F = (F & (SZPV_FLAGS | Z80_C_FLAG))
@@ -1124,11 +2936,11 @@ emulate_next_instruction:
 
                                         | Z80_H_FLAG | Z80_N_FLAG;
 
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case NEG: {
+                        INSTRUCTION(NEG): {
 
                                 int     a, f, z, c;
 
@@ -1145,11 +2957,11 @@ emulate_next_instruction:
                                 A = z;
                                 F = f;
 
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case CCF: {
+                        INSTRUCTION(CCF): {
 
                                 int     c;
 
@@ -1165,11 +2977,11 @@ emulate_next_instruction:
 
                                         | (c ^ Z80_C_FLAG);
 
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case SCF: {
+                        INSTRUCTION(SCF): {
 
                                 F = (F & SZPV_FLAGS) 
 
@@ -1181,41 +2993,58 @@ emulate_next_instruction:
 
                                         | Z80_C_FLAG;
 
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case NOP: {
+                        INSTRUCTION(NOP): {
 
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case HALT: {
+                        INSTRUCTION(HALT): {
 
 #ifdef Z80_CATCH_HALT
 
                                 state->status = Z80_STATUS_FLAG_HALT;
 
+				goto stop_emulation;
+
 #else
 
 				/* If an HALT instruction is executed, the Z80
 				 * keeps executing NOPs until an interrupt is
-				 * generated. Basically nothing happens for the
-				 * remaining number of cycles.
+				 * generated. pc is kept on the HALT so that it
+				 * is executed again if the emulation resumes,
+				 * see leave_halt(). Instead of emulating the
+				 * NOPs one at a time, skip all those that run
+				 * before the cycle check would stop the 
+				 * emulation.
 				 */
 
-				if (elapsed_cycles < number_cycles)
-	
-					elapsed_cycles = number_cycles;
+                                {
+                                        int     nops, remaining;
 
-#endif
+                                        pc--;
+                                        state->halted = 1;
 
-				goto stop_emulation;
+                                        remaining = number_cycles 
+                                                - elapsed_cycles;
+                                        nops = remaining > 0 
+                                                ? (remaining + 3) >> 2 
+                                                : 0;
+                                        elapsed_cycles += nops << 2;
+                                        r += nops;
+
+                                }
+                                END_INSTRUCTION;
+
+#endif
 
                         }
 
-                        case DI: {
+                        INSTRUCTION(DI): {
 
 				state->iff1 = state->iff2 = 0;
 
@@ -1238,13 +3067,13 @@ emulate_next_instruction:
                                  */
 
                                 number_cycles += 4;
-                                break;
+                                END_INSTRUCTION;
 
 #endif                  
 
                         }
 
-                        case EI: {
+                        INSTRUCTION(EI): {
 
                                 state->iff1 = state->iff2 = 1;
 
@@ -1258,13 +3087,13 @@ emulate_next_instruction:
                                 /* See comment for DI. */
 
                                 number_cycles += 4;
-                                break;
+                                END_INSTRUCTION;
 
 #endif
 
                         }
 
-                        case IM_N: {
+                        INSTRUCTION(IM_N): {
 
                                 /* "IM 0/1" (0xed prefixed opcodes 0x4e and
                                  * 0x6e) is treated like a "IM 0".
@@ -1282,13 +3111,13 @@ emulate_next_instruction:
 
                                         state->im = Z80_INTERRUPT_MODE_2;
 
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
                         /* 16-bit arithmetic group. */
 
-                        case ADD_HL_RR: {
+                        INSTRUCTION(ADD_HL_RR): {
 
                                 int     x, y, z, f, c;
 
@@ -1313,11 +3142,11 @@ emulate_next_instruction:
 
                                 elapsed_cycles += 7;
 
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case ADC_HL_RR: {
+                        INSTRUCTION(ADC_HL_RR): {
 
                                 int     x, y, z, f, c;
                         
@@ -1344,11 +3173,11 @@ emulate_next_instruction:
 
                                 elapsed_cycles += 7;
 
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case SBC_HL_RR: {
+                        INSTRUCTION(SBC_HL_RR): {
 
                                 int     x, y, z, f, c;
                         
@@ -1377,11 +3206,11 @@ emulate_next_instruction:
 
                                 elapsed_cycles += 7;
 
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case INC_RR: {
+                        INSTRUCTION(INC_RR): {
 
                                 int     x;
 
@@ -1391,11 +3220,11 @@ emulate_next_instruction:
 
                                 elapsed_cycles += 2;
 
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case DEC_RR: {
+                        INSTRUCTION(DEC_RR): {
 
                                 int     x;
 
@@ -1405,22 +3234,22 @@ emulate_next_instruction:
 
                                 elapsed_cycles += 2;
 
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
                         /* Rotate and shift group. */
 
-                        case RLCA: {
+                        INSTRUCTION(RLCA): {
                         
                                 A = (A << 1) | (A >> 7);
                                 F = (F & SZPV_FLAGS)
                                         | (A & (YX_FLAGS | Z80_C_FLAG));
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case RLA: {
+                        INSTRUCTION(RLA): {
 
                                 int     a, f;
 
@@ -1437,11 +3266,11 @@ emulate_next_instruction:
                                 A = a | (F & Z80_C_FLAG); 
                                 F = f;
 
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case RRCA: {
+                        INSTRUCTION(RRCA): {
 
                                 int     c;
 
@@ -1457,11 +3286,11 @@ emulate_next_instruction:
 
                                         | c;
 
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case RRA: {
+                        INSTRUCTION(RRA): {
 
                                 int     c;
 
@@ -1477,356 +3306,363 @@ emulate_next_instruction:
 
                                         | c;
 
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case RLC_R: {
+                        INSTRUCTION(RLC_R): {
 
                                 RLC(R(Z(opcode)));
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case RLC_INDIRECT_HL: {
+                        INSTRUCTION(RLC_INDIRECT_HL): {
 
                                 int     x;
 
-                                if (registers == state->register_table) {
+                                READ_BYTE(HL, x);
+                                RLC(x);
+                                WRITE_BYTE(HL, x);
 
-                                        READ_BYTE(HL, x);
-                                        RLC(x);
-                                        WRITE_BYTE(HL, x);
+                                elapsed_cycles++;
 
-                                        elapsed_cycles++;
+                                END_INSTRUCTION;
 
-                                } else {
+                        }
 
-                                        int     d;
+                        INSTRUCTION(RLC_INDEXED): {
 
-                                        Z80_FETCH_BYTE(pc, d);
-                                        d = ((signed char) d) + HL_IX_IY;
+                                int     d, x;
 
-                                        READ_BYTE(d, x);
-                                        RLC(x);
-                                        WRITE_BYTE(d, x);
+                                Z80_FETCH_BYTE(pc, d);
+                                d = ((signed char) d) + HL_IX_IY;
 
-                                        if (Z(opcode) != INDIRECT_HL)
+                                READ_BYTE(d, x);
+                                RLC(x);
+                                WRITE_BYTE(d, x);
 
-                                                R(Z(opcode)) = x;
+                                if (Z(opcode) != INDIRECT_HL)
 
-                                        pc += 2;
+                                        R(Z(opcode)) = x;
 
-                                        elapsed_cycles += 5;
+                                pc += 2;
 
-                                }
+                                elapsed_cycles += 5;
 
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case RL_R: {
+                        INSTRUCTION(RL_R): {
 
                                 RL(R(Z(opcode)));
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case RL_INDIRECT_HL: {
+                        INSTRUCTION(RL_INDIRECT_HL): {
 
                                 int     x;
 
-                                if (registers == state->register_table) {
+                                READ_BYTE(HL, x);
+                                RL(x);
+                                WRITE_BYTE(HL, x);
+
+                                elapsed_cycles++;
 
-                                        READ_BYTE(HL, x);
-                                        RL(x);
-                                        WRITE_BYTE(HL, x);
+                                END_INSTRUCTION;
 
-                                        elapsed_cycles++;
+                        }
 
-                                } else {
+                        INSTRUCTION(RL_INDEXED): {
 
-                                        int     d;
+                                int     d, x;
 
-                                        Z80_FETCH_BYTE(pc, d);
-                                        d = ((signed char) d) + HL_IX_IY;
+                                Z80_FETCH_BYTE(pc, d);
+                                d = ((signed char) d) + HL_IX_IY;
 
-                                        READ_BYTE(d, x);
-                                        RL(x);
-                                        WRITE_BYTE(d, x);
+                                READ_BYTE(d, x);
+                                RL(x);
+                                WRITE_BYTE(d, x);
 
-                                        if (Z(opcode) != INDIRECT_HL)
+                                if (Z(opcode) != INDIRECT_HL)
 
-                                                R(Z(opcode)) = x;
+                                        R(Z(opcode)) = x;
 
-                                        pc += 2;
+                                pc += 2;
 
-                                        elapsed_cycles += 5;
+                                elapsed_cycles += 5;
 
-                                }
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case RRC_R: {
+                        INSTRUCTION(RRC_R): {
 
                                 RRC(R(Z(opcode)));
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case RRC_INDIRECT_HL: {
+                        INSTRUCTION(RRC_INDIRECT_HL): {
 
                                 int     x;
 
-                                if (registers == state->register_table) {
+                                READ_BYTE(HL, x);
+                                RRC(x);
+                                WRITE_BYTE(HL, x);
+
+                                elapsed_cycles++;
 
-                                        READ_BYTE(HL, x);
-                                        RRC(x);
-                                        WRITE_BYTE(HL, x);
+                                END_INSTRUCTION;
 
-                                        elapsed_cycles++;
+                        }
 
-                                } else {
+                        INSTRUCTION(RRC_INDEXED): {
 
-                                        int     d;
+                                int     d, x;
 
-                                        Z80_FETCH_BYTE(pc, d);
-                                        d = ((signed char) d) + HL_IX_IY;
+                                Z80_FETCH_BYTE(pc, d);
+                                d = ((signed char) d) + HL_IX_IY;
 
-                                        READ_BYTE(d, x);
-                                        RRC(x);
-                                        WRITE_BYTE(d, x);
+                                READ_BYTE(d, x);
+                                RRC(x);
+                                WRITE_BYTE(d, x);
 
-                                        if (Z(opcode) != INDIRECT_HL)
+                                if (Z(opcode) != INDIRECT_HL)
 
-                                                R(Z(opcode)) = x;
+                                        R(Z(opcode)) = x;
 
-                                        pc += 2;
+                                pc += 2;
 
-                                        elapsed_cycles += 5;
+                                elapsed_cycles += 5;
 
-                                }
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case RR_R: {
+                        INSTRUCTION(RR_R): {
 
                                 RR_INSTRUCTION(R(Z(opcode)));
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case RR_INDIRECT_HL: {
+                        INSTRUCTION(RR_INDIRECT_HL): {
 
                                 int     x;
 
-                                if (registers == state->register_table) {
+                                READ_BYTE(HL, x);
+                                RR_INSTRUCTION(x);
+                                WRITE_BYTE(HL, x);
 
-                                        READ_BYTE(HL, x);
-                                        RR_INSTRUCTION(x);
-                                        WRITE_BYTE(HL, x);
+                                elapsed_cycles++;
 
-                                        elapsed_cycles++;
+                                END_INSTRUCTION;
 
-                                } else {
+                        }
 
-                                        int     d;
+                        INSTRUCTION(RR_INDEXED): {
 
-                                        Z80_FETCH_BYTE(pc, d);
-                                        d = ((signed char) d) + HL_IX_IY;
+                                int     d, x;
 
-                                        READ_BYTE(d, x);
-                                        RR_INSTRUCTION(x);
-                                        WRITE_BYTE(d, x);
+                                Z80_FETCH_BYTE(pc, d);
+                                d = ((signed char) d) + HL_IX_IY;
 
-                                        if (Z(opcode) != INDIRECT_HL)
+                                READ_BYTE(d, x);
+                                RR_INSTRUCTION(x);
+                                WRITE_BYTE(d, x);
 
-                                                R(Z(opcode)) = x;
+                                if (Z(opcode) != INDIRECT_HL)
 
-                                        pc += 2;
+                                        R(Z(opcode)) = x;
 
-                                        elapsed_cycles += 5;
+                                pc += 2;
 
-                                }
-                                break;
+                                elapsed_cycles += 5;
+
+                                END_INSTRUCTION;
 
                         }
 
-                        case SLA_R: {
+                        INSTRUCTION(SLA_R): {
 
                                 SLA(R(Z(opcode)));
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case SLA_INDIRECT_HL: {
+                        INSTRUCTION(SLA_INDIRECT_HL): {
 
                                 int     x;      
 
-                                if (registers == state->register_table) {
+                                READ_BYTE(HL, x);
+                                SLA(x);
+                                WRITE_BYTE(HL, x);
 
-                                        READ_BYTE(HL, x);
-                                        SLA(x);
-                                        WRITE_BYTE(HL, x);
+                                elapsed_cycles++;
 
-                                        elapsed_cycles++;
+                                END_INSTRUCTION;
 
-                                } else {
+                        }
 
-                                        int     d;
+                        INSTRUCTION(SLA_INDEXED): {
 
-                                        Z80_FETCH_BYTE(pc, d);
-                                        d = ((signed char) d) + HL_IX_IY;
+                                int     d, x;
 
-                                        READ_BYTE(d, x);
-                                        SLA(x);
-                                        WRITE_BYTE(d, x);
+                                Z80_FETCH_BYTE(pc, d);
+                                d = ((signed char) d) + HL_IX_IY;
 
-                                        if (Z(opcode) != INDIRECT_HL)
+                                READ_BYTE(d, x);
+                                SLA(x);
+                                WRITE_BYTE(d, x);
 
-                                                R(Z(opcode)) = x;
+                                if (Z(opcode) != INDIRECT_HL)
 
-                                        pc += 2;
+                                        R(Z(opcode)) = x;
 
-                                        elapsed_cycles += 5;
+                                pc += 2;
 
-                                }
-                                break;
+                                elapsed_cycles += 5;
+
+                                END_INSTRUCTION;
 
                         }
 
-                        case SLL_R: {
+                        INSTRUCTION(SLL_R): {
 
                                 SLL(R(Z(opcode)));
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case SLL_INDIRECT_HL: {
+                        INSTRUCTION(SLL_INDIRECT_HL): {
 
                                 int     x;
 
-                                if (registers == state->register_table) {
+                                READ_BYTE(HL, x);
+                                SLL(x);
+                                WRITE_BYTE(HL, x);
 
-                                        READ_BYTE(HL, x);
-                                        SLL(x);
-                                        WRITE_BYTE(HL, x);
+                                elapsed_cycles++;
 
-                                        elapsed_cycles++;
+                                END_INSTRUCTION;
 
-                                } else {
+                        }
 
-                                        int     d;
+                        INSTRUCTION(SLL_INDEXED): {
 
-                                        Z80_FETCH_BYTE(pc, d);
-                                        d = ((signed char) d) + HL_IX_IY;
+                                int     d, x;
 
-                                        READ_BYTE(d, x);
-                                        SLL(x);
-                                        WRITE_BYTE(d, x);
+                                Z80_FETCH_BYTE(pc, d);
+                                d = ((signed char) d) + HL_IX_IY;
 
-                                        if (Z(opcode) != INDIRECT_HL)
+                                READ_BYTE(d, x);
+                                SLL(x);
+                                WRITE_BYTE(d, x);
 
-                                                R(Z(opcode)) = x;
+                                if (Z(opcode) != INDIRECT_HL)
 
-                                        pc += 2;
+                                        R(Z(opcode)) = x;
 
-                                        elapsed_cycles += 5;
+                                pc += 2;
 
-                                }
-                                break;
+                                elapsed_cycles += 5;
+
+                                END_INSTRUCTION;
 
                         }
 
-                        case SRA_R: {
+                        INSTRUCTION(SRA_R): {
 
                                 SRA(R(Z(opcode)));
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case SRA_INDIRECT_HL: {
+                        INSTRUCTION(SRA_INDIRECT_HL): {
 
                                 int     x;
 
-                                if (registers == state->register_table) {
+                                READ_BYTE(HL, x);
+                                SRA(x);
+                                WRITE_BYTE(HL, x);
+
+                                elapsed_cycles++;
 
-                                        READ_BYTE(HL, x);
-                                        SRA(x);
-                                        WRITE_BYTE(HL, x);
+                                END_INSTRUCTION;
 
-                                        elapsed_cycles++;
+                        }
 
-                                } else {
+                        INSTRUCTION(SRA_INDEXED): {
 
-                                        int     d;
+                                int     d, x;
 
-                                        Z80_FETCH_BYTE(pc, d);
-                                        d = ((signed char) d) + HL_IX_IY;
+                                Z80_FETCH_BYTE(pc, d);
+                                d = ((signed char) d) + HL_IX_IY;
 
-                                        READ_BYTE(d, x);
-                                        SRA(x);
-                                        WRITE_BYTE(d, x);
+                                READ_BYTE(d, x);
+                                SRA(x);
+                                WRITE_BYTE(d, x);
 
-                                        if (Z(opcode) != INDIRECT_HL)
+                                if (Z(opcode) != INDIRECT_HL)
 
-                                                R(Z(opcode)) = x;
+                                        R(Z(opcode)) = x;
 
-                                        pc += 2;
+                                pc += 2;
 
-                                        elapsed_cycles += 5;
+                                elapsed_cycles += 5;
 
-                                }
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case SRL_R: {
+                        INSTRUCTION(SRL_R): {
 
                                 SRL(R(Z(opcode)));
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case SRL_INDIRECT_HL: {
+                        INSTRUCTION(SRL_INDIRECT_HL): {
 
                                 int     x;
 
-                                if (registers == state->register_table) {
+                                READ_BYTE(HL, x);
+                                SRL(x);
+                                WRITE_BYTE(HL, x);
+
+                                elapsed_cycles++;
 
-                                        READ_BYTE(HL, x);
-                                        SRL(x);
-                                        WRITE_BYTE(HL, x);
+                                END_INSTRUCTION;
 
-                                        elapsed_cycles++;
+                        }
 
-                                } else {
+                        INSTRUCTION(SRL_INDEXED): {
 
-                                        int     d;
+                                int     d, x;
 
-                                        Z80_FETCH_BYTE(pc, d);
-                                        d = ((signed char) d) + HL_IX_IY;
+                                Z80_FETCH_BYTE(pc, d);
+                                d = ((signed char) d) + HL_IX_IY;
 
-                                        READ_BYTE(d, x);
-                                        SRL(x);
-                                        WRITE_BYTE(d, x);
+                                READ_BYTE(d, x);
+                                SRL(x);
+                                WRITE_BYTE(d, x);
 
-                                        if (Z(opcode) != INDIRECT_HL)
+                                if (Z(opcode) != INDIRECT_HL)
 
-                                                R(Z(opcode)) = x;
+                                        R(Z(opcode)) = x;
 
-                                        pc += 2;
+                                pc += 2;
 
-                                        elapsed_cycles += 5;
+                                elapsed_cycles += 5;
 
-                                }
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case RLD_RRD: {
+                        INSTRUCTION(RLD_RRD): {
 
                                 int     x, y;
 
@@ -1845,13 +3681,13 @@ emulate_next_instruction:
 
                                 elapsed_cycles += 4;
 
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
                         /* Bit set, reset, and test group. */
 
-                        case BIT_B_R: {
+                        INSTRUCTION(BIT_B_R): {
 
                                 int     x;
 
@@ -1868,30 +3704,46 @@ emulate_next_instruction:
                                         | Z80_H_FLAG
                                         | (F & Z80_C_FLAG);
 
-                                break;
+                                END_INSTRUCTION;
 
                         }                               
 
-                        case BIT_B_INDIRECT_HL: {
+                        INSTRUCTION(BIT_B_INDIRECT_HL): {
 
                                 int     d, x;
                                         
-                                if (registers == state->register_table) {
+                                d = HL;
 
-                                        d = HL;
+                                elapsed_cycles++;
 
-                                        elapsed_cycles++;
+                                READ_BYTE(d, x);
+                                x &= 1 << Y(opcode);
+                                F = (x ? 0 : Z80_Z_FLAG | Z80_P_FLAG)
 
-                                } else {
+#ifndef Z80_DOCUMENTED_FLAGS_ONLY
 
-                                        Z80_FETCH_BYTE(pc, d);
-                                        d = ((signed char) d) + HL_IX_IY;
+                                        | (x & Z80_S_FLAG)
+                                        | (d & YX_FLAGS)
 
-                                        pc += 2;
+#endif
 
-                                        elapsed_cycles += 5;
+                                        | Z80_H_FLAG
+                                        | (F & Z80_C_FLAG);
 
-                                }
+                                END_INSTRUCTION;
+
+                        }
+
+                        INSTRUCTION(BIT_B_INDEXED): {
+
+                                int     d, x;
+                                        
+                                Z80_FETCH_BYTE(pc, d);
+                                d = ((signed char) d) + HL_IX_IY;
+
+                                pc += 2;
+
+                                elapsed_cycles += 5;
 
                                 READ_BYTE(d, x);
                                 x &= 1 << Y(opcode);
@@ -1907,118 +3759,123 @@ emulate_next_instruction:
                                         | Z80_H_FLAG
                                         | (F & Z80_C_FLAG);
 
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case SET_B_R: {
+                        INSTRUCTION(SET_B_R): {
 
                                 R(Z(opcode)) |= 1 << Y(opcode);
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case SET_B_INDIRECT_HL: {
+                        INSTRUCTION(SET_B_INDIRECT_HL): {
 
                                 int     x;
 
-                                if (registers == state->register_table) {
+                                READ_BYTE(HL, x);
+                                x |= 1 << Y(opcode);
+                                WRITE_BYTE(HL, x);
 
-                                        READ_BYTE(HL, x);
-                                        x |= 1 << Y(opcode);
-                                        WRITE_BYTE(HL, x);
+                                elapsed_cycles++;
 
-                                        elapsed_cycles++;
+                                END_INSTRUCTION;
 
-                                } else {
+                        }
 
-                                        int     d;
+                        INSTRUCTION(SET_B_INDEXED): {
 
-                                        Z80_FETCH_BYTE(pc, d);
-                                        d = ((signed char) d) + HL_IX_IY;
+                                int     d, x;
 
-                                        READ_BYTE(d, x);
-                                        x |= 1 << Y(opcode);
-                                        WRITE_BYTE(d, x);
+                                Z80_FETCH_BYTE(pc, d);
+                                d = ((signed char) d) + HL_IX_IY;
 
-                                        if (Z(opcode) != INDIRECT_HL)
+                                READ_BYTE(d, x);
+                                x |= 1 << Y(opcode);
+                                WRITE_BYTE(d, x);
 
-                                                R(Z(opcode)) = x;
+                                if (Z(opcode) != INDIRECT_HL)
 
-                                        pc += 2;
+                                        R(Z(opcode)) = x;
 
-                                        elapsed_cycles += 5;
+                                pc += 2;
 
-                                }
-                                break;
+                                elapsed_cycles += 5;
+
+                                END_INSTRUCTION;
 
                         }
 
-                        case RES_B_R: {
+                        INSTRUCTION(RES_B_R): {
 
                                 R(Z(opcode)) &= ~(1 << Y(opcode));
-                                break;
+                                END_INSTRUCTION;
 
                         }       
 
-                        case RES_B_INDIRECT_HL: {
+                        INSTRUCTION(RES_B_INDIRECT_HL): {
 
                                 int     x;
 
-                                if (registers == state->register_table) {
+                                READ_BYTE(HL, x);
+                                x &= ~(1 << Y(opcode));
+                                WRITE_BYTE(HL, x);
 
-                                        READ_BYTE(HL, x);
-                                        x &= ~(1 << Y(opcode));
-                                        WRITE_BYTE(HL, x);
+                                elapsed_cycles++;
 
-                                        elapsed_cycles++;
+                                END_INSTRUCTION;
 
-                                } else {
+                        }
 
-                                        int     d;
+                        INSTRUCTION(RES_B_INDEXED): {
 
-                                        Z80_FETCH_BYTE(pc, d);
-                                        d = ((signed char) d) + HL_IX_IY;
+                                int     d, x;
 
-                                        READ_BYTE(d, x);
-                                        x &= ~(1 << Y(opcode));
-                                        WRITE_BYTE(d, x);
+                                Z80_FETCH_BYTE(pc, d);
+                                d = ((signed char) d) + HL_IX_IY;
 
-                                        if (Z(opcode) != INDIRECT_HL)
+                                READ_BYTE(d, x);
+                                x &= ~(1 << Y(opcode));
+                                WRITE_BYTE(d, x);
 
-                                                R(Z(opcode)) = x;
+                                if (Z(opcode) != INDIRECT_HL)
 
-                                        pc += 2;
+                                        R(Z(opcode)) = x;
 
-                                        elapsed_cycles += 5;
+                                pc += 2;
 
-                                }
-                                break;
+                                elapsed_cycles += 5;
+
+                                END_INSTRUCTION;
 
                         }
 
                         /* Jump group. */
 
-                        case JP_NN: {
+                        INSTRUCTION(JP_NN): {
 
                                 int     nn;
 
                                 Z80_FETCH_WORD(pc, nn);
-                                pc = nn;
-
                                 elapsed_cycles += 6;
+                                IDLE_LOOP(nn, pc + 2);
+                                pc = nn;
 
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case JP_CC_NN: {
+                        INSTRUCTION(JP_CC_NN): {
 
                                 int     nn;
 
+                                elapsed_cycles += 6;
+
                                 if (CC(Y(opcode))) {
 
                                         Z80_FETCH_WORD(pc, nn);
+                                        IDLE_LOOP(nn, pc + 2);
                                         pc = nn;
 
                                 } else {
@@ -2030,38 +3887,38 @@ emulate_next_instruction:
 #endif          
 
                                         pc += 2;
+                                        LEAVE_IDLE_LOOP;
 
                                 }
 
-                                elapsed_cycles += 6;
-
-                                break;
+                                END_INSTRUCTION;
 
                         }                               
 
-                        case JR_E: {
+                        INSTRUCTION(JR_E): {
 
                                 int     e;
                                 
                                 Z80_FETCH_BYTE(pc, e);
-                                pc += ((signed char) e) + 1;
-
                                 elapsed_cycles += 8;
+                                IDLE_LOOP(pc + ((signed char) e) + 1, pc + 1);
+                                pc += ((signed char) e) + 1;
 
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case JR_DD_E: {
+                        INSTRUCTION(JR_DD_E): {
 
                                 int     e;
 
                                 if (DD(Q(opcode))) {
                                 
                                         Z80_FETCH_BYTE(pc, e);
-                                        pc += ((signed char) e) + 1;
-
                                         elapsed_cycles += 8;
+                                        IDLE_LOOP(pc + ((signed char) e) + 1,
+                                                pc + 1);
+                                        pc += ((signed char) e) + 1;
 
                                 } else {
 
@@ -2074,20 +3931,21 @@ emulate_next_instruction:
                                         pc++;
 
                                         elapsed_cycles += 3;
+                                        LEAVE_IDLE_LOOP;
 
                                 }
-                                break;  
+                                END_INSTRUCTION;
 
                         }                                            
 
-                        case JP_HL: {
+                        INSTRUCTION(JP_HL): {
 
                                 pc = HL_IX_IY;
-                                break;
+                                END_INSTRUCTION;
 
                         }                       
 
-                        case DJNZ_E: {
+                        INSTRUCTION(DJNZ_E): {
 
                                 int     e;
                                 
@@ -2111,13 +3969,13 @@ emulate_next_instruction:
                                         elapsed_cycles += 4;
 
                                 }
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
                         /* Call and return group. */
 
-                        case CALL_NN: {
+                        INSTRUCTION(CALL_NN): {
 
                                 int     nn;
 
@@ -2127,11 +3985,13 @@ emulate_next_instruction:
 
                                 elapsed_cycles++;
 
-                                break;
+                                HLE_ROUTINE;
+
+                                END_INSTRUCTION;
 
                         }
 
-                        case CALL_CC_NN: {
+                        INSTRUCTION(CALL_CC_NN): {
 
                                 int     nn;
 
@@ -2143,6 +4003,8 @@ emulate_next_instruction:
 
                                         elapsed_cycles++;
 
+                                        HLE_ROUTINE;
+
                                 } else {
 
 #ifdef Z80_FALSE_CONDITION_FETCH
@@ -2156,18 +4018,18 @@ emulate_next_instruction:
                                         elapsed_cycles += 6;
 
                                 }
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case RET: {
+                        INSTRUCTION(RET): {
 
                                 POP(pc);
-                                break;
+                                END_INSTRUCTION;
 
                         }
                                                   
-                        case RET_CC: {
+                        INSTRUCTION(RET_CC): {
 
                                 if (CC(Y(opcode))) {
 
@@ -2175,11 +4037,11 @@ emulate_next_instruction:
 
                                 }
                                 elapsed_cycles++;
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case RETI_RETN: {
+                        INSTRUCTION(RETI_RETN): {
 
                                 state->iff1 = state->iff2;
                                 state->in_nmi = 0;
@@ -2204,24 +4066,24 @@ emulate_next_instruction:
 
 #else
 
-                                break;
+                                END_INSTRUCTION;
 
 #endif
 
                         }
 
-                        case RST_P: {
+                        INSTRUCTION(RST_P): {
 
                                 PUSH(pc);
                                 pc = RST_TABLE[Y(opcode)];
                                 elapsed_cycles++;
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
                         /* Input and output group. */
 
-                        case IN_A_N: {
+                        INSTRUCTION(IN_A_N): {
 
                                 int     n;
 
@@ -2230,11 +4092,11 @@ emulate_next_instruction:
 
                                 elapsed_cycles += 4;
 
-                                break;
+                                END_INSTRUCTION;
 
                         }       
 
-                        case IN_R_C: {
+                        INSTRUCTION(IN_R_C): {
 
                                 int     x = 0;                                           
                                 Z80_INPUT_BYTE(C, x);
@@ -2246,7 +4108,7 @@ emulate_next_instruction:
 
                                 elapsed_cycles += 4;
 
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
@@ -2257,7 +4119,7 @@ emulate_next_instruction:
                          * Undocumented Z80 Documented Version 0.91". 
                          */
 
-                        case INI_IND: {
+                        INSTRUCTION(INI_IND): {
 
                                 int     x = 0, f;
 
@@ -2284,11 +4146,11 @@ emulate_next_instruction:
 
                                 elapsed_cycles += 5;
 
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case INIR_INDR: {
+                        INSTRUCTION(INIR_INDR): {
 
                                 int     d, b, hl, x = 0, f;
 
@@ -2308,6 +4170,41 @@ emulate_next_instruction:
 
                                 r -= 2;
                                 elapsed_cycles -= 8;
+
+#ifdef Z80_BLOCK_TRANSFERS
+
+                                {
+                                        int     count, n;
+
+                                        /* B = 0 repeats 256 times. The input
+                                         * may stop the emulation before
+                                         * count iterations.
+                                         */
+
+                                        b = ((b - 1) & 0xff) + 1;
+                                        REPEAT_ITERATIONS(b, count);
+                                        Z80_INPUT_BLOCK(C, hl, count, d, n, x);
+
+                                        r += 2 * n;
+                                        hl += d * n;
+                                        b -= n;
+                                        elapsed_cycles += 21 * n;
+                                        if (b) {
+
+                                                f = SZYX_FLAGS_TABLE[b];
+                                                pc -= 2;
+
+                                        } else {
+
+                                                f = Z80_Z_FLAG;
+                                                elapsed_cycles -= 5;
+
+                                        }
+
+                                }
+
+#else
+
                                 for ( ; ; ) {
 
                                         r += 2;
@@ -2317,7 +4214,8 @@ emulate_next_instruction:
 
                                         hl += d;
 
-                                        if (--b) 
+                                        b = (b - 1) & 0xff;
+                                        if (b) 
 
                                                 elapsed_cycles += 21;
 
@@ -2356,6 +4254,8 @@ emulate_next_instruction:
 
                                 } 
 
+#endif
+
                                 HL = hl;
                                 B = b;
 
@@ -2366,11 +4266,11 @@ emulate_next_instruction:
                                         & Z80_P_FLAG;
                                 F = f;
 
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case OUT_N_A: {
+                        INSTRUCTION(OUT_N_A): {
 
                                 int     n;
 
@@ -2379,11 +4279,11 @@ emulate_next_instruction:
 
                                 elapsed_cycles += 4;
 
-                                break;
+                                END_INSTRUCTION;
 
                         }       
 
-                        case OUT_C_R: {
+                        INSTRUCTION(OUT_C_R): {
 
                                 int     x;
 
@@ -2394,11 +4294,11 @@ emulate_next_instruction:
 
                                 elapsed_cycles += 4;
 
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case OUTI_OUTD: {
+                        INSTRUCTION(OUTI_OUTD): {
 
                                 int     x, f;
 
@@ -2418,11 +4318,11 @@ emulate_next_instruction:
                                         & Z80_P_FLAG;
                                 F = f;
 
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
-                        case OTIR_OTDR: {
+                        INSTRUCTION(OTIR_OTDR): {
 
                                 int     d, b, hl, x, f;
 
@@ -2433,6 +4333,41 @@ emulate_next_instruction:
 
                                 r -= 2;
                                 elapsed_cycles -= 8;
+
+#ifdef Z80_BLOCK_TRANSFERS
+
+                                {
+                                        int     count, n;
+
+                                        /* B = 0 repeats 256 times. The output
+                                         * may stop the emulation before
+                                         * count iterations.
+                                         */
+
+                                        b = ((b - 1) & 0xff) + 1;
+                                        REPEAT_ITERATIONS(b, count);
+                                        Z80_OUTPUT_BLOCK(C, hl, count, d, n, x);
+
+                                        r += 2 * n;
+                                        hl += d * n;
+                                        b -= n;
+                                        elapsed_cycles += 21 * n;
+                                        if (b) {
+
+                                                f = SZYX_FLAGS_TABLE[b];
+                                                pc -= 2;
+
+                                        } else {
+
+                                                f = Z80_Z_FLAG;
+                                                elapsed_cycles -= 5;
+
+                                        }
+
+                                }
+
+#else
+
                                 for ( ; ; ) {
 
                                         r += 2;
@@ -2441,7 +4376,8 @@ emulate_next_instruction:
                                         Z80_OUTPUT_BYTE(C, x);
 
                                         hl += d;
-                                        if (--b) 
+                                        b = (b - 1) & 0xff;
+                                        if (b) 
 
                                                 elapsed_cycles += 21;
 
@@ -2467,6 +4403,8 @@ emulate_next_instruction:
 
                                 } 
 
+#endif
+
                                 HL = hl;
                                 B = b;
 
@@ -2477,41 +4415,40 @@ emulate_next_instruction:
                                         & Z80_P_FLAG;
                                 F = f;
 
-                                break;
+                                END_INSTRUCTION;
 
                         }
 
                         /* Prefix group. */
 
-                        case CB_PREFIX: {
-
-                                /* Special handling if the 0xcb prefix is 
-                                 * prefixed by a 0xdd or 0xfd prefix.
-                                 */
-
-                                if (registers != state->register_table) {
+                        INSTRUCTION(CB_PREFIX): {
 
-                                        r--;
+                                Z80_FETCH_BYTE(pc, opcode);
+                                pc++;
+                                DISPATCH(CB_INSTRUCTION_TABLE, CB_DISPATCH_TABLE);
 
-                                        /* Indexed memory access routine will
-                                         * correctly update pc.
-                                         */
+                        }
 
-                                        Z80_FETCH_BYTE(pc + 1, opcode);
+                        INSTRUCTION(INDEXED_CB_PREFIX): {
 
-                                } else {
+                                /* The 0xcb prefix is prefixed by a 0xdd or 
+                                 * 0xfd prefix, the displacement comes before
+                                 * the opcode.
+                                 */
 
-                                        Z80_FETCH_BYTE(pc, opcode);
-                                        pc++;
+                                r--;
 
-                                }
-                                instruction = CB_INSTRUCTION_TABLE[opcode];
+                                /* Indexed memory access routine will
+                                 * correctly update pc.
+                                 */
 
-                                goto emulate_next_instruction;
+                                Z80_FETCH_BYTE(pc + 1, opcode);
+                                DISPATCH(INDEXED_CB_INSTRUCTION_TABLE, 
+                                        INDEXED_CB_DISPATCH_TABLE);
 
                         }
 
-                        case DD_PREFIX: {
+                        INSTRUCTION(DD_PREFIX): {
 
                                 registers = state->dd_register_table;
 
@@ -2525,7 +4462,8 @@ emulate_next_instruction:
 
                                         Z80_FETCH_BYTE(pc, opcode);
                                         pc++;
-                                        goto emulate_next_opcode;
+                                        DISPATCH(INDEXED_INSTRUCTION_TABLE, 
+                                                DD_DISPATCH_TABLE);
 
                                 } else {
 
@@ -2540,13 +4478,14 @@ emulate_next_instruction:
 
                                 Z80_FETCH_BYTE(pc, opcode);
                                 pc++;
-                                goto emulate_next_opcode;
+                                DISPATCH(INDEXED_INSTRUCTION_TABLE, 
+                                        DD_DISPATCH_TABLE);
 
 #endif                          
 
                         }
 
-                        case FD_PREFIX: {
+                        INSTRUCTION(FD_PREFIX): {
 
                                 registers = state->fd_register_table;
 
@@ -2556,7 +4495,8 @@ emulate_next_instruction:
 
                                         Z80_FETCH_BYTE(pc, opcode);
                                         pc++;
-                                        goto emulate_next_opcode;
+                                        DISPATCH(INDEXED_INSTRUCTION_TABLE, 
+                                                FD_DISPATCH_TABLE);
 
                                 } else {
 
@@ -2571,26 +4511,25 @@ emulate_next_instruction:
         
                                 Z80_FETCH_BYTE(pc, opcode);
                                 pc++;
-                                goto emulate_next_opcode;
+                                DISPATCH(INDEXED_INSTRUCTION_TABLE, 
+                                        FD_DISPATCH_TABLE);
 
 #endif                          
 
                         }
 
-                        case ED_PREFIX: {
+                        INSTRUCTION(ED_PREFIX): {
 
                                 registers = state->register_table;
                                 Z80_FETCH_BYTE(pc, opcode);
                                 pc++;
-                                instruction = ED_INSTRUCTION_TABLE[opcode];
-
-                                goto emulate_next_instruction;
+                                DISPATCH(ED_INSTRUCTION_TABLE, ED_DISPATCH_TABLE);
 
                         }
 
                         /* Special/pseudo instruction group. */
 
-                        case ED_UNDEFINED: {
+                        INSTRUCTION(ED_UNDEFINED): {
 
 #ifdef Z80_CATCH_ED_UNDEFINED
 
@@ -2600,7 +4539,7 @@ emulate_next_instruction:
 
 #else
 
-                                break;
+                                END_INSTRUCTION;
 
 #endif
 
@@ -2608,16 +4547,46 @@ emulate_next_instruction:
 
                 }
 
-                Z80_PROCESS_CYCLES(elapsed_cycles);
+#ifndef Z80_THREADED_DISPATCH
+
+#ifdef Z80_BLOCK_CACHE
+
+end_compiled_block:
+
+#endif
+
+                CONTINUE_BLOCK;
 
                 if (elapsed_cycles >= number_cycles)
 
                         goto stop_emulation;
 
+                LOOKUP_BLOCK;
+
+#endif
+
         }
 
+#if defined(Z80_THREADED_DISPATCH) && defined(Z80_BLOCK_CACHE)
+
+enter_block:
+
+        LOOKUP_BLOCK;
+        Z80_FETCH_BYTE(pc, opcode);
+        pc++;
+        registers = state->register_table;
+        DISPATCH(INSTRUCTION_TABLE, DISPATCH_TABLE);
+
+end_compiled_block:
+
+        END_INSTRUCTION;
+
+#endif
+
 stop_emulation:
 
+        FLUSH_FLAGS;
+        state->opcode_fetches += r - (state->r & 0x7f);
         state->r = (state->r & 0x80) | (r & 0x7f);
         state->pc = pc & 0xffff;
 
@@ -117,6 +117,10 @@ enum {
 
 };
 
+/* Cache of predecoded instructions, see Z80_BLOCK_CACHE in z80config.h. */
+
+typedef struct Z80_CACHE        Z80_CACHE;
+
 /* Z80 processor's state. You may add your own members if needed. However, it
  * is rather suggested to use the context pointer passed to the emulation 
  * functions for that purpose. See z80user.h.
@@ -136,6 +140,19 @@ typedef struct Z80_STATE {
         unsigned short  alternates[4];
 
         int             i, r, pc, iff1, iff2, im, in_nmi;
+
+        /* Non-zero while a HALT instruction waits for an interrupt, pc then
+         * points on the HALT.
+         */
+
+        int             halted;
+
+        /* Opcodes fetched by Z80Emulate(), as counted by R: one per
+         * instruction and one more per prefix.  A running total that
+         * Z80Reset() leaves alone, to be read as the difference across calls.
+         */
+
+        long long       opcode_fetches;
         
         /* Register decoding tables. */
 
@@ -143,6 +160,12 @@ typedef struct Z80_STATE {
                         *dd_register_table[16], 
                         *fd_register_table[16];        
 
+        /* Block cache used by the emulation if not NULL. It is not changed by
+         * Z80Reset().
+         */
+
+        Z80_CACHE       *block_cache;
+
 } Z80_STATE;
 
 /* Initialize processor's state to power-on default. */
@@ -175,6 +198,70 @@ extern int      Z80Emulate (Z80_STATE *state,
 			int number_cycles, 
 			void *context);
 
+/* Allocate an empty block cache to be set as Z80_STATE's block_cache, or
+ * return NULL if the emulator is built without Z80_BLOCK_CACHE. Flush it 
+ * whenever code that Z80_CODE_IS_CACHEABLE() accepted is changed or remapped.
+ */
+
+extern Z80_CACHE        *Z80CreateBlockCache (void);
+
+extern void     Z80FlushBlockCache (Z80_CACHE *cache);
+
+extern void     Z80DestroyBlockCache (Z80_CACHE *cache);
+
+/* Instruction of a block as decoded by the block cache. prefix is 0, 0xcb, 
+ * 0xed, 0xdd, 0xfd, 0xddcb, or 0xfdcb. length, cycles, and r account for the
+ * opcode and prefix bytes fetched before instruction's handler is run, 
+ * operands are read by the handler itself. For 0xddcb and 0xfdcb, this leaves
+ * the displacement to be read.
+ */
+
+#define Z80_MAXIMUM_BLOCK_INSTRUCTIONS  32
+
+typedef struct Z80_BLOCK_INSTRUCTION {
+
+        int     address, instruction, opcode, prefix;
+        int     length, cycles, r;
+
+} Z80_BLOCK_INSTRUCTION;
+
+/* Decode into instructions the block that the block cache would build at 
+ * address, and return its number of instructions, or zero if there is none.
+ */
+
+extern int      Z80DescribeBlock (int address, 
+                        Z80_BLOCK_INSTRUCTION *instructions, 
+                        void *context);
+
+/* Function emulating a whole block of instructions, typically generated ahead
+ * of time by romcompile. It is entered with *pc and *r right before the 
+ * block's first instruction, runs all of them exactly like emulate() would, 
+ * and returns the updated number of elapsed cycles. *number_cycles is the
+ * number_cycles variable of the user macros.
+ */
+
+typedef int     (*Z80_COMPILED_FUNCTION) (Z80_STATE *state, 
+                        int *pc, int *r, 
+                        int elapsed_cycles, int *number_cycles,
+                        void *context);
+
+typedef struct Z80_COMPILED_BLOCK {
+
+        int                     address, count;
+        Z80_COMPILED_FUNCTION   function;
+
+} Z80_COMPILED_BLOCK;
+
+/* Have the block cache run compiled functions instead of the blocks they 
+ * were compiled from. blocks must be sorted by address and stay valid as long
+ * as they are set. A compiled block is only used if the block decoded at its
+ * address still has count instructions. The cache is flushed.
+ */
+
+extern void     Z80SetCompiledBlocks (Z80_CACHE *cache, 
+                        const Z80_COMPILED_BLOCK *blocks, 
+                        int count);
+
 #ifdef __cplusplus
 }
 #endif
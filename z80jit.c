@@ -0,0 +1,1956 @@
+/* z80jit.c
+ * Translation of the blocks of the block cache to x86-64 code, see Z80_JIT in
+ * z80config.h.
+ *
+ * A translated block is a Z80_COMPILED_FUNCTION. Registers stay in Z80_STATE
+ * and are read and written where the handlers of emulate() would, and F is
+ * computed from the host flags of the same operation, since they line up
+ * with the Z80's. The memory and input/output user macros are run by the
+ * helper functions below, so that bank switches and NMIs stop a block after
+ * the instruction that caused them, as in emulate(). Each translated block
+ * is listed in /tmp/perf-<pid>.map for perf to name it.
+ */
+
+#include "z80emu.h"
+#include "z80jit.h"
+
+#ifdef Z80_JIT
+
+#if defined(__x86_64__) && !defined(Z80_BIG_ENDIAN) \
+        && !defined(Z80_DOCUMENTED_FLAGS_ONLY)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "z80user.h"
+#include "instructions.h"
+#include "macros.h"
+#include "tables.h"
+#include "encodings.h"
+
+/* Executable memory is allocated once per cache. When it is full, blocks are
+ * left to the interpreter until the cache is flushed.
+ */
+
+#define JIT_ARENA_SIZE          (2 * 1024 * 1024)
+
+struct Z80_TRANSLATIONS {
+
+        unsigned char   *arena;
+        size_t          used;
+        int             full;
+        FILE            *perf_map;
+
+};
+
+/* Code being emitted for a block. cycles and r are counted since the start of
+ * the block, and checked is set once an instruction has run a user macro
+ * that may stop the emulation. Exits taken when one does are emitted after
+ * the block's code.
+ */
+
+typedef struct JIT_EXIT {
+
+        unsigned char   *jump;
+        int             pc, cycles, r;
+
+} JIT_EXIT;
+
+typedef struct JIT_CODE {
+
+        unsigned char   *p, *end;
+        int             overflow;
+        int             cycles, r, checked;
+        JIT_EXIT        exits[Z80_MAXIMUM_BLOCK_INSTRUCTIONS];
+        int             exit_count;
+
+} JIT_CODE;
+
+/* Host registers. rbx holds state, rbp pc, r12 r, r13 number_cycles, r14d
+ * elapsed_cycles on entry, and r15 context. The others are scratch.
+ */
+
+enum {
+
+        RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+        R8, R9, R10, R11, R12, R13, R14, R15
+
+};
+
+/* Operations of the 0x81 and 0x83 opcodes, the register forms of each are
+ * 8 * operation + 1, and their byte forms 8 * operation.
+ */
+
+enum {
+
+        HOST_ADD, HOST_OR, HOST_ADC, HOST_SBB,
+        HOST_AND, HOST_SUB, HOST_XOR, HOST_CMP
+
+};
+
+enum {
+
+        HOST_SHL = 4,
+        HOST_SHR = 5
+
+};
+
+/* Condition codes of the Jcc instructions. */
+
+enum {
+
+        HOST_JZ = 0x4,
+        HOST_JNZ = 0x5,
+        HOST_JGE = 0xd
+
+};
+
+#define OFFSET(index)           ((int) offsetof(Z80_STATE, registers)   \
+                                        + (index))
+#define WORD_OFFSET(index)      ((int) offsetof(Z80_STATE, registers)   \
+                                        + 2 * (index))
+#define ALTERNATE_OFFSET(index) ((int) offsetof(Z80_STATE, alternates)  \
+                                        + 2 * (index))
+
+/* Address of a helper called by the generated code. */
+
+#define HELPER(function)        ((uint64_t) (uintptr_t) (function))
+
+/* pc of an exit taken from ecx rather than a constant. */
+
+#define PC_IN_ECX               INT_MIN
+
+/* Helpers running the user macros. They have the variables that the macros
+ * use, but elapsed_cycles, which is only precise up to the block's start.
+ */
+
+static int jit_read_byte (void *context, int address,
+        int *number_cycles_,
+        Z80_STATE *state)
+{
+        int     number_cycles, x;
+
+        number_cycles = *number_cycles_;
+        Z80_READ_BYTE(address, x);
+        *number_cycles_ = number_cycles;
+        (void) state;
+
+        return x;
+}
+
+static int jit_read_word (void *context, int address,
+        int *number_cycles_,
+        Z80_STATE *state)
+{
+        int     number_cycles, x;
+
+        number_cycles = *number_cycles_;
+        Z80_READ_WORD(address, x);
+        *number_cycles_ = number_cycles;
+        (void) state;
+
+        return x;
+}
+
+static void jit_write_byte (void *context, int address, int x,
+        int *number_cycles_,
+        Z80_STATE *state)
+{
+        int     number_cycles;
+
+        number_cycles = *number_cycles_;
+        Z80_WRITE_BYTE(address, x);
+        *number_cycles_ = number_cycles;
+        (void) state;
+}
+
+static void jit_write_word (void *context, int address, int x,
+        int *number_cycles_,
+        Z80_STATE *state)
+{
+        int     number_cycles;
+
+        number_cycles = *number_cycles_;
+        Z80_WRITE_WORD(address, x);
+        *number_cycles_ = number_cycles;
+        (void) state;
+}
+
+static int jit_input_byte (void *context, int port,
+        int *number_cycles_,
+        Z80_STATE *state)
+{
+        int     number_cycles, x;
+
+        number_cycles = *number_cycles_;
+        Z80_INPUT_BYTE(port, x);
+        *number_cycles_ = number_cycles;
+        (void) state;
+
+        return x;
+}
+
+static void jit_output_byte (void *context, int port, int x,
+        int *number_cycles_,
+        Z80_STATE *state)
+{
+        int     number_cycles;
+
+        number_cycles = *number_cycles_;
+        Z80_OUTPUT_BYTE(port, x);
+        *number_cycles_ = number_cycles;
+        (void) state;
+}
+
+#ifdef Z80_HLE
+
+/* Run once a taken CALL has set *pc and *r, returns the new elapsed_cycles.*/
+
+static int jit_hle_routine (void *context, int *pc_, int *r_,
+        int elapsed_cycles,
+        Z80_STATE *state)
+{
+        int     pc, r;
+
+        pc = *pc_;
+        r = *r_;
+        Z80_HLE_ROUTINE();
+        *pc_ = pc;
+        *r_ = r;
+
+        return elapsed_cycles;
+}
+
+#endif
+
+/* DAA is left to C, its flags don't follow the host's. */
+
+static void jit_daa (Z80_STATE *state)
+{
+        int     a, c, d;
+
+        a = A;
+        if (a > 0x99 || (F_REGISTER & Z80_C_FLAG)) {
+
+                c = Z80_C_FLAG;
+                d = 0x60;
+
+        } else
+
+                c = d = 0;
+
+        if ((a & 0x0f) > 0x09 || (F_REGISTER & Z80_H_FLAG))
+
+                d += 0x06;
+
+        A += F_REGISTER & Z80_N_FLAG ? -d : +d;
+        F_REGISTER = SZYXP_FLAGS_TABLE[A]
+                | ((A ^ a) & Z80_H_FLAG)
+                | (F_REGISTER & Z80_N_FLAG)
+                | c;
+}
+
+/* Instruction encoding. */
+
+static void emit (JIT_CODE *code, int byte)
+{
+        if (code->p < code->end)
+
+                *code->p++ = byte;
+
+        else
+
+                code->overflow = 1;
+}
+
+static void emit_bytes (JIT_CODE *code, int count, ...)
+{
+        va_list arguments;
+
+        va_start(arguments, count);
+        while (count--)
+
+                emit(code, va_arg(arguments, int));
+
+        va_end(arguments);
+}
+
+static void emit_32 (JIT_CODE *code, int x)
+{
+        emit_bytes(code, 4, x & 0xff, (x >> 8) & 0xff,
+                (x >> 16) & 0xff, (x >> 24) & 0xff);
+}
+
+static void emit_64 (JIT_CODE *code, uint64_t x)
+{
+        emit_32(code, (int) (x & 0xffffffff));
+        emit_32(code, (int) (x >> 32));
+}
+
+static void emit_rex (JIT_CODE *code, int w, int reg, int rm)
+{
+        int     rex;
+
+        rex = (w ? 8 : 0) | (reg & 8 ? 4 : 0) | (rm & 8 ? 1 : 0);
+        if (rex)
+
+                emit(code, 0x40 | rex);
+}
+
+static void emit_opcode (JIT_CODE *code, int opcode)
+{
+        if (opcode > 0xff)
+
+                emit(code, opcode >> 8);
+
+        emit(code, opcode & 0xff);
+}
+
+/* Instruction with the registers reg and rm as operands, or the operation reg
+ * on rm. Byte registers must be al, cl, or dl.
+ */
+
+static void emit_rr (JIT_CODE *code, int prefix, int w,
+        int opcode,
+        int reg, int rm)
+{
+        if (prefix)
+
+                emit(code, prefix);
+
+        emit_rex(code, w, reg, rm);
+        emit_opcode(code, opcode);
+        emit(code, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+/* Same as emit_rr() with the state member at offset as rm. */
+
+static void emit_rm (JIT_CODE *code, int prefix,
+        int opcode,
+        int reg, int offset)
+{
+        if (prefix)
+
+                emit(code, prefix);
+
+        emit_rex(code, 0, reg, RBX);
+        emit_opcode(code, opcode);
+        if (offset >= -128 && offset < 128) {
+
+                emit(code, 0x40 | (reg & 7) << 3 | RBX);
+                emit(code, offset & 0xff);
+
+        } else {
+
+                emit(code, 0x80 | (reg & 7) << 3 | RBX);
+                emit_32(code, offset);
+
+        }
+}
+
+static void emit_load_byte (JIT_CODE *code, int reg, int offset)
+{
+        emit_rm(code, 0, 0x0fb6, reg, offset);
+}
+
+static void emit_load_word (JIT_CODE *code, int reg, int offset)
+{
+        emit_rm(code, 0, 0x0fb7, reg, offset);
+}
+
+static void emit_store_byte (JIT_CODE *code, int reg, int offset)
+{
+        emit_rm(code, 0, 0x88, reg, offset);
+}
+
+static void emit_store_word (JIT_CODE *code, int reg, int offset)
+{
+        emit_rm(code, 0x66, 0x89, reg, offset);
+}
+
+static void emit_store_byte_immediate (JIT_CODE *code, int offset, int n)
+{
+        emit_rm(code, 0, 0xc6, 0, offset);
+        emit(code, n & 0xff);
+}
+
+static void emit_store_word_immediate (JIT_CODE *code, int offset, int nn)
+{
+        emit_rm(code, 0x66, 0xc7, 0, offset);
+        emit_bytes(code, 2, nn & 0xff, (nn >> 8) & 0xff);
+}
+
+static void emit_mov (JIT_CODE *code, int to, int from)
+{
+        emit_rr(code, 0, 0, 0x89, from, to);
+}
+
+static void emit_mov_64 (JIT_CODE *code, int to, int from)
+{
+        emit_rr(code, 0, 1, 0x89, from, to);
+}
+
+static void emit_mov_immediate (JIT_CODE *code, int reg, int n)
+{
+        emit_rex(code, 0, 0, reg);
+        emit(code, 0xb8 + (reg & 7));
+        emit_32(code, n);
+}
+
+static void emit_alu (JIT_CODE *code, int operation, int to, int from)
+{
+        emit_rr(code, 0, 0, 8 * operation + 1, from, to);
+}
+
+static void emit_alu_byte (JIT_CODE *code, int operation, int to, int from)
+{
+        emit_rr(code, 0, 0, 8 * operation, from, to);
+}
+
+static void emit_alu_word (JIT_CODE *code, int operation, int to, int from)
+{
+        emit_rr(code, 0x66, 0, 8 * operation + 1, from, to);
+}
+
+static void emit_alu_immediate (JIT_CODE *code,
+        int operation,
+        int reg, int n)
+{
+        if (n >= -128 && n < 128) {
+
+                emit_rr(code, 0, 0, 0x83, operation, reg);
+                emit(code, n & 0xff);
+
+        } else {
+
+                emit_rr(code, 0, 0, 0x81, operation, reg);
+                emit_32(code, n);
+
+        }
+}
+
+static void emit_shift (JIT_CODE *code, int operation, int reg, int n)
+{
+        emit_rr(code, 0, 0, 0xc1, operation, reg);
+        emit(code, n);
+}
+
+/* Copy reg to or from the spare stack slot. */
+
+static void emit_save (JIT_CODE *code, int reg)
+{
+        emit_rex(code, 0, reg, 0);
+        emit_bytes(code, 3, 0x89, 0x04 | (reg & 7) << 3, 0x24);
+}
+
+static void emit_restore (JIT_CODE *code, int reg)
+{
+        emit_rex(code, 0, reg, 0);
+        emit_bytes(code, 3, 0x8b, 0x04 | (reg & 7) << 3, 0x24);
+}
+
+/* Forward jump, to be patched by emit_label(). */
+
+static unsigned char *emit_jump (JIT_CODE *code, int condition)
+{
+        if (condition < 0)
+
+                emit(code, 0xe9);
+
+        else
+
+                emit_bytes(code, 2, 0x0f, 0x80 | condition);
+
+        emit_32(code, 0);
+
+        return code->p - 4;
+}
+
+static void emit_label (JIT_CODE *code, unsigned char *jump)
+{
+        int     displacement;
+
+        if (code->overflow)
+
+                return;
+
+        displacement = (int) (code->p - (jump + 4));
+        jump[0] = displacement & 0xff;
+        jump[1] = (displacement >> 8) & 0xff;
+        jump[2] = (displacement >> 16) & 0xff;
+        jump[3] = (displacement >> 24) & 0xff;
+}
+
+static void emit_call (JIT_CODE *code, uint64_t function)
+{
+        emit_bytes(code, 2, 0x48, 0xb8);
+        emit_64(code, function);
+        emit_bytes(code, 2, 0xff, 0xd0);
+}
+
+/* Call a memory or input/output helper, with the address or port in esi and
+ * the value to write in edx. The result is in eax.
+ */
+
+static void emit_read (JIT_CODE *code, uint64_t function)
+{
+        emit_mov_64(code, RDI, R15);
+        emit_mov_64(code, RDX, R13);
+        emit_mov_64(code, RCX, RBX);
+        emit_call(code, function);
+        code->checked = 1;
+}
+
+static void emit_write (JIT_CODE *code, uint64_t function)
+{
+        emit_mov_64(code, RDI, R15);
+        emit_mov_64(code, RCX, R13);
+        emit_mov_64(code, R8, RBX);
+        emit_call(code, function);
+        code->checked = 1;
+}
+
+/* Set F to the flags of the host operation that has just been run: the host
+ * flags in mask, the overflow flag as P/V if overflow is set, Y and X from
+ * the yx register, or from extra, and the bits of constant. yx and extra may
+ * be -1, but not edx or esi, which are clobbered.
+ */
+
+static void emit_flags (JIT_CODE *code,
+        int mask, int overflow,
+        int yx, int extra, int constant)
+{
+        emit_bytes(code, 2, 0x9c, 0x5a);        /* pushfq, pop rdx */
+        if (overflow) {
+
+                emit_mov(code, RSI, RDX);
+                emit_shift(code, HOST_SHR, RSI, 11 - Z80_V_FLAG_SHIFT);
+                emit_alu_immediate(code, HOST_AND, RSI, Z80_V_FLAG);
+
+        }
+        emit_alu_immediate(code, HOST_AND, RDX, mask);
+        if (overflow)
+
+                emit_alu(code, HOST_OR, RDX, RSI);
+
+        if (yx >= 0) {
+
+                emit_mov(code, RSI, yx);
+                emit_alu_immediate(code, HOST_AND, RSI, YX_FLAGS);
+                emit_alu(code, HOST_OR, RDX, RSI);
+
+        }
+        if (extra >= 0)
+
+                emit_alu(code, HOST_OR, RDX, extra);
+
+        if (constant)
+
+                emit_alu_immediate(code, HOST_OR, RDX, constant);
+
+        emit_store_byte(code, RDX, OFFSET(Z80_F));
+}
+
+/* Set esi to the address of an (IX + d) or (IY + d) operand. */
+
+static void emit_indexed_address (JIT_CODE *code, int offset, int d)
+{
+        emit_load_word(code, RSI, offset);
+        if (d)
+
+                emit_alu_immediate(code, HOST_ADD, RSI, d);
+}
+
+/* Jump if condition cc of the Z80, as encoded in opcodes, is false. */
+
+static unsigned char *emit_unless (JIT_CODE *code, int cc)
+{
+        emit_rm(code, 0, 0xf6, 0, OFFSET(Z80_F));
+        emit(code, AND_CONDITION_TABLE[cc]);
+
+        return emit_jump(code, XOR_CONDITION_TABLE[cc] ? HOST_JNZ : HOST_JZ);
+}
+
+static void emit_prologue (JIT_CODE *code)
+{
+        emit_bytes(code, 10,
+                0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57);
+        emit_bytes(code, 4, 0x48, 0x83, 0xec, 0x08);
+        emit_mov_64(code, RBX, RDI);
+        emit_mov_64(code, RBP, RSI);
+        emit_mov_64(code, R12, RDX);
+        emit_mov(code, R14, RCX);
+        emit_mov_64(code, R13, R8);
+        emit_mov_64(code, R15, R9);
+}
+
+/* Set *pc to pc, or to ecx for PC_IN_ECX, and add r to *r. */
+
+static void emit_leave (JIT_CODE *code, int pc, int r)
+{
+        if (pc != PC_IN_ECX) {
+
+                emit_bytes(code, 3, 0xc7, 0x45, 0x00);
+                emit_32(code, pc);
+
+        } else
+
+                emit_bytes(code, 3, 0x89, 0x4d, 0x00);
+
+        if (r) {
+
+                emit_bytes(code, 4, 0x41, 0x81, 0x04, 0x24);
+                emit_32(code, r);
+
+        }
+}
+
+/* Return the elapsed_cycles of the entry plus cycles. */
+
+static void emit_return (JIT_CODE *code, int cycles)
+{
+        emit_bytes(code, 3, 0x41, 0x8d, 0x86);
+        emit_32(code, cycles);
+        emit_bytes(code, 4, 0x48, 0x83, 0xc4, 0x08);
+        emit_bytes(code, 11,
+                0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5d, 0x5b,
+                0xc3);
+}
+
+static void emit_exit (JIT_CODE *code, int pc, int cycles)
+{
+        emit_leave(code, pc, code->r);
+        emit_return(code, code->cycles + cycles);
+}
+
+/* Leave the block after the current instruction if a user macro has lowered
+ * number_cycles, as CONTINUE_BLOCK does.
+ */
+
+static void emit_check (JIT_CODE *code, int pc)
+{
+        JIT_EXIT        *exit;
+
+        emit_bytes(code, 3, 0x41, 0x8d, 0x86);
+        emit_32(code, code->cycles);
+        emit_bytes(code, 4, 0x41, 0x3b, 0x45, 0x00);
+        exit = &code->exits[code->exit_count++];
+        exit->jump = emit_jump(code, HOST_JGE);
+        exit->pc = pc;
+        exit->cycles = code->cycles;
+        exit->r = code->r;
+}
+
+/* Push the word in edx, and leave esi on the new SP. */
+
+static void emit_push (JIT_CODE *code)
+{
+        emit_load_word(code, RSI, WORD_OFFSET(Z80_SP));
+        emit_alu_immediate(code, HOST_SUB, RSI, 2);
+        emit_store_word(code, RSI, WORD_OFFSET(Z80_SP));
+        emit_write(code, HELPER(jit_write_word));
+}
+
+/* Pop a word into eax. */
+
+static void emit_pop (JIT_CODE *code)
+{
+        emit_load_word(code, RSI, WORD_OFFSET(Z80_SP));
+        emit_read(code, HELPER(jit_read_word));
+        emit_rm(code, 0x66, 0x83, HOST_ADD, WORD_OFFSET(Z80_SP));
+        emit(code, 2);
+}
+
+/* Taken CALL or RST: push return, and leave the block at target. */
+
+static void emit_call_exit (JIT_CODE *code, int target, int return_address,
+        int cycles,
+        int hle)
+{
+        emit_mov_immediate(code, RDX, return_address);
+        emit_push(code);
+        if (hle) {
+
+#ifdef Z80_HLE
+
+                emit_leave(code, target, code->r);
+                emit_mov_64(code, RDI, R15);
+                emit_mov_64(code, RSI, RBP);
+                emit_mov_64(code, RDX, R12);
+                emit_bytes(code, 3, 0x41, 0x8d, 0x8e);
+                emit_32(code, code->cycles + cycles);
+                emit_mov_64(code, R8, RBX);
+                emit_call(code, HELPER(jit_hle_routine));
+                emit_bytes(code, 4, 0x48, 0x83, 0xc4, 0x08);
+                emit_bytes(code, 11,
+                        0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c,
+                        0x5d, 0x5b, 0xc3);
+
+                return;
+
+#endif
+
+        }
+        emit_exit(code, target, cycles);
+}
+
+/* Rotate or shift eax as the 0xcb prefixed instruction y does, and set F. */
+
+static void emit_rotate (JIT_CODE *code, int y)
+{
+        emit_mov(code, RCX, RAX);
+        if (y & 1) {
+
+                /* Right: carry from bit 0. */
+
+                emit_alu_immediate(code, HOST_AND, RCX, 1);
+                if (y == 5) {
+
+                        emit_mov(code, RDX, RAX);
+                        emit_alu_immediate(code, HOST_AND, RDX, 0x80);
+
+                } else if (y == 1) {
+
+                        emit_mov(code, RDX, RCX);
+                        emit_shift(code, HOST_SHL, RDX, 7);
+
+                } else if (y == 3) {
+
+                        emit_load_byte(code, RDX, OFFSET(Z80_F));
+                        emit_alu_immediate(code, HOST_AND, RDX, Z80_C_FLAG);
+                        emit_shift(code, HOST_SHL, RDX, 7);
+
+                }
+                emit_shift(code, HOST_SHR, RAX, 1);
+                if (y != 7)
+
+                        emit_alu(code, HOST_OR, RAX, RDX);
+
+        } else {
+
+                /* Left: carry from bit 7. */
+
+                emit_shift(code, HOST_SHR, RCX, 7);
+                emit_alu(code, HOST_ADD, RAX, RAX);
+                if (y == 0)
+
+                        emit_alu(code, HOST_OR, RAX, RCX);
+
+                else if (y == 2) {
+
+                        emit_load_byte(code, RDX, OFFSET(Z80_F));
+                        emit_alu_immediate(code, HOST_AND, RDX, Z80_C_FLAG);
+                        emit_alu(code, HOST_OR, RAX, RDX);
+
+                } else if (y == 6)
+
+                        emit_alu_immediate(code, HOST_OR, RAX, 1);
+
+        }
+        emit_bytes(code, 2, 0x84, 0xc0);        /* test al, al */
+        emit_flags(code, SZ_FLAGS | Z80_P_FLAG, 0, RAX, RCX, 0);
+}
+
+/* Operation y of the 8-bit arithmetic and logical group, in opcode order,
+ * on A and ecx.
+ */
+
+static void emit_arithmetic (JIT_CODE *code, int y)
+{
+        static const int        OPERATIONS[8] = {
+
+                HOST_ADD, HOST_ADC, HOST_SUB, HOST_SBB,
+                HOST_AND, HOST_XOR, HOST_OR, HOST_CMP
+
+        };
+
+        emit_load_byte(code, RAX, OFFSET(Z80_A));
+        if (y == 1 || y == 3) {
+
+                /* shr edx, 1 leaves the Z80's carry in the host's. */
+
+                emit_load_byte(code, RDX, OFFSET(Z80_F));
+                emit_rr(code, 0, 0, 0xd1, HOST_SHR, RDX);
+
+        }
+        emit_alu_byte(code, OPERATIONS[y], RAX, RCX);
+        if (y < 4 || y == 7)
+
+                emit_flags(code, SZ_FLAGS | Z80_H_FLAG | Z80_C_FLAG, 1,
+                        y == 7 ? RCX : RAX, -1,
+                        y >= 2 ? Z80_N_FLAG : 0);
+
+        else
+
+                emit_flags(code, SZ_FLAGS | Z80_P_FLAG, 0, RAX, -1,
+                        y == 4 ? Z80_H_FLAG : 0);
+
+        if (y != 7)
+
+                emit_store_byte(code, RAX, OFFSET(Z80_A));
+}
+
+/* INC or DEC on eax, and set F. */
+
+static void emit_increment (JIT_CODE *code, int decrement)
+{
+        emit_load_byte(code, RCX, OFFSET(Z80_F));
+        emit_alu_immediate(code, HOST_AND, RCX, Z80_C_FLAG);
+        emit_bytes(code, 2, 0xfe, decrement ? 0xc8 : 0xc0);
+        emit_flags(code, SZ_FLAGS | Z80_H_FLAG, 1, RAX, RCX,
+                decrement ? Z80_N_FLAG : 0);
+}
+
+/* BIT y on eax, Y and X are taken from ecx. */
+
+static void emit_bit (JIT_CODE *code, int y)
+{
+        emit_alu_immediate(code, HOST_AND, RCX, YX_FLAGS);
+        emit_alu_immediate(code, HOST_AND, RAX, 1 << y);
+        emit_mov(code, RDX, RAX);
+        emit_alu_immediate(code, HOST_AND, RDX, Z80_S_FLAG);
+        emit_alu(code, HOST_OR, RDX, RCX);
+        emit_alu_immediate(code, HOST_CMP, RAX, 1);
+        emit_alu(code, HOST_SBB, RAX, RAX);
+        emit_alu_immediate(code, HOST_AND, RAX, Z80_Z_FLAG | Z80_P_FLAG);
+        emit_alu(code, HOST_OR, RDX, RAX);
+        emit_load_byte(code, RCX, OFFSET(Z80_F));
+        emit_alu_immediate(code, HOST_AND, RCX, Z80_C_FLAG);
+        emit_alu(code, HOST_OR, RDX, RCX);
+        emit_alu_immediate(code, HOST_OR, RDX, Z80_H_FLAG);
+        emit_store_byte(code, RDX, OFFSET(Z80_F));
+}
+
+/* Read-modify-write of the byte at esi for INC, DEC, and the 0xcb prefixed
+ * instructions.
+ */
+
+static void emit_modify (JIT_CODE *code, int instruction, int opcode)
+{
+        emit_save(code, RSI);
+        emit_read(code, HELPER(jit_read_byte));
+        switch (instruction) {
+
+                case INC_INDIRECT_HL:
+                case INC_INDEXED:
+                case DEC_INDIRECT_HL:
+                case DEC_INDEXED: {
+
+                        emit_increment(code, instruction == DEC_INDIRECT_HL
+                                || instruction == DEC_INDEXED);
+                        break;
+
+                }
+
+                case SET_B_INDIRECT_HL:
+                case SET_B_INDEXED: {
+
+                        emit_alu_immediate(code, HOST_OR, RAX,
+                                1 << Y(opcode));
+                        break;
+
+                }
+
+                case RES_B_INDIRECT_HL:
+                case RES_B_INDEXED: {
+
+                        emit_alu_immediate(code, HOST_AND, RAX,
+                                ~(1 << Y(opcode)));
+                        break;
+
+                }
+
+                default: {
+
+                        emit_rotate(code, Y(opcode));
+                        break;
+
+                }
+
+        }
+        emit_mov(code, RDX, RAX);
+        emit_restore(code, RSI);
+        emit_write(code, HELPER(jit_write_byte));
+}
+
+static int fetch_byte (int address, void *context)
+{
+        int     x;
+
+        Z80_FETCH_BYTE(address, x);
+
+        return x;
+}
+
+static int fetch_word (int address, void *context)
+{
+        int     x;
+
+        Z80_FETCH_WORD(address, x);
+
+        return x;
+}
+
+/* Emit instruction, and return the address of the next one, or -1 if it
+ * can't be translated. Only the last instruction of a block may transfer
+ * control, it leaves the block itself.
+ */
+
+static int translate_instruction (JIT_CODE *code,
+        const Z80_STATE *state,
+        const Z80_BLOCK_INSTRUCTION *instruction,
+        void *context)
+{
+        void * const    *registers;
+        const char      *base;
+        int             opcode, operand, next, offset, d, n;
+        unsigned char   *jump;
+
+        base = (const char *) state;
+        registers = instruction->prefix == 0xdd
+                || instruction->prefix == 0xddcb
+                ? state->dd_register_table
+                : instruction->prefix == 0xfd
+                || instruction->prefix == 0xfdcb
+                ? state->fd_register_table
+                : state->register_table;
+
+#define REGISTER(index)         ((int) ((const char *) registers[(index)] \
+                                        - base))
+#define SINGLE_REGISTER(index)  ((int) ((const char *)                  \
+                                        state->register_table[(index)]  \
+                                        - base))
+
+        opcode = instruction->opcode;
+        operand = instruction->address + instruction->length;
+        code->cycles += instruction->cycles;
+        code->r += instruction->r;
+        next = operand;
+        switch (instruction->instruction) {
+
+                /* 8-bit load group. */
+
+                case LD_R_R: {
+
+                        emit_load_byte(code, RAX, REGISTER(Z(opcode)));
+                        emit_store_byte(code, RAX, REGISTER(Y(opcode)));
+                        break;
+
+                }
+
+                case LD_R_N: {
+
+                        emit_store_byte_immediate(code, REGISTER(Y(opcode)),
+                                fetch_byte(operand, context));
+                        code->cycles += 3;
+                        next++;
+                        break;
+
+                }
+
+                case LD_R_INDIRECT_HL: {
+
+                        emit_load_word(code, RSI, WORD_OFFSET(Z80_HL));
+                        emit_read(code, HELPER(jit_read_byte));
+                        emit_store_byte(code, RAX, REGISTER(Y(opcode)));
+                        code->cycles += 3;
+                        break;
+
+                }
+
+                case LD_R_INDEXED: {
+
+                        d = (signed char) fetch_byte(operand, context);
+                        emit_indexed_address(code, REGISTER(6), d);
+                        emit_read(code, HELPER(jit_read_byte));
+                        emit_store_byte(code, RAX, SINGLE_REGISTER(Y(opcode)));
+                        code->cycles += 3 + 3 + 5;
+                        next++;
+                        break;
+
+                }
+
+                case LD_INDIRECT_HL_R: {
+
+                        emit_load_word(code, RSI, WORD_OFFSET(Z80_HL));
+                        emit_load_byte(code, RDX, REGISTER(Z(opcode)));
+                        emit_write(code, HELPER(jit_write_byte));
+                        code->cycles += 3;
+                        break;
+
+                }
+
+                case LD_INDEXED_R: {
+
+                        d = (signed char) fetch_byte(operand, context);
+                        emit_indexed_address(code, REGISTER(6), d);
+                        emit_load_byte(code, RDX, SINGLE_REGISTER(Z(opcode)));
+                        emit_write(code, HELPER(jit_write_byte));
+                        code->cycles += 3 + 3 + 5;
+                        next++;
+                        break;
+
+                }
+
+                case LD_INDIRECT_HL_N: {
+
+                        emit_load_word(code, RSI, WORD_OFFSET(Z80_HL));
+                        emit_mov_immediate(code, RDX,
+                                fetch_byte(operand, context));
+                        emit_write(code, HELPER(jit_write_byte));
+                        code->cycles += 3 + 3;
+                        next++;
+                        break;
+
+                }
+
+                case LD_INDEXED_N: {
+
+                        d = (signed char) fetch_byte(operand, context);
+                        emit_indexed_address(code, REGISTER(6), d);
+                        emit_mov_immediate(code, RDX,
+                                fetch_byte(operand + 1, context));
+                        emit_write(code, HELPER(jit_write_byte));
+                        code->cycles += 3 + 3 + 3 + 2;
+                        next += 2;
+                        break;
+
+                }
+
+                case LD_A_INDIRECT_BC:
+                case LD_A_INDIRECT_DE: {
+
+                        emit_load_word(code, RSI,
+                                WORD_OFFSET(instruction->instruction
+                                        == LD_A_INDIRECT_BC
+                                        ? Z80_BC
+                                        : Z80_DE));
+                        emit_read(code, HELPER(jit_read_byte));
+                        emit_store_byte(code, RAX, OFFSET(Z80_A));
+                        code->cycles += 3;
+                        break;
+
+                }
+
+                case LD_A_INDIRECT_NN: {
+
+                        emit_mov_immediate(code, RSI,
+                                fetch_word(operand, context));
+                        emit_read(code, HELPER(jit_read_byte));
+                        emit_store_byte(code, RAX, OFFSET(Z80_A));
+                        code->cycles += 6 + 3;
+                        next += 2;
+                        break;
+
+                }
+
+                case LD_INDIRECT_BC_A:
+                case LD_INDIRECT_DE_A: {
+
+                        emit_load_word(code, RSI,
+                                WORD_OFFSET(instruction->instruction
+                                        == LD_INDIRECT_BC_A
+                                        ? Z80_BC
+                                        : Z80_DE));
+                        emit_load_byte(code, RDX, OFFSET(Z80_A));
+                        emit_write(code, HELPER(jit_write_byte));
+                        code->cycles += 3;
+                        break;
+
+                }
+
+                case LD_INDIRECT_NN_A: {
+
+                        emit_mov_immediate(code, RSI,
+                                fetch_word(operand, context));
+                        emit_load_byte(code, RDX, OFFSET(Z80_A));
+                        emit_write(code, HELPER(jit_write_byte));
+                        code->cycles += 6 + 3;
+                        next += 2;
+                        break;
+
+                }
+
+                /* 16-bit load group. */
+
+                case LD_RR_NN: {
+
+                        emit_store_word_immediate(code,
+                                REGISTER(P(opcode) + 8),
+                                fetch_word(operand, context));
+                        code->cycles += 6;
+                        next += 2;
+                        break;
+
+                }
+
+                case LD_HL_INDIRECT_NN:
+                case LD_RR_INDIRECT_NN: {
+
+                        offset = instruction->instruction == LD_HL_INDIRECT_NN
+                                ? REGISTER(6)
+                                : REGISTER(P(opcode) + 8);
+                        emit_mov_immediate(code, RSI,
+                                fetch_word(operand, context));
+                        emit_read(code, HELPER(jit_read_word));
+                        emit_store_word(code, RAX, offset);
+                        code->cycles += 6 + 6;
+                        next += 2;
+                        break;
+
+                }
+
+                case LD_INDIRECT_NN_HL:
+                case LD_INDIRECT_NN_RR: {
+
+                        offset = instruction->instruction == LD_INDIRECT_NN_HL
+                                ? REGISTER(6)
+                                : REGISTER(P(opcode) + 8);
+                        emit_mov_immediate(code, RSI,
+                                fetch_word(operand, context));
+                        emit_load_word(code, RDX, offset);
+                        emit_write(code, HELPER(jit_write_word));
+                        code->cycles += 6 + 6;
+                        next += 2;
+                        break;
+
+                }
+
+                case LD_SP_HL: {
+
+                        emit_load_word(code, RAX, REGISTER(6));
+                        emit_store_word(code, RAX, WORD_OFFSET(Z80_SP));
+                        code->cycles += 2;
+                        break;
+
+                }
+
+                case PUSH_SS: {
+
+                        emit_load_word(code, RDX, REGISTER(P(opcode) + 12));
+                        emit_push(code);
+                        code->cycles += 6 + 1;
+                        break;
+
+                }
+
+                case POP_SS: {
+
+                        emit_pop(code);
+                        emit_store_word(code, RAX, REGISTER(P(opcode) + 12));
+                        code->cycles += 6;
+                        break;
+
+                }
+
+                /* Exchange group. */
+
+                case EX_DE_HL: {
+
+                        emit_load_word(code, RAX, WORD_OFFSET(Z80_DE));
+                        emit_load_word(code, RCX, WORD_OFFSET(Z80_HL));
+                        emit_store_word(code, RCX, WORD_OFFSET(Z80_DE));
+                        emit_store_word(code, RAX, WORD_OFFSET(Z80_HL));
+                        break;
+
+                }
+
+                case EX_AF_AF_PRIME:
+                case EXX: {
+
+                        int     i, first, last;
+
+                        if (instruction->instruction == EX_AF_AF_PRIME)
+
+                                first = last = Z80_AF;
+
+                        else {
+
+                                first = Z80_BC;
+                                last = Z80_HL;
+
+                        }
+                        for (i = first; i <= last; i++) {
+
+                                emit_load_word(code, RAX, WORD_OFFSET(i));
+                                emit_load_word(code, RCX,
+                                        ALTERNATE_OFFSET(i));
+                                emit_store_word(code, RCX, WORD_OFFSET(i));
+                                emit_store_word(code, RAX,
+                                        ALTERNATE_OFFSET(i));
+
+                        }
+                        break;
+
+                }
+
+                case EX_INDIRECT_SP_HL: {
+
+                        emit_load_word(code, RSI, WORD_OFFSET(Z80_SP));
+                        emit_read(code, HELPER(jit_read_word));
+                        emit_save(code, RAX);
+                        emit_load_word(code, RSI, WORD_OFFSET(Z80_SP));
+                        emit_load_word(code, RDX, REGISTER(6));
+                        emit_write(code, HELPER(jit_write_word));
+                        emit_restore(code, RAX);
+                        emit_store_word(code, RAX, REGISTER(6));
+                        code->cycles += 6 + 6 + 3;
+                        break;
+
+                }
+
+                /* 8-bit arithmetic and logical group. */
+
+                case ADD_R:
+                case ADC_R:
+                case SUB_R:
+                case SBC_R:
+                case AND_R:
+                case XOR_R:
+                case OR_R:
+                case CP_R: {
+
+                        emit_load_byte(code, RCX, REGISTER(Z(opcode)));
+                        emit_arithmetic(code, Y(opcode));
+                        break;
+
+                }
+
+                case ADD_N:
+                case ADC_N:
+                case SUB_N:
+                case SBC_N:
+                case AND_N:
+                case XOR_N:
+                case OR_N:
+                case CP_N: {
+
+                        emit_mov_immediate(code, RCX,
+                                fetch_byte(operand, context));
+                        emit_arithmetic(code, Y(opcode));
+                        code->cycles += 3;
+                        next++;
+                        break;
+
+                }
+
+                case ADD_INDIRECT_HL:
+                case ADC_INDIRECT_HL:
+                case SUB_INDIRECT_HL:
+                case SBC_INDIRECT_HL:
+                case AND_INDIRECT_HL:
+                case XOR_INDIRECT_HL:
+                case OR_INDIRECT_HL:
+                case CP_INDIRECT_HL: {
+
+                        emit_load_word(code, RSI, WORD_OFFSET(Z80_HL));
+                        emit_read(code, HELPER(jit_read_byte));
+                        emit_mov(code, RCX, RAX);
+                        emit_arithmetic(code, Y(opcode));
+                        code->cycles += 3;
+                        break;
+
+                }
+
+                case ADD_INDEXED:
+                case ADC_INDEXED:
+                case SUB_INDEXED:
+                case SBC_INDEXED:
+                case AND_INDEXED:
+                case XOR_INDEXED:
+                case OR_INDEXED:
+                case CP_INDEXED: {
+
+                        d = (signed char) fetch_byte(operand, context);
+                        emit_indexed_address(code, REGISTER(6), d);
+                        emit_read(code, HELPER(jit_read_byte));
+                        emit_mov(code, RCX, RAX);
+                        emit_arithmetic(code, Y(opcode));
+                        code->cycles += 3 + 3 + 5;
+                        next++;
+                        break;
+
+                }
+
+                case INC_R:
+                case DEC_R: {
+
+                        emit_load_byte(code, RAX, REGISTER(Y(opcode)));
+                        emit_increment(code,
+                                instruction->instruction == DEC_R);
+                        emit_store_byte(code, RAX, REGISTER(Y(opcode)));
+                        break;
+
+                }
+
+                case INC_INDIRECT_HL:
+                case DEC_INDIRECT_HL: {
+
+                        emit_load_word(code, RSI, WORD_OFFSET(Z80_HL));
+                        emit_modify(code, instruction->instruction, opcode);
+                        code->cycles += 3 + 3 + 1;
+                        break;
+
+                }
+
+                case INC_INDEXED:
+                case DEC_INDEXED: {
+
+                        d = (signed char) fetch_byte(operand, context);
+                        emit_indexed_address(code, REGISTER(6), d);
+                        emit_modify(code, instruction->instruction, opcode);
+                        code->cycles += 3 + 3 + 3 + 6;
+                        next++;
+                        break;
+
+                }
+
+                /* General-purpose arithmetic and CPU control group. */
+
+                case DAA: {
+
+                        emit_mov_64(code, RDI, RBX);
+                        emit_call(code, HELPER(jit_daa));
+                        break;
+
+                }
+
+                case CPL: {
+
+                        emit_load_byte(code, RAX, OFFSET(Z80_A));
+                        emit_alu_immediate(code, HOST_XOR, RAX, 0xff);
+                        emit_store_byte(code, RAX, OFFSET(Z80_A));
+                        emit_load_byte(code, RDX, OFFSET(Z80_F));
+                        emit_alu_immediate(code, HOST_AND, RDX,
+                                SZPV_FLAGS | Z80_C_FLAG);
+                        emit_alu_immediate(code, HOST_AND, RAX, YX_FLAGS);
+                        emit_alu(code, HOST_OR, RDX, RAX);
+                        emit_alu_immediate(code, HOST_OR, RDX,
+                                Z80_H_FLAG | Z80_N_FLAG);
+                        emit_store_byte(code, RDX, OFFSET(Z80_F));
+                        break;
+
+                }
+
+                case NEG: {
+
+                        emit_load_byte(code, RAX, OFFSET(Z80_A));
+                        emit_rr(code, 0, 0, 0xf6, 3, RAX);      /* neg al */
+                        emit_flags(code, SZ_FLAGS | Z80_H_FLAG | Z80_C_FLAG,
+                                1, RAX, -1, Z80_N_FLAG);
+                        emit_store_byte(code, RAX, OFFSET(Z80_A));
+                        break;
+
+                }
+
+                case CCF:
+                case SCF: {
+
+                        emit_load_byte(code, RDX, OFFSET(Z80_F));
+                        if (instruction->instruction == CCF) {
+
+                                emit_mov(code, RCX, RDX);
+                                emit_alu_immediate(code, HOST_AND, RCX,
+                                        Z80_C_FLAG);
+                                emit_alu_immediate(code, HOST_AND, RDX,
+                                        SZPV_FLAGS);
+                                emit_alu(code, HOST_OR, RDX, RCX);
+                                emit_shift(code, HOST_SHL, RCX,
+                                        Z80_H_FLAG_SHIFT);
+                                emit_alu(code, HOST_OR, RDX, RCX);
+                                emit_alu_immediate(code, HOST_XOR, RDX,
+                                        Z80_C_FLAG);
+
+                        } else {
+
+                                emit_alu_immediate(code, HOST_AND, RDX,
+                                        SZPV_FLAGS);
+                                emit_alu_immediate(code, HOST_OR, RDX,
+                                        Z80_C_FLAG);
+
+                        }
+                        emit_load_byte(code, RAX, OFFSET(Z80_A));
+                        emit_alu_immediate(code, HOST_AND, RAX, YX_FLAGS);
+                        emit_alu(code, HOST_OR, RDX, RAX);
+                        emit_store_byte(code, RDX, OFFSET(Z80_F));
+                        break;
+
+                }
+
+                case NOP:
+
+                        break;
+
+                /* 16-bit arithmetic group. */
+
+                case ADD_HL_RR: {
+
+                        offset = REGISTER(6);
+                        emit_load_word(code, RAX, offset);
+                        emit_load_word(code, RCX, REGISTER(P(opcode) + 8));
+                        emit_mov(code, RDI, RAX);
+                        emit_alu(code, HOST_ADD, RAX, RCX);
+                        emit_store_word(code, RAX, offset);
+                        emit_load_byte(code, RDX, OFFSET(Z80_F));
+                        emit_alu_immediate(code, HOST_AND, RDX, SZPV_FLAGS);
+                        emit_alu(code, HOST_XOR, RDI, RCX);
+                        emit_alu(code, HOST_XOR, RDI, RAX);
+                        emit_shift(code, HOST_SHR, RDI, 8);
+                        emit_alu_immediate(code, HOST_AND, RDI, Z80_H_FLAG);
+                        emit_alu(code, HOST_OR, RDX, RDI);
+                        emit_mov(code, RSI, RAX);
+                        emit_shift(code, HOST_SHR, RSI, 8);
+                        emit_alu_immediate(code, HOST_AND, RSI, YX_FLAGS);
+                        emit_alu(code, HOST_OR, RDX, RSI);
+                        emit_shift(code, HOST_SHR, RAX, 16);
+                        emit_alu(code, HOST_OR, RDX, RAX);
+                        emit_store_byte(code, RDX, OFFSET(Z80_F));
+                        code->cycles += 7;
+                        break;
+
+                }
+
+                case ADC_HL_RR:
+                case SBC_HL_RR: {
+
+                        emit_load_word(code, RAX, WORD_OFFSET(Z80_HL));
+                        emit_load_word(code, RCX, REGISTER(P(opcode) + 8));
+                        emit_mov(code, RDI, RAX);
+                        emit_load_byte(code, RDX, OFFSET(Z80_F));
+                        emit_rr(code, 0, 0, 0xd1, HOST_SHR, RDX);
+                        emit_alu_word(code,
+                                instruction->instruction == ADC_HL_RR
+                                        ? HOST_ADC
+                                        : HOST_SBB,
+                                RAX, RCX);
+                        emit_bytes(code, 2, 0x9c, 0x5a);
+                        emit_store_word(code, RAX, WORD_OFFSET(Z80_HL));
+                        emit_mov(code, RSI, RDX);
+                        emit_shift(code, HOST_SHR, RSI,
+                                11 - Z80_V_FLAG_SHIFT);
+                        emit_alu_immediate(code, HOST_AND, RSI, Z80_V_FLAG);
+                        emit_alu_immediate(code, HOST_AND, RDX, SZC_FLAGS);
+                        emit_alu(code, HOST_OR, RDX, RSI);
+                        emit_alu(code, HOST_XOR, RDI, RCX);
+                        emit_alu(code, HOST_XOR, RDI, RAX);
+                        emit_shift(code, HOST_SHR, RDI, 8);
+                        emit_alu_immediate(code, HOST_AND, RDI, Z80_H_FLAG);
+                        emit_alu(code, HOST_OR, RDX, RDI);
+                        emit_shift(code, HOST_SHR, RAX, 8);
+                        emit_alu_immediate(code, HOST_AND, RAX, YX_FLAGS);
+                        emit_alu(code, HOST_OR, RDX, RAX);
+                        if (instruction->instruction == SBC_HL_RR)
+
+                                emit_alu_immediate(code, HOST_OR, RDX,
+                                        Z80_N_FLAG);
+
+                        emit_store_byte(code, RDX, OFFSET(Z80_F));
+                        code->cycles += 7;
+                        break;
+
+                }
+
+                case INC_RR:
+                case DEC_RR: {
+
+                        emit_rm(code, 0x66, 0xff,
+                                instruction->instruction == DEC_RR,
+                                REGISTER(P(opcode) + 8));
+                        code->cycles += 2;
+                        break;
+
+                }
+
+                /* Rotate and shift group. */
+
+                case RLCA:
+                case RLA:
+                case RRCA:
+                case RRA: {
+
+                        emit_load_byte(code, RAX, OFFSET(Z80_A));
+                        emit_load_byte(code, RDX, OFFSET(Z80_F));
+                        emit_mov(code, RCX, RAX);
+                        if (instruction->instruction == RLCA
+                                || instruction->instruction == RLA) {
+
+                                emit_shift(code, HOST_SHR, RCX, 7);
+                                emit_alu(code, HOST_ADD, RAX, RAX);
+                                if (instruction->instruction == RLCA)
+
+                                        emit_alu(code, HOST_OR, RAX, RCX);
+
+                                else {
+
+                                        emit_mov(code, RSI, RDX);
+                                        emit_alu_immediate(code, HOST_AND,
+                                                RSI, Z80_C_FLAG);
+                                        emit_alu(code, HOST_OR, RAX, RSI);
+
+                                }
+
+                        } else {
+
+                                emit_alu_immediate(code, HOST_AND, RCX, 1);
+                                emit_mov(code, RSI,
+                                        instruction->instruction == RRCA
+                                                ? RCX
+                                                : RDX);
+                                emit_alu_immediate(code, HOST_AND, RSI, 1);
+                                emit_shift(code, HOST_SHL, RSI, 7);
+                                emit_shift(code, HOST_SHR, RAX, 1);
+                                emit_alu(code, HOST_OR, RAX, RSI);
+
+                        }
+                        emit_store_byte(code, RAX, OFFSET(Z80_A));
+                        emit_alu_immediate(code, HOST_AND, RDX, SZPV_FLAGS);
+                        emit_alu(code, HOST_OR, RDX, RCX);
+                        emit_alu_immediate(code, HOST_AND, RAX, YX_FLAGS);
+                        emit_alu(code, HOST_OR, RDX, RAX);
+                        emit_store_byte(code, RDX, OFFSET(Z80_F));
+                        break;
+
+                }
+
+                case RLC_R:
+                case RL_R:
+                case RRC_R:
+                case RR_R:
+                case SLA_R:
+                case SLL_R:
+                case SRA_R:
+                case SRL_R: {
+
+                        emit_load_byte(code, RAX, REGISTER(Z(opcode)));
+                        emit_rotate(code, Y(opcode));
+                        emit_store_byte(code, RAX, REGISTER(Z(opcode)));
+                        break;
+
+                }
+
+                case RLC_INDIRECT_HL:
+                case RL_INDIRECT_HL:
+                case RRC_INDIRECT_HL:
+                case RR_INDIRECT_HL:
+                case SLA_INDIRECT_HL:
+                case SLL_INDIRECT_HL:
+                case SRA_INDIRECT_HL:
+                case SRL_INDIRECT_HL:
+                case SET_B_INDIRECT_HL:
+                case RES_B_INDIRECT_HL: {
+
+                        emit_load_word(code, RSI, WORD_OFFSET(Z80_HL));
+                        emit_modify(code, instruction->instruction, opcode);
+                        code->cycles += 3 + 3 + 1;
+                        break;
+
+                }
+
+                /* Only the forms without a register copy are cached. */
+
+                case RLC_INDEXED:
+                case RL_INDEXED:
+                case RRC_INDEXED:
+                case RR_INDEXED:
+                case SLA_INDEXED:
+                case SLL_INDEXED:
+                case SRA_INDEXED:
+                case SRL_INDEXED:
+                case SET_B_INDEXED:
+                case RES_B_INDEXED: {
+
+                        d = (signed char) fetch_byte(operand, context);
+                        emit_indexed_address(code, REGISTER(6), d);
+                        emit_modify(code, instruction->instruction, opcode);
+                        code->cycles += 5 + 3 + 3;
+                        next += 2;
+                        break;
+
+                }
+
+                /* Bit set, reset, and test group. */
+
+                case BIT_B_R: {
+
+                        emit_load_byte(code, RAX, REGISTER(Z(opcode)));
+                        emit_mov(code, RCX, RAX);
+                        emit_bit(code, Y(opcode));
+                        break;
+
+                }
+
+                case BIT_B_INDIRECT_HL: {
+
+                        emit_load_word(code, RSI, WORD_OFFSET(Z80_HL));
+                        emit_read(code, HELPER(jit_read_byte));
+                        emit_load_word(code, RCX, WORD_OFFSET(Z80_HL));
+                        emit_bit(code, Y(opcode));
+                        code->cycles += 1 + 3;
+                        break;
+
+                }
+
+                case BIT_B_INDEXED: {
+
+                        d = (signed char) fetch_byte(operand, context);
+                        emit_indexed_address(code, REGISTER(6), d);
+                        emit_save(code, RSI);
+                        emit_read(code, HELPER(jit_read_byte));
+                        emit_restore(code, RCX);
+                        emit_bit(code, Y(opcode));
+                        code->cycles += 5 + 3;
+                        next += 2;
+                        break;
+
+                }
+
+                case SET_B_R:
+                case RES_B_R: {
+
+                        n = 1 << Y(opcode);
+                        emit_rm(code, 0, 0x80,
+                                instruction->instruction == SET_B_R
+                                        ? HOST_OR
+                                        : HOST_AND,
+                                REGISTER(Z(opcode)));
+                        emit(code, instruction->instruction == SET_B_R
+                                ? n
+                                : ~n & 0xff);
+                        break;
+
+                }
+
+                /* Jump group. */
+
+                case JP_NN: {
+
+                        emit_exit(code, fetch_word(operand, context), 6);
+                        next = -1;
+                        break;
+
+                }
+
+                case JP_CC_NN: {
+
+                        jump = emit_unless(code, Y(opcode));
+                        emit_exit(code, fetch_word(operand, context), 6);
+                        emit_label(code, jump);
+                        emit_exit(code, operand + 2, 6);
+                        next = -1;
+                        break;
+
+                }
+
+                case JR_E: {
+
+                        d = (signed char) fetch_byte(operand, context);
+                        emit_exit(code, operand + 1 + d, 8);
+                        next = -1;
+                        break;
+
+                }
+
+                case JR_DD_E: {
+
+                        d = (signed char) fetch_byte(operand, context);
+                        jump = emit_unless(code, Q(opcode));
+                        emit_exit(code, operand + 1 + d, 8);
+                        emit_label(code, jump);
+                        emit_exit(code, operand + 1, 3);
+                        next = -1;
+                        break;
+
+                }
+
+                case JP_HL: {
+
+                        emit_load_word(code, RCX, REGISTER(6));
+                        emit_exit(code, PC_IN_ECX, 0);
+                        next = -1;
+                        break;
+
+                }
+
+                case DJNZ_E: {
+
+                        d = (signed char) fetch_byte(operand, context);
+                        emit_rm(code, 0, 0xfe, 1, OFFSET(Z80_B));
+                        jump = emit_jump(code, HOST_JZ);
+                        emit_exit(code, operand + 1 + d, 9);
+                        emit_label(code, jump);
+                        emit_exit(code, operand + 1, 4);
+                        next = -1;
+                        break;
+
+                }
+
+                /* Call and return group. */
+
+                case CALL_NN: {
+
+                        emit_call_exit(code, fetch_word(operand, context),
+                                operand + 2,
+                                6 + 6 + 1,
+                                1);
+                        next = -1;
+                        break;
+
+                }
+
+                case CALL_CC_NN: {
+
+                        jump = emit_unless(code, Y(opcode));
+                        emit_call_exit(code, fetch_word(operand, context),
+                                operand + 2,
+                                6 + 6 + 1,
+                                1);
+                        emit_label(code, jump);
+                        emit_exit(code, operand + 2, 6);
+                        next = -1;
+                        break;
+
+                }
+
+                case RET: {
+
+                        emit_pop(code);
+                        emit_mov(code, RCX, RAX);
+                        emit_exit(code, PC_IN_ECX, 6);
+                        next = -1;
+                        break;
+
+                }
+
+                case RET_CC: {
+
+                        jump = emit_unless(code, Y(opcode));
+                        emit_pop(code);
+                        emit_mov(code, RCX, RAX);
+                        emit_exit(code, PC_IN_ECX, 6 + 1);
+                        emit_label(code, jump);
+                        emit_exit(code, operand, 1);
+                        next = -1;
+                        break;
+
+                }
+
+                case RST_P: {
+
+                        emit_call_exit(code, RST_TABLE[Y(opcode)], operand,
+                                6 + 1,
+                                0);
+                        next = -1;
+                        break;
+
+                }
+
+                /* Input and output group. */
+
+                case IN_A_N: {
+
+                        emit_mov_immediate(code, RSI,
+                                fetch_byte(operand, context));
+                        emit_read(code, HELPER(jit_input_byte));
+                        emit_store_byte(code, RAX, OFFSET(Z80_A));
+                        emit_exit(code, operand + 1, 3 + 4);
+                        next = -1;
+                        break;
+
+                }
+
+                case OUT_N_A: {
+
+                        emit_mov_immediate(code, RSI,
+                                fetch_byte(operand, context));
+                        emit_load_byte(code, RDX, OFFSET(Z80_A));
+                        emit_write(code, HELPER(jit_output_byte));
+                        emit_exit(code, operand + 1, 3 + 4);
+                        next = -1;
+                        break;
+
+                }
+
+                default:
+
+                        return -2;
+
+        }
+
+#undef REGISTER
+#undef SINGLE_REGISTER
+
+        return next;
+}
+
+Z80_TRANSLATIONS *Z80JitCreate (void)
+{
+        Z80_TRANSLATIONS        *jit;
+        void                    *arena;
+        char                    name[64];
+
+        arena = mmap(NULL, JIT_ARENA_SIZE,
+                PROT_READ | PROT_WRITE | PROT_EXEC,
+                MAP_PRIVATE | MAP_ANONYMOUS,
+                -1, 0);
+        if (arena == MAP_FAILED)
+
+                return NULL;
+
+        jit = calloc(1, sizeof(Z80_TRANSLATIONS));
+        if (jit == NULL) {
+
+                munmap(arena, JIT_ARENA_SIZE);
+
+                return NULL;
+
+        }
+        jit->arena = arena;
+        sprintf(name, "/tmp/perf-%d.map", (int) getpid());
+        jit->perf_map = fopen(name, "a");
+
+        return jit;
+}
+
+void Z80JitFlush (Z80_TRANSLATIONS *jit)
+{
+        if (jit != NULL) {
+
+                jit->used = 0;
+                jit->full = 0;
+
+        }
+}
+
+void Z80JitDestroy (Z80_TRANSLATIONS *jit)
+{
+        if (jit != NULL) {
+
+                munmap(jit->arena, JIT_ARENA_SIZE);
+                if (jit->perf_map != NULL)
+
+                        fclose(jit->perf_map);
+
+                free(jit);
+
+        }
+}
+
+Z80_COMPILED_FUNCTION Z80JitTranslate (Z80_TRANSLATIONS *jit,
+        const Z80_STATE *state,
+        const Z80_BLOCK_INSTRUCTION *instructions,
+        int count,
+        void *context)
+{
+        JIT_CODE        code;
+        unsigned char   *start;
+        int             i, next;
+
+        if (jit->full || count == 0)
+
+                return NULL;
+
+        start = jit->arena + jit->used;
+        code.p = start;
+        code.end = jit->arena + JIT_ARENA_SIZE;
+        code.overflow = 0;
+        code.cycles = code.r = 0;
+        code.exit_count = 0;
+
+        emit_prologue(&code);
+        next = instructions[0].address;
+        for (i = 0; i < count; i++) {
+
+                code.checked = 0;
+                next = translate_instruction(&code, state, &instructions[i],
+                        context);
+                if (next == -2) {
+
+                        if (i == 0)
+
+                                return NULL;
+
+                        code.cycles -= instructions[i].cycles;
+                        code.r -= instructions[i].r;
+                        next = instructions[i].address;
+                        break;
+
+                }
+                if (next >= 0 && i + 1 < count && code.checked)
+
+                        emit_check(&code, next);
+
+        }
+
+        /* A block cut after Z80_MAXIMUM_BLOCK_INSTRUCTIONS, or before an
+         * instruction left to the interpreter, falls through to next.
+         */
+
+        if (next >= 0)
+
+                emit_exit(&code, next, 0);
+
+        for (i = 0; i < code.exit_count; i++) {
+
+                emit_label(&code, code.exits[i].jump);
+                emit_leave(&code, code.exits[i].pc, code.exits[i].r);
+                emit_return(&code, code.exits[i].cycles);
+
+        }
+        if (code.overflow) {
+
+                jit->full = 1;
+
+                return NULL;
+
+        }
+
+        jit->used = ((code.p - jit->arena) + 15) & ~(size_t) 15;
+        if (jit->perf_map != NULL) {
+
+                fprintf(jit->perf_map, "%lx %lx z80_%04x\n",
+                        (unsigned long) (uintptr_t) start,
+                        (unsigned long) (code.p - start),
+                        instructions[0].address);
+                fflush(jit->perf_map);
+
+        }
+
+        return (Z80_COMPILED_FUNCTION) (uintptr_t) start;
+}
+
+#else
+
+/* Blocks are only translated for x86-64 hosts, and with the undocumented
+ * flags that the host's flags give.
+ */
+
+Z80_TRANSLATIONS *Z80JitCreate (void)
+{
+        return NULL;
+}
+
+void Z80JitFlush (Z80_TRANSLATIONS *jit)
+{
+}
+
+void Z80JitDestroy (Z80_TRANSLATIONS *jit)
+{
+}
+
+Z80_COMPILED_FUNCTION Z80JitTranslate (Z80_TRANSLATIONS *jit,
+        const Z80_STATE *state,
+        const Z80_BLOCK_INSTRUCTION *instructions,
+        int count,
+        void *context)
+{
+        return NULL;
+}
+
+#endif
+
+#endif
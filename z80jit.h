@@ -0,0 +1,48 @@
+/* z80jit.h
+ * Translation of blocks of the block cache to x86-64 code, see Z80_JIT in
+ * z80config.h. Only used by z80emu.c.
+ */
+
+#ifndef __Z80JIT_INCLUDED__
+#define __Z80JIT_INCLUDED__
+
+#include "z80emu.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Executable memory holding the translated blocks of one block cache. */
+
+typedef struct Z80_TRANSLATIONS        Z80_TRANSLATIONS;
+
+/* Allocate an empty arena, or return NULL if blocks can't be translated on
+ * this host.
+ */
+
+extern Z80_TRANSLATIONS *Z80JitCreate (void);
+
+/* Forget all translated blocks, and reuse their memory. */
+
+extern void     Z80JitFlush (Z80_TRANSLATIONS *jit);
+
+extern void     Z80JitDestroy (Z80_TRANSLATIONS *jit);
+
+/* Translate the count instructions of a block, as decoded by
+ * Z80DescribeBlock(), to a function that runs them like a compiled block.
+ * The register tables of state give the registers' offsets. A block is
+ * translated up to its first instruction that can't be, which the function
+ * leaves pc on. Returns NULL if that is the first one or the arena is full.
+ */
+
+extern Z80_COMPILED_FUNCTION    Z80JitTranslate (Z80_TRANSLATIONS *jit,
+                                        const Z80_STATE *state,
+                                        const Z80_BLOCK_INSTRUCTION *instructions,
+                                        int count,
+                                        void *context);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -11,6 +11,7 @@
 #define __Z80USER_INCLUDED__
 
 #include <stdint.h>
+#include <string.h>
 #include <assert.h>
 
 #ifdef __cplusplus
@@ -91,14 +92,28 @@ extern "C" {
 extern void cv_out_byte(void *context, uint16_t address, uint8_t data);
 extern uint8_t cv_in_byte(void *context, uint16_t address);
 
+/* Same as count calls to cv_out_byte() or cv_in_byte() for a VDP data port. */
+extern void cv_out_block(void *context, uint16_t address, const uint8_t *data, int count);
+extern void cv_in_block(void *context, uint16_t address, uint8_t *data, int count);
+
 #define RAM_START 0x6000
 #define RAM_LENGTH 0x2000
 #define RAM_ADDRESS_MASK 0x07FF
 
+/* The 64K address space is decoded through per-page tables so that every
+ * memory access is a single index and load.  ROM and unmapped pages have
+ * their write pointer aimed at a sink page, and unmapped pages read as zero.
+ */
+
+#define CV_PAGE_SHIFT 8
+#define CV_PAGE_SIZE (1 << CV_PAGE_SHIFT)
+#define CV_PAGE_OFFSET_MASK (CV_PAGE_SIZE - 1)
+#define CV_PAGE_COUNT (0x10000 >> CV_PAGE_SHIFT)
+
 typedef struct Z80MemoryInfo
 {
     uint16_t start;
-    uint16_t length;
+    uint32_t length;
     uint8_t *bytes;
 } Z80MemoryInfo;
 
@@ -107,122 +122,436 @@ typedef struct ColecovisionContext
     Z80MemoryInfo BIOS;
     Z80MemoryInfo cartridge;
     uint8_t* RAM;
+    uint8_t* read_pages[CV_PAGE_COUNT];     /* host memory backing each page for reads */
+    uint8_t* write_pages[CV_PAGE_COUNT];    /* host memory backing each page for writes */
+    uint8_t unmapped_page[CV_PAGE_SIZE];    /* always zero */
+    uint8_t write_sink[CV_PAGE_SIZE];       /* ignored writes to ROM or unmapped pages land here */
+    uint8_t* banks;                     /* MegaCart ROM, NULL for other cartridges */
+    int bank_count;                     /* 16K banks in the MegaCart ROM */
+    int bank;                           /* bank mapped at 0xC000 */
     void* cvhw;                         /* struct ColecoHW */
-    int64_t* clk;                       /* main CPU clock */
-    int64_t next_field_start_clock;
-    uint32_t clocks_per_retrace;
-    int do_vretrace_work;               /* does main loop need to do retrace work if we return? */
+    long long* clk;                     /* main CPU clock */
     uint32_t* nmi;                      /* NMI signal */
     int nmi_was_issued;                 /* was NMI already asserted? */
     int do_nmi;                         /* does main loop need to call NonMaskableInterrupt? */
+    uint8_t* idle_loop_allowed;         /* per address, if Z80_IDLE_LOOPS may skip the loop there; NULL allows all */
+    long long idle_loop_skips;          /* times Z80_IDLE_LOOPS skipped iterations */
+    long long idle_cycles_skipped;      /* clocks covered by the skipped iterations */
+    void* hle;                          /* struct OS7HLE if Z80_HLE runs BIOS routines natively, else NULL */
 } ColecovisionContext;
 
-static inline uint8_t cv_read_byte(void *ctx_, uint32_t address32)
+/* Point every page to unmapped memory: reads return 0 and writes are ignored.
+ * Any MegaCart is forgotten.
+ */
+static inline void cv_clear_pages(ColecovisionContext *ctx)
 {
-    ColecovisionContext *ctx = (ColecovisionContext*)ctx_;
-    uint16_t address = address32 & 0xFFFF;
+    int page;
 
-    if(address >= ctx->cartridge.start && address < ctx->cartridge.start + ctx->cartridge.length) {
-        return ctx->cartridge.bytes[address - ctx->cartridge.start];
-    } else if(address >= ctx->BIOS.start && address < ctx->BIOS.start + ctx->BIOS.length) {
-        return ctx->BIOS.bytes[address - ctx->BIOS.start];
-    } else if(address >= RAM_START && address < RAM_START + RAM_LENGTH) {
-        return ctx->RAM[(address - RAM_START) & RAM_ADDRESS_MASK];
-    } else {
-        return 0;
+    ctx->banks = NULL;
+    ctx->bank_count = 0;
+    ctx->bank = 0;
+    memset(ctx->unmapped_page, 0, sizeof(ctx->unmapped_page));
+    for(page = 0; page < CV_PAGE_COUNT; page++) {
+        ctx->read_pages[page] = ctx->unmapped_page;
+        ctx->write_pages[page] = ctx->write_sink;
     }
 }
 
-#define Z80_READ_BYTE(address32, x) { (x) = cv_read_byte((context), (address32)); }
+/* Map "length" bytes of Z80 address space starting at "start" (both multiples
+ * of CV_PAGE_SIZE) onto "bytes".  Offsets into "bytes" are masked with
+ * "address_mask", which mirrors memory smaller than the window.  If "writable"
+ * is zero, writes to the window are dropped.
+ */
+static inline void cv_map_pages(ColecovisionContext *ctx, uint32_t start, uint32_t length, uint8_t *bytes, uint32_t address_mask, int writable)
+{
+    uint32_t address;
 
-#define Z80_FETCH_BYTE(address32, x)		Z80_READ_BYTE((address32), (x))
+    assert((start & CV_PAGE_OFFSET_MASK) == 0);
+    assert((length & CV_PAGE_OFFSET_MASK) == 0);
 
-static inline uint16_t cv_read_word(void *ctx_, uint32_t address32)
+    for(address = start; address < start + length; address += CV_PAGE_SIZE) {
+        uint8_t *page = bytes + ((address - start) & address_mask);
+        ctx->read_pages[address >> CV_PAGE_SHIFT] = page;
+        ctx->write_pages[address >> CV_PAGE_SHIFT] = writable ? page : ctx->write_sink;
+    }
+}
+
+/* MegaCart cartridges, larger than 32K, are made of 16K banks.  The last bank
+ * is always at 0x8000, and reading from 0xFFC0 up maps the bank numbered by
+ * the low bits of the address at 0xC000.  A switch only repoints the pages of
+ * that window, so other accesses cost the same as with any cartridge.
+ */
+
+#define CV_BANK_SIZE 0x4000
+#define CV_BANK_WINDOW 0xC000
+#define CV_BANK_SELECT 0xFFC0
+
+static inline void cv_map_bank(ColecovisionContext *ctx, int bank)
+{
+    ctx->bank = bank;
+    cv_map_pages(ctx, CV_BANK_WINDOW, CV_BANK_SIZE, ctx->banks + (size_t)bank * CV_BANK_SIZE, 0xFFFF, 0);
+}
+
+/* Map a MegaCart of "bank_count" banks, "banks" holding all of them, with
+ * bank 0 selected.
+ */
+static inline void cv_map_megacart(ColecovisionContext *ctx, uint8_t *banks, int bank_count)
+{
+    ctx->banks = banks;
+    ctx->bank_count = bank_count;
+    cv_map_pages(ctx, 0x8000, CV_BANK_SIZE, banks + (size_t)(bank_count - 1) * CV_BANK_SIZE, 0xFFFF, 0);
+    cv_map_bank(ctx, 0);
+}
+
+/* Switch banks for a read at "address32", from CV_BANK_SELECT up.  Returns
+ * non-zero if another bank was mapped.
+ */
+static inline int cv_select_bank(void *ctx_, uint32_t address32)
 {
     ColecovisionContext *ctx = (ColecovisionContext*)ctx_;
-    uint16_t address = (address32) & 0xFFFF;
-
-    if(address >= ctx->cartridge.start && (address + 1) < ctx->cartridge.start + ctx->cartridge.length) {
-        return ctx->cartridge.bytes[address - ctx->cartridge.start] |
-                (ctx->cartridge.bytes[address + 1 - ctx->cartridge.start] << 8);
-    } else if(address >= ctx->BIOS.start && (address + 1) < ctx->BIOS.start + ctx->BIOS.length) {
-        return ctx->BIOS.bytes[address - ctx->BIOS.start] |
-                (ctx->BIOS.bytes[address + 1 - ctx->BIOS.start] << 8);
-    } else if(address >= RAM_START && (address + 1) < RAM_START + RAM_LENGTH) {
-        return ctx->RAM[(address - RAM_START) & RAM_ADDRESS_MASK] |
-                (ctx->RAM[(address + 1 - RAM_START) & RAM_ADDRESS_MASK] << 8);
-    } else {
+    int bank;
+
+    if(ctx->bank_count == 0) {
         return 0;
     }
+    bank = ((address32 & 0xFFFF) - CV_BANK_SELECT) % ctx->bank_count;
+    if(bank == ctx->bank) {
+        return 0;
+    }
+    cv_map_bank(ctx, bank);
+    return 1;
+}
+
+/* Reads memory without side effects, as fetches, the debugger, and the block
+ * decoders do.
+ */
+static inline uint8_t cv_read_byte(void *ctx_, uint32_t address32)
+{
+    ColecovisionContext *ctx = (ColecovisionContext*)ctx_;
+    uint16_t address = address32 & 0xFFFF;
+
+    return ctx->read_pages[address >> CV_PAGE_SHIFT][address & CV_PAGE_OFFSET_MASK];
+}
+
+/* Data reads by the program also switch MegaCart banks.  A switch stops the
+ * emulation, for the main loop to change to the bank's block cache.  The
+ * address is evaluated once, before x is set, since LD L,(HL) and LD H,(HL)
+ * read into a register the address is made of.
+ */
+#define Z80_READ_BYTE(address32, x) \
+{ \
+    uint32_t read_address = (address32); \
+    (x) = cv_read_byte((context), read_address); \
+    if((read_address & 0xFFFF) >= CV_BANK_SELECT) { \
+        if(cv_select_bank((context), read_address)) { \
+            number_cycles = 0; /* cause Emulate to stop loop and return */ \
+        } \
+    } \
 }
 
-#define Z80_READ_WORD(address32, x) { (x) = cv_read_word((context), (address32)); }
+#define Z80_FETCH_BYTE(address32, x)		{ (x) = cv_read_byte((context), (address32)); }
 
-#define Z80_READ_WORD_INTERRUPT(address32, x)	Z80_READ_WORD((address32), (x))
+/* Two byte accesses so that words straddling a page or region boundary, or
+ * wrapping at 0xFFFF, decode each byte on its own.
+ */
+static inline uint16_t cv_read_word(void *ctx_, uint32_t address32)
+{
+    return cv_read_byte(ctx_, address32) | (cv_read_byte(ctx_, address32 + 1) << 8);
+}
 
-#define Z80_FETCH_WORD(address32, x)		Z80_READ_WORD((address32), (x))
+#define Z80_READ_WORD(address32, x) \
+{ \
+    uint8_t low_byte, high_byte; \
+    Z80_READ_BYTE((address32), low_byte); \
+    Z80_READ_BYTE((address32) + 1, high_byte); \
+    (x) = low_byte | (high_byte << 8); \
+}
+
+#define Z80_READ_WORD_INTERRUPT(address32, x)	{ (x) = cv_read_word((context), (address32)); }
+
+#define Z80_FETCH_WORD(address32, x)		{ (x) = cv_read_word((context), (address32)); }
 
 static inline void cv_write_byte(void *ctx_, uint32_t address32, uint8_t byte)
 {
     ColecovisionContext *ctx = (ColecovisionContext*)ctx_;
+    uint16_t address = address32 & 0xFFFF;
 
-    uint16_t address = (address32) & 0xFFFF;
-
-    if(address >= RAM_START && address < RAM_START + RAM_LENGTH) {
-        ctx->RAM[(address - RAM_START) & RAM_ADDRESS_MASK] = byte;
-    }
+    ctx->write_pages[address >> CV_PAGE_SHIFT][address & CV_PAGE_OFFSET_MASK] = byte;
 }
 
 #define Z80_WRITE_BYTE(address32, x) { cv_write_byte((context), (address32), (x)); }
 
 static inline void cv_write_word(void *ctx_, uint32_t address32, uint16_t word)
 {
-    ColecovisionContext *ctx = (ColecovisionContext*)ctx_;
-    uint16_t address = (address32) & 0xFFFF;
-
-    if(address >= RAM_START && (address + 1) < RAM_START + RAM_LENGTH) {
-        ctx->RAM[(address - RAM_START) & RAM_ADDRESS_MASK] = word & 0xff;
-        ctx->RAM[(address + 1 - RAM_START) & RAM_ADDRESS_MASK] = (word >> 8) & 0xff;
-    }
+    cv_write_byte(ctx_, address32, word & 0xff);
+    cv_write_byte(ctx_, address32 + 1, (word >> 8) & 0xff);
 }
 
 #define Z80_WRITE_WORD(address32, x) { cv_write_word((context), (address32), (x)); }
 
 #define Z80_WRITE_WORD_INTERRUPT(address32, x)	Z80_WRITE_WORD((address32), (x))
 
-#define Z80_INPUT_BYTE(port16, x) { (x) = cv_in_byte((context), (port16)); }
+/* The NMI line follows the VDP's interrupt output, which only changes at
+ * vertical retrace, handled by the main loop between calls to Z80Emulate, and
+ * on accesses to the VDP ports.  Its rising edge is looked for after each
+ * input and output instead of after every instruction, and stops the
+ * emulation right after the instruction for the main loop to issue the NMI.
+ * Returns non-zero on a rising edge.
+ */
+static inline int cv_check_nmi(void *ctx_)
+{
+    ColecovisionContext *ctx = (ColecovisionContext*)ctx_;
 
-#define Z80_OUTPUT_BYTE(port16, x) { cv_out_byte((context), (port16), (x)); }
+    if(*ctx->nmi) {
+        if(!ctx->nmi_was_issued) {
+            ctx->nmi_was_issued = 1;
+            ctx->do_nmi = 1;
+            return 1;
+        }
+    } else {
+        ctx->nmi_was_issued = 0;
+    }
+    return 0;
+}
 
-// process the number of clocks emulated
-#define Z80_PROCESS_CYCLES(cycles) \
+#define Z80_INPUT_BYTE(port16, x) \
 { \
-    int return_early = 0; \
-    ColecovisionContext *ctx = (ColecovisionContext*)(context); \
-\
-    /* Check to see if main loop needs to perform scanout */ \
-    if((*ctx->clk) + (cycles) > ctx->next_field_start_clock) { \
-        ctx->do_vretrace_work = 1; \
-        ctx->next_field_start_clock += ctx->clocks_per_retrace; \
-        return_early = 1; \
-    } \
-\
-    /* Check to see if main loop needs to perform NonMaskableInterrupt */ \
-    if(*ctx->nmi) { \
-        if(!ctx->nmi_was_issued) { \
-            ctx->nmi_was_issued = 1; \
-            ctx->do_nmi = 1; \
-            return_early = 1; \
-        } \
-    } else { \
-        ctx->nmi_was_issued = 0; \
+    (x) = cv_in_byte((context), (port16)); \
+    if(cv_check_nmi(context)) { \
+        number_cycles = 0; /* cause Emulate to stop loop and return */ \
     } \
-\
-    if(return_early) { \
+}
+
+#define Z80_OUTPUT_BYTE(port16, x) \
+{ \
+    cv_out_byte((context), (port16), (x)); \
+    if(cv_check_nmi(context)) { \
         number_cycles = 0; /* cause Emulate to stop loop and return */ \
     } \
 }
 
+/* Z80_BLOCK_TRANSFERS hands the iterations of LDIR, LDDR, INIR, INDR, OTIR,
+ * and OTDR that run before the next check of number_cycles to the functions
+ * below at once.  Copies go a page at a time, with memmove() when that gives
+ * the same bytes as copying them one after the other.  Reads from
+ * CV_BANK_SELECT up go a byte at a time and switch MegaCart banks like
+ * Z80_READ_BYTE, stopping after the byte that does.  Each returns the number
+ * of iterations run.
+ */
+static inline int cv_copy_block(void *ctx_, int destination, int source, int count, int direction, int *x, int *number_cycles)
+{
+    ColecovisionContext *ctx = (ColecovisionContext*)ctx_;
+    int done = 0;
+
+    while(done < count) {
+        uint16_t from = source & 0xFFFF;
+        uint16_t to = destination & 0xFFFF;
+        int from_left = (direction > 0) ? CV_PAGE_SIZE - (from & CV_PAGE_OFFSET_MASK) : (from & CV_PAGE_OFFSET_MASK) + 1;
+        int to_left = (direction > 0) ? CV_PAGE_SIZE - (to & CV_PAGE_OFFSET_MASK) : (to & CV_PAGE_OFFSET_MASK) + 1;
+        int chunk = count - done;
+        uint8_t *from_bytes, *to_bytes;
+        int i;
+
+        if((ctx->bank_count != 0) && (from >= CV_BANK_SELECT)) {
+            *x = cv_read_byte(ctx_, from);
+            cv_write_byte(ctx_, to, *x);
+            source += direction;
+            destination += direction;
+            done++;
+            if(cv_select_bank(ctx_, from)) {
+                *number_cycles = 0;
+                break;
+            }
+            continue;
+        }
+
+        if(chunk > from_left) {
+            chunk = from_left;
+        }
+        if(chunk > to_left) {
+            chunk = to_left;
+        }
+        if((ctx->bank_count != 0) && (direction > 0) && (chunk > CV_BANK_SELECT - from)) {
+            chunk = CV_BANK_SELECT - from;
+        }
+
+        /* Lowest address of the chunk in both */
+        from_bytes = ctx->read_pages[from >> CV_PAGE_SHIFT] + (from & CV_PAGE_OFFSET_MASK);
+        to_bytes = ctx->write_pages[to >> CV_PAGE_SHIFT] + (to & CV_PAGE_OFFSET_MASK);
+        if(direction < 0) {
+            from_bytes -= chunk - 1;
+            to_bytes -= chunk - 1;
+        }
+
+        /* Copying in the other direction than memmove() repeats bytes */
+        if((direction > 0) ? ((to_bytes > from_bytes) && (to_bytes < from_bytes + chunk))
+                           : ((to_bytes < from_bytes) && (to_bytes + chunk > from_bytes))) {
+            for(i = 0; i < chunk; i++) {
+                if(direction > 0) {
+                    to_bytes[i] = from_bytes[i];
+                } else {
+                    to_bytes[chunk - 1 - i] = from_bytes[chunk - 1 - i];
+                }
+            }
+        } else {
+            memmove(to_bytes, from_bytes, chunk);
+        }
+        *x = (direction > 0) ? to_bytes[chunk - 1] : to_bytes[0];
+
+        source += direction * chunk;
+        destination += direction * chunk;
+        done += chunk;
+    }
+    return done;
+}
+
+#define Z80_COPY_BLOCK(destination, source, count, direction, done, x) \
+{ \
+    (done) = cv_copy_block((context), (destination), (source), (count), (direction), &(x), &number_cycles); \
+}
+
+static inline int cv_vdp_data_port(int port)
+{
+    port &= 0xFF;
+    return (port >= 0xA0) && (port <= 0xBF) && !(port & 0x1);
+}
+
+/* Other ports than the VDP's data port go a byte at a time, stopping at the
+ * byte raising the NMI like Z80_OUTPUT_BYTE and Z80_INPUT_BYTE would.
+ */
+static inline int cv_output_block(void *ctx_, int port, int source, int count, int direction, int *x, int *number_cycles)
+{
+    uint8_t bytes[256];
+    int i;
+
+    assert((count > 0) && (count <= 256));
+    for(i = 0; i < count; i++) {
+        uint16_t from = (source + i * direction) & 0xFFFF;
+
+        bytes[i] = cv_read_byte(ctx_, from);
+        if((from >= CV_BANK_SELECT) && cv_select_bank(ctx_, from)) {
+            *number_cycles = 0;
+            count = i + 1;
+            break;
+        }
+    }
+    if(cv_vdp_data_port(port)) {
+        cv_out_block(ctx_, port, bytes, count);
+        *x = bytes[count - 1];
+        return count;
+    }
+    for(i = 0; i < count; i++) {
+        cv_out_byte(ctx_, port, bytes[i]);
+        if(cv_check_nmi(ctx_)) {
+            *number_cycles = 0;
+            i++;
+            break;
+        }
+    }
+    *x = bytes[i - 1];
+    return i;
+}
+
+#define Z80_OUTPUT_BLOCK(port16, source, count, direction, done, x) \
+{ \
+    (done) = cv_output_block((context), (port16), (source), (count), (direction), &(x), &number_cycles); \
+}
+
+static inline int cv_input_block(void *ctx_, int port, int destination, int count, int direction, int *x, int *number_cycles)
+{
+    uint8_t bytes[256];
+    int i, done;
+
+    assert((count > 0) && (count <= 256));
+    if(cv_vdp_data_port(port)) {
+        cv_in_block(ctx_, port, bytes, count);
+        done = count;
+    } else {
+        for(done = 0; done < count; ) {
+            bytes[done++] = cv_in_byte(ctx_, port);
+            if(cv_check_nmi(ctx_)) {
+                *number_cycles = 0;
+                break;
+            }
+        }
+    }
+    for(i = 0; i < done; i++) {
+        cv_write_byte(ctx_, destination + i * direction, bytes[i]);
+    }
+    *x = bytes[done - 1];
+    return done;
+}
+
+#define Z80_INPUT_BLOCK(port16, destination, count, direction, done, x) \
+{ \
+    (done) = cv_input_block((context), (port16), (destination), (count), (direction), &(x), &number_cycles); \
+}
+
+/* Code is cacheable by Z80_BLOCK_CACHE on pages that drop writes: ROM, and
+ * unmapped pages, which always read as zero.
+ */
+static inline int cv_code_is_cacheable(void *ctx_, uint32_t address32)
+{
+    ColecovisionContext *ctx = (ColecovisionContext*)ctx_;
+    uint16_t address = address32 & 0xFFFF;
+
+    return ctx->write_pages[address >> CV_PAGE_SHIFT] == ctx->write_sink;
+}
+
+#define Z80_CODE_IS_CACHEABLE(address32) cv_code_is_cacheable((context), (address32))
+
+/* Idle loops skipped by Z80_IDLE_LOOPS may poll the VDP status register:
+ * reading it again only returns the same value until the next field, and the
+ * main loop never runs Z80Emulate past the vertical retrace.  The controllers
+ * are left out since the platform may update their state at any time.
+ */
+static inline int cv_idle_input(void *ctx_, int port)
+{
+    (void)ctx_;
+    port &= 0xFF;
+    return (port >= 0xA0) && (port <= 0xBF) && (port & 0x1);
+}
+
+#define Z80_IDLE_INPUT(port) cv_idle_input((context), (port))
+
+static inline int cv_idle_loop_allowed(void *ctx_, int address)
+{
+    ColecovisionContext *ctx = (ColecovisionContext*)ctx_;
+
+    return (ctx->idle_loop_allowed == NULL) || ctx->idle_loop_allowed[address & 0xFFFF];
+}
+
+#define Z80_IDLE_LOOP_ALLOWED(address) cv_idle_loop_allowed((context), (address))
+
+static inline void cv_idle_loop_skipped(void *ctx_, int address, int cycles)
+{
+    ColecovisionContext *ctx = (ColecovisionContext*)ctx_;
+
+    (void)address;
+    ctx->idle_loop_skips++;
+    ctx->idle_cycles_skipped += cycles;
+}
+
+#define Z80_IDLE_LOOP_SKIPPED(address, cycles) cv_idle_loop_skipped((context), (address), (cycles))
+
+/* Z80_HLE hands calls into the BIOS to cv_hle_routine(), which runs the 
+ * routine at *pc natively if it knows it and it would end before the next
+ * vertical retrace, returning from it with *pc and *r updated.  Returns the
+ * cycles the routine took, or zero to have its code emulated.  The routine 
+ * may end past number_cycles, delaying the main loop's other events, none of
+ * which the routines depend on.
+ */
+struct Z80_STATE;
+
+extern int cv_hle_routine(void *context, struct Z80_STATE *state, int *pc, int *r, int elapsed_cycles);
+
+#define Z80_HLE_ROUTINE() \
+{ \
+    if((((ColecovisionContext*)(context))->hle != NULL) && ((pc & 0xFFFF) < 0x2000)) { \
+        elapsed_cycles += cv_hle_routine((context), state, &pc, &r, elapsed_cycles); \
+    } \
+}
+
 #ifdef __cplusplus
 }
 #endif